@@ -10,18 +10,128 @@
  */
 
 #include "db/rq/data_model.h"
+
+#include <set>
+
 #include "db/util/transform.h"
 
 namespace open_edi {
 namespace db {
 
-void DataModel::importAllGeometries()
+// owners per import task, small enough to balance big and small nets
+static const int kImportChunk = 256;
+
+// Owners are collected first so that chunks of them can be imported on the
+// executor, each chunk into its own buffer. Taken in chunk order, the
+// buffers hold exactly what a sequential import would.
+void DataModel::importGeometryChunks(RQExecutor *executor,
+                                     std::vector<std::vector<LRect> > &chunks,
+                                     LInstances *instances)
+{
+    std::vector<ObjectId> owners;
+    _collectRoutingBlockages(owners);
+    _collectIOPins(owners);
+    _collectInstances(owners);
+    _collectRNets(owners);
+    _collectSNets(owners);
+
+    int num_chunks = (owners.size() + kImportChunk - 1) / kImportChunk;
+    chunks.assign(num_chunks, std::vector<LRect>());
+    if (instances) {
+        instances->cell_shapes_.clear();
+        instances->placements_.assign(num_chunks, std::vector<LPlacement>());
+    }
+    RQExecutor::Task import_chunk = [&](int chunk, int thread_id) {
+        int end = std::min<size_t>((size_t)(chunk + 1) * kImportChunk, owners.size());
+        for (int i = chunk * kImportChunk; i < end; i++) {
+            Object *obj = instances ? Object::addr<Object>(owners[i]) : nullptr;
+            if (obj && obj->getObjectType() == kObjectTypeInst &&
+                _placeInstance(Object::addr<Inst>(owners[i]), instances->placements_[chunk])) {
+                continue;
+            }
+            _importOwner(owners[i], chunks[chunk]);
+        }
+    };
+    if (executor) {
+        executor->parallelFor(num_chunks, import_chunk);
+    } else {
+        for (int i = 0; i < num_chunks; i++) import_chunk(i, 0);
+    }
+    if (!instances) return;
+
+    // every master once, in the order its first instance comes
+    std::vector<ObjectId> masters;
+    std::set<ObjectId> seen;
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        const std::vector<LPlacement> &placements = instances->placements_[chunk];
+        for (unsigned int i = 0; i < placements.size(); i++) {
+            if (seen.insert(placements[i].cell_).second) {
+                masters.push_back(placements[i].cell_);
+            }
+        }
+    }
+    for (unsigned int i = 0; i < masters.size(); i++) {
+        _importMaster(Object::addr<Cell>(masters[i]), instances->cell_shapes_);
+    }
+}
+
+void DataModel::importAllGeometries(RQExecutor *executor)
 {
-    _importRoutingBlockages();
-    _importIOPins();
-    _importInstances();
-    _importRNets();
-    _importSNets();
+    std::vector<std::vector<LRect> > chunks;
+    importGeometryChunks(executor, chunks);
+    int num_chunks = chunks.size();
+    std::vector<size_t> offsets(num_chunks + 1, 0);
+    for (int i = 0; i < num_chunks; i++) {
+        offsets[i + 1] = offsets[i] + chunks[i].size();
+    }
+    geometries_.resize(offsets[num_chunks]);
+    RQExecutor::Task merge_chunk = [&](int chunk, int thread_id) {
+        std::copy(chunks[chunk].begin(), chunks[chunk].end(),
+                  geometries_.begin() + offsets[chunk]);
+        std::vector<LRect>().swap(chunks[chunk]);
+    };
+    if (executor) {
+        executor->parallelFor(num_chunks, merge_chunk);
+    } else {
+        for (int i = 0; i < num_chunks; i++) merge_chunk(i, 0);
+    }
+}
+
+bool DataModel::importObject(ObjectId owner)
+{
+    return _importOwner(owner, geometries_);
+}
+
+bool DataModel::_importOwner(ObjectId owner, std::vector<LRect> &geometries)
+{
+    Object *obj = Object::addr<Object>(owner);
+    if (!obj) {
+        return false;
+    }
+    switch (obj->getObjectType()) {
+        case kObjectTypeInst:
+            _importInstance(Object::addr<Inst>(owner), geometries);
+            return true;
+        case kObjectTypeNet:
+            _importRNet(Object::addr<Net>(owner), geometries);
+            return true;
+        case kObjectTypeSpecialNet:
+            _importSNet(Object::addr<SpecialNet>(owner), geometries);
+            return true;
+        case kObjectTypePin:
+            _importIOPin(Object::addr<Pin>(owner), geometries);
+            return true;
+        case kObjectTypePhysicalConstraint:
+            _importRoutingBlockage(Object::addr<Constraint>(owner), geometries);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void DataModel::clear()
+{
+    std::vector<LRect>().swap(geometries_);
 }
 
 std::vector<LRect> &DataModel::getGeometries()
@@ -29,7 +139,7 @@ std::vector<LRect> &DataModel::getGeometries()
     return geometries_;
 }
 
-void DataModel::_importRoutingBlockages()
+void DataModel::_collectRoutingBlockages(std::vector<ObjectId> &owners)
 {
     Cell* top_cell = getTopCell();
     ObjectId route_blockages = top_cell->getFloorplan()->getRouteBlockages();
@@ -44,19 +154,26 @@ void DataModel::_importRoutingBlockages()
             if (!route_blockage) {
                 continue;
             }
-            if (!route_blockage->hasLayer()) {
-                continue;
-            }
-            LayerGeometry *lg = route_blockage->getLayerGeometry();
-            if (!lg) {
-                continue;
-            }
-            _importLayerGeometry(lg, 0);
+            owners.push_back(route_blockage->getId());
         }
     }
 }
 
-void DataModel::_importIOPins()
+void DataModel::_importRoutingBlockage(Constraint *route_blockage,
+                                       std::vector<LRect> &geometries)
+{
+    if (!route_blockage->hasLayer()) {
+        return;
+    }
+    LayerGeometry *lg = route_blockage->getLayerGeometry();
+    if (!lg) {
+        return;
+    }
+    _importLayerGeometry(lg, 0, route_blockage->getId(), route_blockage->getId(),
+                         kRQShapeRoutingBlockage, geometries);
+}
+
+void DataModel::_collectIOPins(std::vector<ObjectId> &owners)
 {
     Cell* top_cell = getTopCell();
     for (int i = 0; i < top_cell->getNumOfIOPins(); i++) {
@@ -64,20 +181,26 @@ void DataModel::_importIOPins()
         if (!pin) {
             continue;
         }
-        Term *term = pin->getTerm();
-        for (int i = 0; i < term->getPortNum(); i++) {
-            Port *p = term->getPort(i);
-            if (p->getLayerGeometryNum() > 0) {
-                for (int j = 0; j < p->getLayerGeometryNum(); j++) {
-                    LayerGeometry *lg = p->getLayerGeometry(j);
-                    _importLayerGeometry(lg, 0);
-                }
+        owners.push_back(pin->getId());
+    }
+}
+
+void DataModel::_importIOPin(Pin *pin, std::vector<LRect> &geometries)
+{
+    Term *term = pin->getTerm();
+    for (int i = 0; i < term->getPortNum(); i++) {
+        Port *p = term->getPort(i);
+        if (p->getLayerGeometryNum() > 0) {
+            for (int j = 0; j < p->getLayerGeometryNum(); j++) {
+                LayerGeometry *lg = p->getLayerGeometry(j);
+                _importLayerGeometry(lg, 0, pin->getId(), pin->getId(), kRQShapeIOPin,
+                                     geometries);
             }
         }
     }
 }
 
-void DataModel::_importInstances()
+void DataModel::_collectInstances(std::vector<ObjectId> &owners)
 {
     Cell* top_cell = getTopCell();
     uint64_t num_components = top_cell->getNumOfInsts();
@@ -93,30 +216,85 @@ void DataModel::_importInstances()
         if (!instance) {
             continue;
         }
-        Cell *cell = instance->getMaster();
-        if (!cell) {
-            continue;
-        }
-        for (int i = 0; i < cell->getNumOfTerms(); i++) {
-            Term *term = cell->getTerm(i);
-            for (int i = 0; i < term->getPortNum(); i++) {
-                Port *p = term->getPort(i);
-                if (p->getLayerGeometryNum() > 0) {
-                    for (int j = 0; j < p->getLayerGeometryNum(); j++) {
-                        LayerGeometry *lg = p->getLayerGeometry(j);
-                        _importLayerGeometry(lg, instance);
-                    }
+        owners.push_back(instance->getId());
+    }
+}
+
+void DataModel::_importInstance(Inst *instance, std::vector<LRect> &geometries)
+{
+    Cell *cell = instance->getMaster();
+    if (!cell) {
+        return;
+    }
+    for (int i = 0; i < cell->getNumOfTerms(); i++) {
+        Term *term = cell->getTerm(i);
+        for (int i = 0; i < term->getPortNum(); i++) {
+            Port *p = term->getPort(i);
+            if (p->getLayerGeometryNum() > 0) {
+                for (int j = 0; j < p->getLayerGeometryNum(); j++) {
+                    LayerGeometry *lg = p->getLayerGeometry(j);
+                    _importLayerGeometry(lg, instance, instance->getId(), term->getId(),
+                                         kRQShapeInstPin, geometries);
                 }
             }
         }
-        for (int i = 0; i < cell->getOBSSize(); i++) {
-            LayerGeometry *lg = cell->getOBS(i);
-            _importLayerGeometry(lg, instance);
+    }
+    for (int i = 0; i < cell->getOBSSize(); i++) {
+        LayerGeometry *lg = cell->getOBS(i);
+        _importLayerGeometry(lg, instance, instance->getId(), cell->getId(),
+                             kRQShapeInstObs, geometries);
+    }
+}
+
+// The orientation is read off the transform of the unit vectors, so it
+// follows transformByInst whatever the Orient.
+bool DataModel::_placeInstance(Inst *instance, std::vector<LPlacement> &placements)
+{
+    Cell *cell = instance->getMaster();
+    if (!cell) {
+        return false;
+    }
+    Transform transform(instance);
+    Point origin(0, 0), unit_x(1, 0), unit_y(0, 1);
+    transform.transform(origin);
+    transform.transform(unit_x);
+    transform.transform(unit_y);
+    int ax = unit_x.getX() - origin.getX(), ay = unit_x.getY() - origin.getY();
+    int bx = unit_y.getX() - origin.getX(), by = unit_y.getY() - origin.getY();
+    LPlacement placement;
+    placement.inst_ = instance->getId();
+    placement.cell_ = cell->getId();
+    if (ax != 0) {
+        placement.orient_ = (ax < 0 ? 2 : 0) | (by < 0 ? 4 : 0);
+    } else {
+        placement.orient_ = 1 | (bx < 0 ? 2 : 0) | (ay < 0 ? 4 : 0);
+    }
+    placement.x_ = origin.getX();
+    placement.y_ = origin.getY();
+    placements.push_back(placement);
+    return true;
+}
+
+// the shapes _importInstance would produce, left in the master's frame
+void DataModel::_importMaster(Cell *cell, std::vector<LRect> &geometries)
+{
+    for (int i = 0; i < cell->getNumOfTerms(); i++) {
+        Term *term = cell->getTerm(i);
+        for (int i = 0; i < term->getPortNum(); i++) {
+            Port *p = term->getPort(i);
+            for (int j = 0; j < p->getLayerGeometryNum(); j++) {
+                _importLayerGeometry(p->getLayerGeometry(j), 0, cell->getId(), term->getId(),
+                                     kRQShapeInstPin, geometries);
+            }
         }
     }
+    for (int i = 0; i < cell->getOBSSize(); i++) {
+        _importLayerGeometry(cell->getOBS(i), 0, cell->getId(), cell->getId(),
+                             kRQShapeInstObs, geometries);
+    }
 }
 
-void DataModel::_importRNets()
+void DataModel::_collectRNets(std::vector<ObjectId> &owners)
 {
     Cell* top_cell = getTopCell();
     int nets_num = top_cell->getNumOfNets();
@@ -129,62 +307,67 @@ void DataModel::_importRNets()
         if (!net) {
             continue;
         }
-        if (net->getIsBusNet()) {
-            continue;
-        }
-        ArrayObject<ObjectId>* wire_vector = net->getWireArray();
-        if (wire_vector) {
-            for (ArrayObject<ObjectId>::iterator iter = wire_vector->begin();
-                 iter != wire_vector->end(); ++iter) {
-                Wire* wire = nullptr;
-                ObjectId id = (*iter);
-                if (id) {
-                    wire = Object::addr<Wire>(id);
-                }
-                if (wire) {
-                    _importWire(wire);
-                }
+        owners.push_back(net->getId());
+    }
+}
+
+void DataModel::_importRNet(Net *net, std::vector<LRect> &geometries)
+{
+    if (net->getIsBusNet()) {
+        return;
+    }
+    ArrayObject<ObjectId>* wire_vector = net->getWireArray();
+    if (wire_vector) {
+        for (ArrayObject<ObjectId>::iterator iter = wire_vector->begin();
+             iter != wire_vector->end(); ++iter) {
+            Wire* wire = nullptr;
+            ObjectId id = (*iter);
+            if (id) {
+                wire = Object::addr<Wire>(id);
             }
-        }
-        ArrayObject<ObjectId>* via_vector = net->getViaArray();
-        if (via_vector) {
-            for (ArrayObject<ObjectId>::iterator iter = via_vector->begin();
-                 iter != via_vector->end(); ++iter) {
-                Via* via = nullptr;
-                ObjectId id = (*iter);
-                if (id) {
-                    via = Object::addr<Via>(id);
-                }
-                if (via) {
-                    _importVia(via);
-                }
+            if (wire) {
+                _importWire(wire, net->getId(), geometries);
             }
         }
-        // patch
-        ObjectId patches = 0;
-        auto search = getPatchMap().find(net->getId());
-        if (search != getPatchMap().end()) {
-            patches = search->second;
+    }
+    ArrayObject<ObjectId>* via_vector = net->getViaArray();
+    if (via_vector) {
+        for (ArrayObject<ObjectId>::iterator iter = via_vector->begin();
+             iter != via_vector->end(); ++iter) {
+            Via* via = nullptr;
+            ObjectId id = (*iter);
+            if (id) {
+                via = Object::addr<Via>(id);
+            }
+            if (via) {
+                _importVia(via, net->getId(), geometries);
+            }
         }
-        if (patches) {
-            ArrayObject<ObjectId>* patch_vector =
-                Object::addr<ArrayObject<ObjectId>>(patches);
-            for (ArrayObject<ObjectId>::iterator iter = patch_vector->begin();
-                 iter != patch_vector->end(); ++iter) {
-                WirePatch* patch = nullptr;
-                ObjectId id = (*iter);
-                if (id) {
-                    patch = Object::addr<WirePatch>(id);
-                }
-                if (patch) {
-                    _importPatch(patch);
-                }
+    }
+    // patch
+    ObjectId patches = 0;
+    auto search = getPatchMap().find(net->getId());
+    if (search != getPatchMap().end()) {
+        patches = search->second;
+    }
+    if (patches) {
+        ArrayObject<ObjectId>* patch_vector =
+            Object::addr<ArrayObject<ObjectId>>(patches);
+        for (ArrayObject<ObjectId>::iterator iter = patch_vector->begin();
+             iter != patch_vector->end(); ++iter) {
+            WirePatch* patch = nullptr;
+            ObjectId id = (*iter);
+            if (id) {
+                patch = Object::addr<WirePatch>(id);
+            }
+            if (patch) {
+                _importPatch(patch, net->getId(), geometries);
             }
         }
     }
 }
 
-void DataModel::_importSNets()
+void DataModel::_collectSNets(std::vector<ObjectId> &owners)
 {
     Cell* top_cell = getTopCell();
     int special_nets_num = top_cell->getNumOfSpecialNets();
@@ -198,38 +381,44 @@ void DataModel::_importSNets()
         if (!special_net) {
             continue;
         }
-        ArrayObject<ObjectId>* wire_vector = special_net->getWireArray();
-        if (wire_vector) {
-            for (ArrayObject<ObjectId>::iterator iter = wire_vector->begin();
-                 iter != wire_vector->end(); ++iter) {
-                Wire* wire = nullptr;
-                ObjectId id = (*iter);
-                if (id) {
-                    wire = Object::addr<Wire>(id);
-                }
-                if (wire) {
-                    _importWire(wire);
-                }
+        owners.push_back(special_net->getId());
+    }
+}
+
+void DataModel::_importSNet(SpecialNet *special_net, std::vector<LRect> &geometries)
+{
+    ArrayObject<ObjectId>* wire_vector = special_net->getWireArray();
+    if (wire_vector) {
+        for (ArrayObject<ObjectId>::iterator iter = wire_vector->begin();
+             iter != wire_vector->end(); ++iter) {
+            Wire* wire = nullptr;
+            ObjectId id = (*iter);
+            if (id) {
+                wire = Object::addr<Wire>(id);
+            }
+            if (wire) {
+                _importWire(wire, special_net->getId(), geometries);
             }
         }
-        ArrayObject<ObjectId>* via_vector = special_net->getWireArray();
-        if (via_vector) {
-            for (ArrayObject<ObjectId>::iterator iter = via_vector->begin();
-                 iter != via_vector->end(); ++iter) {
-                Via* via = nullptr;
-                ObjectId id = (*iter);
-                if (id) {
-                    via = Object::addr<Via>(id);
-                }
-                if (via) {
-                    _importVia(via);
-                }
+    }
+    ArrayObject<ObjectId>* via_vector = special_net->getViaArray();
+    if (via_vector) {
+        for (ArrayObject<ObjectId>::iterator iter = via_vector->begin();
+             iter != via_vector->end(); ++iter) {
+            Via* via = nullptr;
+            ObjectId id = (*iter);
+            if (id) {
+                via = Object::addr<Via>(id);
+            }
+            if (via) {
+                _importVia(via, special_net->getId(), geometries);
             }
         }
     }
 }
 
-void DataModel::_importWire(Wire *wire)
+void DataModel::_importWire(Wire *wire, ObjectId owner,
+                            std::vector<LRect> &geometries)
 {
     int ext = getTopCell()->getTechLib()->getLayer(wire->getLayerNum())->getWidth()/2;
     int x = wire->getX();
@@ -245,10 +434,13 @@ void DataModel::_importWire(Wire *wire)
     LRect rect;
     rect.rect_ = wire_rect;
     rect.layer_id_ = wire->getLayerNum();
-    geometries_.push_back(rect);
+    rect.owner_ = owner;
+    rect.source_ = wire->getId();
+    rect.kind_ = kRQShapeWire;
+    geometries.push_back(rect);
 }
 
-void DataModel::_importVia(Via *via)
+void DataModel::_importVia(Via *via, ObjectId owner, std::vector<LRect> &geometries)
 {
     Point p = via->getLoc();
     int x = p.getX();
@@ -272,14 +464,18 @@ void DataModel::_importVia(Via *via)
                     LRect rect;
                     rect.rect_ = via_rect;
                     rect.layer_id_ = layer_id;
-                    geometries_.push_back(rect);
+                    rect.owner_ = owner;
+                    rect.source_ = via->getId();
+                    rect.kind_ = kRQShapeVia;
+                    geometries.push_back(rect);
                 }
             }
         }
     }
 }
 
-void DataModel::_importPatch(WirePatch *patch)
+void DataModel::_importPatch(WirePatch *patch, ObjectId owner,
+                             std::vector<LRect> &geometries)
 {
     LRect patch_rect;
     patch_rect.rect_.setBox(patch->getX1() + patch->getLocX(),
@@ -287,13 +483,18 @@ void DataModel::_importPatch(WirePatch *patch)
                             patch->getX2() + patch->getLocX(),
                             patch->getY2() + patch->getLocY());
     patch_rect.layer_id_ = patch->getLayerNum();
-    geometries_.push_back(patch_rect);
+    patch_rect.owner_ = owner;
+    patch_rect.source_ = patch->getId();
+    patch_rect.kind_ = kRQShapePatch;
+    geometries.push_back(patch_rect);
 }
 
 // routing blockage needs no transform
 // IO pin has been transformed
 // Instance pin/obs needs to be transformed from cell
-void DataModel::_importLayerGeometry(LayerGeometry *lg, Inst *inst)
+void DataModel::_importLayerGeometry(LayerGeometry *lg, Inst *inst, ObjectId owner,
+                                     ObjectId source, RQShapeKind kind,
+                                     std::vector<LRect> &geometries)
 {
     Layer *layer = lg->getLayer();
     auto iter_box = lg->getBoxIter();
@@ -305,7 +506,10 @@ void DataModel::_importLayerGeometry(LayerGeometry *lg, Inst *inst)
             transformByInst(inst, rect.rect_);
         }
         rect.layer_id_ = layer->getIndexInLef();
-        geometries_.push_back(rect);
+        rect.owner_ = owner;
+        rect.source_ = source;
+        rect.kind_ = kind;
+        geometries.push_back(rect);
     }
 }
 
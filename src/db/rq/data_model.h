@@ -13,6 +13,7 @@
 
 #include "infra/command_manager.h"
 #include "db/core/db.h"
+#include "db/rq/rq_executor.h"
 
 namespace open_edi {
 namespace db {
@@ -20,26 +21,80 @@ namespace db {
 using namespace open_edi::infra;
 using namespace open_edi::db;
 
+// what produced an indexed shape, and so what LRect::source_ refers to
+enum RQShapeKind {
+    kRQShapeWire,             // Wire
+    kRQShapeVia,              // Via
+    kRQShapePatch,            // WirePatch
+    kRQShapeInstPin,          // Term of the master, the owner is the Inst
+    kRQShapeInstObs,          // master Cell, the owner is the Inst
+    kRQShapeIOPin,            // Pin
+    kRQShapeRoutingBlockage,  // Constraint
+    kRQShapeKindNum
+};
+
 struct LRect {
     Box rect_;
     int layer_id_;
+    ObjectId owner_;  // inst, net, special net, io pin or routing blockage
+    ObjectId source_;
+    RQShapeKind kind_;
+};
+
+// An Inst indexed by reference to its master instead of by its shapes: a
+// shape a of the master lands at boxtree::orientRect(a, orient_) moved by
+// (x_, y_), which is what transformByInst does to it.
+struct LPlacement {
+    ObjectId inst_;
+    ObjectId cell_;
+    int orient_;
+    int x_, y_;
+};
+
+// What an instanced import yields besides the flat shapes: the pin and OBS
+// shapes of every master used, once and in the master's frame with the Cell
+// as owner_, and the placements, one vector per chunk.
+struct LInstances {
+    std::vector<LRect> cell_shapes_;
+    std::vector<std::vector<LPlacement> > placements_;
 };
 
 class DataModel {
 
   public:
-    void importAllGeometries();
+    // imports on the executor when one is given
+    void importAllGeometries(RQExecutor *executor = nullptr);
+    // same shapes as importAllGeometries, left in the per-task buffers
+    // instead of being gathered into getGeometries(); given instances, the
+    // instances are placed there instead of being flattened into chunks
+    void importGeometryChunks(RQExecutor *executor, std::vector<std::vector<LRect> > &chunks,
+                              LInstances *instances = nullptr);
+    // imports the current shapes of one owner, returns false for other objects
+    bool importObject(ObjectId owner);
+    void clear();
     std::vector<LRect> &getGeometries();
   protected:
-    void _importRoutingBlockages();
-    void _importIOPins();
-    void _importInstances();
-    void _importLayerGeometry(LayerGeometry *lg, Inst *inst);
-    void _importRNets();
-    void _importSNets();
-    void _importWire(Wire *wire);
-    void _importVia(Via *via);
-    void _importPatch(WirePatch *patch);
+    // the _import helpers only read the db, so they may run concurrently
+    // as long as each thread appends to its own vector
+    bool _importOwner(ObjectId owner, std::vector<LRect> &geometries);
+    void _collectRoutingBlockages(std::vector<ObjectId> &owners);
+    void _importRoutingBlockage(Constraint *route_blockage, std::vector<LRect> &geometries);
+    void _collectIOPins(std::vector<ObjectId> &owners);
+    void _importIOPin(Pin *pin, std::vector<LRect> &geometries);
+    void _collectInstances(std::vector<ObjectId> &owners);
+    void _importInstance(Inst *instance, std::vector<LRect> &geometries);
+    bool _placeInstance(Inst *instance, std::vector<LPlacement> &placements);
+    void _importMaster(Cell *cell, std::vector<LRect> &geometries);
+    void _importLayerGeometry(LayerGeometry *lg, Inst *inst, ObjectId owner,
+                              ObjectId source, RQShapeKind kind,
+                              std::vector<LRect> &geometries);
+    void _collectRNets(std::vector<ObjectId> &owners);
+    void _importRNet(Net *net, std::vector<LRect> &geometries);
+    void _collectSNets(std::vector<ObjectId> &owners);
+    void _importSNet(SpecialNet *special_net, std::vector<LRect> &geometries);
+    void _importWire(Wire *wire, ObjectId owner, std::vector<LRect> &geometries);
+    void _importVia(Via *via, ObjectId owner, std::vector<LRect> &geometries);
+    void _importPatch(WirePatch *patch, ObjectId owner, std::vector<LRect> &geometries);
   private:
     std::vector<LRect> geometries_;
 };
@@ -3,13 +3,8 @@
 namespace boxtree
 {
 
-    rectdb rdb[NUM_TREE];
-    vector<rect> ans[NUM_TREE];
-    int treeorder[NUM_TREE];
-
-    bool cmpbox(rectdb &rdb, int cmptype, int a, int b)
+    static inline bool cmpbox(const rect &ra, const rect &rb, int cmptype)
     {
-        rect &ra=rdb.r[a],&rb=rdb.r[b];
         if (cmptype == 0)
         {
             if (ra.xl != rb.xl) return ra.xl < rb.xl;
@@ -32,152 +27,423 @@ namespace boxtree
         }
         return 0;
     }
-    bool cmporder(int a, int b)
+    static size_t treesize(const rectdb &t)
     {
-        return rdb[a].r.size() > rdb[b].r.size();
+        return t.r.size() + t.size();
     }
-    void qselect(rectdb &rdb, int S, int hh, int tt, int k, int cmptype)
+    // partitions r (and rpayload with it) in place; cmptype is a template
+    // argument so that cmpbox folds into the loops
+    template <int cmptype>
+    static void qselectby(rectdb &rdb, int S, int hh, int tt, int k)
     {
-        int mid = rdb.id[S + hh + ((tt - hh + 1) >> 1)];
-        int i = hh, j = tt;
-        while (i <= j)
+        while (hh < tt)
         {
-            while (cmpbox(rdb, cmptype, rdb.id[S + i], mid))
-                ++i;
-            while (cmpbox(rdb, cmptype, mid, rdb.id[S + j]))
-                --j;
-            if (i <= j)
+            rect mid = rdb.r[S + hh + ((tt - hh + 1) >> 1)];
+            int i = hh, j = tt;
+            while (i <= j)
             {
-                swap(rdb.id[S + i], rdb.id[S + j]);
-                ++i;
-                --j;
+                while (cmpbox(rdb.r[S + i], mid, cmptype))
+                    ++i;
+                while (cmpbox(mid, rdb.r[S + j], cmptype))
+                    --j;
+                if (i <= j)
+                {
+                    swap(rdb.r[S + i], rdb.r[S + j]);
+                    swap(rdb.rpayload[S + i], rdb.rpayload[S + j]);
+                    ++i;
+                    --j;
+                }
             }
+            if (k <= j)
+                tt = j;
+            else if (k >= i)
+                hh = i;
+            else
+                return;
         }
-        if (hh <= j && k <= j)
-            return qselect(rdb, S, hh, j, k, cmptype);
-        if (i <= tt && k >= i)
-            return qselect(rdb, S, i, tt, k, cmptype);
-        return;
     }
-    void allocatetree(std::vector<rect> &rects)
+    static void qselect(rectdb &rdb, int S, int hh, int tt, int k, int cmptype)
     {
-        struct treetype
-        {
-            int size, intth, sth, lastth;
-            double dnum, doubleth;
-        } tt[3];
+        if (cmptype == 0)
+            qselectby<0>(rdb, S, hh, tt, k);
+        else if (cmptype == 1)
+            qselectby<1>(rdb, S, hh, tt, k);
+        else if (cmptype == 2)
+            qselectby<2>(rdb, S, hh, tt, k);
+        else
+            qselectby<3>(rdb, S, hh, tt, k);
+    }
+    // Every rect type gets whole trees in proportion to its share of the
+    // layer. The fractional shares go to the last trees; when they add up to
+    // two trees, the largest one shares the extra tree with its own. Spatial
+    // partitioning then spreads each type evenly over all of its trees.
+    void plantrees(forest &f, const long long count[3], int base, int nth, treeplan &plan,
+                   int partition, const std::vector<uint64_t> *keys)
+    {
+        vector<rectdb> &rdb = f.rdb;
+        long long rsize = count[0] + count[1] + count[2];
+        double sumdouble = 0;
+        plan.base = base;
+        plan.nth = nth;
+        plan.partition = partition;
+        plan.carryextra = 0;
         for (int i = 0; i < 3; i++)
-            tt[i].lastth = tt[i].size = 0;
-        int rsize = rects.size();
-        for (int i = 0; i < rsize; i++)
         {
-            tt[recttype(rects[i])].size++;
+            plan.lastth[i] = 0;
+            plan.carry[i] = 0;
+            plan.intth[i] = nth * count[i] / rsize;
+            plan.doubleth[i] = nth * 1.0 * count[i] / rsize - plan.intth[i];
+            sumdouble += plan.doubleth[i];
         }
-        vector<bool> ped(rsize, 0);
-        double sumdouble = 0;
+        plan.sth[0] = 0;
+        plan.sth[1] = plan.intth[0];
+        plan.sth[2] = plan.sth[1] + plan.intth[1];
         for (int i = 0; i < 3; i++)
+            plan.dnum[i] = plan.doubleth[i] / (plan.intth[i] + plan.doubleth[i]);
+        plan.mixed = sumdouble >= 1.5;
+        if (!plan.mixed)
         {
-            tt[i].intth = NUM_TH * tt[i].size / rsize;
-            tt[i].doubleth = NUM_TH * 1.0 * tt[i].size / rsize - tt[i].intth;
-            sumdouble += tt[i].doubleth;
+            rdb[base + nth - 1].type = 0;
+            rdb[base + nth].type = 1;
+            rdb[base + nth + 1].type = 2;
         }
-        tt[0].sth = 0;
-        tt[1].sth = tt[0].intth;
-        tt[2].sth = tt[1].sth + tt[1].intth;
-        for (int i = 0; i < 3; i++)
-            tt[i].dnum = tt[i].doubleth / (tt[i].intth + tt[i].doubleth);
-        if (sumdouble < 1.5)
+        else
         {
-            rdb[NUM_TH - 1].type = 0;
-            rdb[NUM_TH].type = 1;
-            rdb[NUM_TH + 1].type = 2;
-            for (int i = 0; i < rsize; i++)
+            plan.maxt = 0;
+            plan.t1 = 1;
+            if (plan.doubleth[1] > plan.doubleth[plan.maxt])
             {
-                int t = recttype(rects[i]);
-                if (rand() % 10000 < tt[t].dnum * 10000)
-                {
-                    rdb[NUM_TH - 1 + t].r.push_back(rects[i]);
-                    ped[i] = true;
-                }
+                plan.maxt = 1;
+                plan.t1 = 0;
             }
+            if (plan.doubleth[2] > plan.doubleth[plan.maxt])
+            {
+                plan.maxt = 2;
+                plan.t1 = 0;
+            }
+            rdb[base + nth - 2].type = 0;
+            rdb[base + nth - 1].type = 1;
+            rdb[base + nth].type = 2;
+            rdb[base + nth + 1].type = plan.maxt;
         }
-        else
+        for (int i = plan.sth[0]; i < plan.sth[1]; i++)
+            rdb[base + i].type = 0;
+        for (int i = plan.sth[1]; i < plan.sth[2]; i++)
+            rdb[base + i].type = 1;
+        for (int i = plan.sth[2]; i < plan.sth[2] + plan.intth[2]; i++)
+            rdb[base + i].type = 2;
+        // reserve the expected sizes so the trees are not regrown while placing
+        vector<double> expect(nth + 2, 0);
+        if (partition == PARTITION_SPATIAL)
         {
-            int maxt = 0, t1 = 1, t2 = 2;
-            if (tt[1].doubleth > tt[maxt].doubleth)
+            for (int t = 0; t < 3; t++)
             {
-                maxt = 1;
-                t1 = 0;
-                t2 = 2;
+                plan.tiles[t].clear();
+                plan.bounds[t].clear();
             }
-            if (tt[2].doubleth > tt[maxt].doubleth)
+            for (int i = 0; i < nth + 2; i++)
+                plan.tiles[rdb[base + i].type].push_back(base + i);
+            for (int t = 0; t < 3; t++)
             {
-                maxt = 2;
-                t1 = 0;
-                t2 = 1;
+                int m = plan.tiles[t].size();
+                const vector<uint64_t> &k = keys[t];
+                for (int j = 1; j < m && !k.empty(); j++)
+                    plan.bounds[t].push_back(k[(size_t)j * k.size() / m]);
+                for (int j = 0; j < m; j++)
+                    expect[plan.tiles[t][j] - base] = (double)count[t] / m;
             }
-            rdb[NUM_TH - 2].type = 0;
-            rdb[NUM_TH - 1].type = 1;
-            rdb[NUM_TH].type = 2;
-            rdb[NUM_TH + 1].type = maxt;
-            for (int i = 0; i < rsize; i++)
+        }
+        else
+        {
+            for (int t = 0; t < 3; t++)
             {
-                int t = recttype(rects[i]);
-                if (t == maxt)
+                // dnum is 0 / 0 for a type the layer has none of
+                if (count[t] == 0)
+                    continue;
+                double extra = count[t] * plan.dnum[t];
+                for (int i = 0; i < plan.intth[t]; i++)
+                    expect[plan.sth[t] + i] += (count[t] - extra) / plan.intth[t];
+                if (!plan.mixed)
+                    expect[nth - 1 + t] += extra;
+                else if (t != plan.maxt)
+                    expect[nth - 2 + t] += extra;
+                else
                 {
-                    if (rand() % 10000 < tt[t].dnum * 10000)
-                    {
-                        if (rand() % 10000 < (1 - tt[t1].doubleth) * 10000)
-                            rdb[NUM_TH - 2 + t].r.push_back(rects[i]);
-                        else
-                            rdb[NUM_TH + 1].r.push_back(rects[i]);
-                    }
+                    expect[nth - 2 + t] += extra * (1 - plan.doubleth[plan.t1]);
+                    expect[nth + 1] += extra * plan.doubleth[plan.t1];
                 }
-                else
+            }
+        }
+        for (int i = 0; i < nth + 2; i++)
+        {
+            size_t n = expect[i] * 1.02 + 64;
+            rdb[base + i].r.reserve(n);
+            rdb[base + i].rpayload.reserve(n);
+        }
+    }
+    int picktree(treeplan &plan, const rect &a)
+    {
+        int t = recttype(a);
+        if (plan.partition == PARTITION_SPATIAL)
+        {
+            const vector<uint64_t> &b = plan.bounds[t];
+            return plan.tiles[t][upper_bound(b.begin(), b.end(), rectkey(a)) - b.begin()];
+        }
+        // the fractional shares are handed out by error diffusion, evenly
+        // and the same way on every run
+        int base = plan.base, nth = plan.nth;
+        plan.carry[t] += plan.dnum[t];
+        if (plan.carry[t] >= 1)
+        {
+            plan.carry[t] -= 1;
+            if (!plan.mixed)
+                return base + nth - 1 + t;
+            if (t == plan.maxt)
+            {
+                plan.carryextra += plan.doubleth[plan.t1];
+                if (plan.carryextra >= 1)
                 {
-                    if (rand() % 10000 < tt[t].dnum * 10000)
-                        rdb[NUM_TH - 2 + t].r.push_back(rects[i]);
+                    plan.carryextra -= 1;
+                    return base + nth + 1;
                 }
-                ped[i] = true;
             }
+            return base + nth - 2 + t;
         }
+        int treeid = plan.sth[t] + plan.lastth[t];
+        plan.lastth[t] = (plan.lastth[t] + 1) % plan.intth[t];
+        return base + treeid;
+    }
+    uint64_t rectkey(const rect &a)
+    {
+        // coordinates stay within +-INF < 2^30
+        const long long offset = 1LL << 30, top = (1LL << 31) - 1;
+        long long cx = std::min(std::max(((long long)a.xl + a.xr) / 2 + offset, 0LL), top);
+        long long cy = std::min(std::max(((long long)a.yl + a.yr) / 2 + offset, 0LL), top);
+        return hilbertKey(cx, cy, 31);
+    }
+    void allocatetree(forest &f, std::vector<rect> &rects, std::vector<payload> &payloads, int base, int nth)
+    {
+        vector<rectdb> &rdb = f.rdb;
+        long long count[3] = {0, 0, 0};
+        vector<uint64_t> keys[3];
+        int rsize = rects.size();
         for (int i = 0; i < rsize; i++)
         {
-            if (ped[i])
-                continue;
             int t = recttype(rects[i]);
-            int treeid;
-            treeid = tt[t].sth + tt[t].lastth;
-            tt[t].lastth = (tt[t].lastth + 1) % tt[t].intth;
+            count[t]++;
+            if (f.partition == PARTITION_SPATIAL)
+                keys[t].push_back(rectkey(rects[i]));
+        }
+        for (int t = 0; t < 3; t++)
+            sort(keys[t].begin(), keys[t].end());
+        treeplan plan;
+        plantrees(f, count, base, nth, plan, f.partition, keys);
+        for (int i = 0; i < rsize; i++)
+        {
+            int treeid = picktree(plan, rects[i]);
             rdb[treeid].r.push_back(rects[i]);
+            rdb[treeid].rpayload.push_back(payloads[i]);
         }
-        for (int i = tt[0].sth; i < tt[1].sth; i++)
-            rdb[i].type = 0;
-        for (int i = tt[1].sth; i < tt[2].sth; i++)
-            rdb[i].type = 1;
-        for (int i = tt[2].sth; i < tt[2].sth + tt[2].intth; i++)
-            rdb[i].type = 2;
-        // for (int i=0;i<NUM_TREE;i++)
-        //     printf("tree%d: size=%ld type=%d\n",i,rdb[i].r.size(),rdb[i].type);
-        for (int i = 0; i < NUM_TREE; i++)
-            treeorder[i] = i;
-        sort(treeorder, treeorder + NUM_TREE, cmporder);
         return;
     }
+    void clearForest(forest &f)
+    {
+        f.rdb.clear();
+        f.treeorder.clear();
+        f.layertree.assign(MAX_LAYER_NUM + 1, -1);
+        f.layerlong.assign(MAX_LAYER_NUM + 1, -1);
+        f.layerinst.assign(MAX_LAYER_NUM + 1, -1);
+        f.cells.clear();
+        f.layerdelta.assign(MAX_LAYER_NUM + 1, -1);
+        f.nth = 0;
+        f.layerplan.clear();
+        vector<pair<uint64_t, uint64_t> >().swap(f.ownerindex);
+        f.deltaowner.clear();
+    }
+
+    // layers beyond MAX_LAYER_NUM share the last group and are only reachable by ALL_LAYERS
+    void planForest(forest &f, const std::vector<long long> &count, int num_th,
+                    int partition, std::vector<std::vector<uint64_t> > *keys)
+    {
+        int nth = std::max(num_th, 2);
+        clearForest(f);
+        f.nth = nth;
+        f.partition = keys ? partition : PARTITION_SHARD;
+        f.layerplan.assign(MAX_LAYER_NUM + 1, treeplan());
+        vector<rectdb> &rdb = f.rdb;
+        for (int l = 0; l <= MAX_LAYER_NUM; l++)
+        {
+            const long long *c = &count[l * RECT_CLASSES];
+            if (c[LONG_CLASS] > 0)
+            {
+                // the long tree keeps the box tree whatever the engine, its
+                // split rule is what orders the stripes
+                f.layerlong[l] = rdb.size();
+                rdb.push_back(rectdb());
+                rdb.back().type = LONG_TREE;
+                rdb.back().layer = l;
+                rdb.back().r.reserve(c[LONG_CLASS]);
+                rdb.back().rpayload.reserve(c[LONG_CLASS]);
+            }
+            if (c[INST_CLASS] > 0)
+            {
+                f.layerinst[l] = rdb.size();
+                rdb.push_back(rectdb());
+                rdb.back().type = INST_TREE;
+                rdb.back().layer = l;
+                rdb.back().engine = f.engine;
+                rdb.back().r.reserve(c[INST_CLASS]);
+                rdb.back().rpayload.reserve(c[INST_CLASS]);
+            }
+            if (c[0] + c[1] + c[2] == 0)
+                continue;
+            int base = rdb.size();
+            f.layertree[l] = base;
+            rdb.resize(base + nth + 2);
+            for (int i = 0; i < nth + 2; i++)
+            {
+                rdb[base + i].layer = l;
+                rdb[base + i].ndead = 0;
+                rdb[base + i].engine = f.engine;
+            }
+            vector<uint64_t> *k = nullptr;
+            if (f.partition == PARTITION_SPATIAL)
+            {
+                k = &(*keys)[l * RECT_CLASSES];
+                for (int t = 0; t < 3; t++)
+                    sort(k[t].begin(), k[t].end());
+            }
+            plantrees(f, c, base, nth, f.layerplan[l], f.partition, k);
+        }
+    }
+    void placeShape(forest &f, const rect &a, int layer, const payload &pl)
+    {
+        int l = layerIndex(layer);
+        int treeid = shapeclass(f, a) == LONG_CLASS ? f.layerlong[l] : picktree(f.layerplan[l], a);
+        f.rdb[treeid].r.push_back(a);
+        f.rdb[treeid].rpayload.push_back(pl);
+    }
+    void allocateForest(forest &f, std::vector<rect> &rects, std::vector<int> &layers,
+                        std::vector<payload> &payloads, int num_th, int partition)
+    {
+        vector<long long> count((MAX_LAYER_NUM + 1) * RECT_CLASSES, 0);
+        vector<vector<uint64_t> > keys(count.size());
+        int rsize = rects.size();
+        rect extent = {INF, INF, -INF, -INF};
+        for (int i = 0; i < rsize; i++)
+        {
+            extent.xl = std::min(extent.xl, rects[i].xl);
+            extent.yl = std::min(extent.yl, rects[i].yl);
+            extent.xr = std::max(extent.xr, rects[i].xr);
+            extent.yr = std::max(extent.yr, rects[i].yr);
+        }
+        setLongSide(f, extent);
+        for (int i = 0; i < rsize; i++)
+        {
+            int c = layerIndex(layers[i]) * RECT_CLASSES + shapeclass(f, rects[i]);
+            count[c]++;
+            if (partition == PARTITION_SPATIAL)
+                keys[c].push_back(rectkey(rects[i]));
+        }
+        planForest(f, count, num_th, partition, &keys);
+        for (int i = 0; i < rsize; i++)
+            placeShape(f, rects[i], layers[i], payloads[i]);
+        sortTreeOrder(f);
+        return;
+    }
+    void sortTreeOrder(forest &f)
+    {
+        const vector<rectdb> &rdb = f.rdb;
+        f.treeorder.resize(rdb.size());
+        for (unsigned int i = 0; i < rdb.size(); i++)
+            f.treeorder[i] = i;
+        sort(f.treeorder.begin(), f.treeorder.end(),
+             [&rdb](int a, int b) { return treesize(rdb[a]) > treesize(rdb[b]); });
+    }
+    bool layerSelected(int layer, uint64_t layer_mask)
+    {
+        if (layer_mask == ALL_LAYERS)
+            return true;
+        if (layer >= MAX_LAYER_NUM)
+            return false;
+        return (layer_mask >> layer) & 1;
+    }
+    // selected trees keep the size-descending treeorder so the largest trees start first
+    void selectTrees(const forest &f, uint64_t layer_mask, std::vector<int> &trees)
+    {
+        trees.clear();
+        for (unsigned int i = 0; i < f.treeorder.size(); i++)
+        {
+            const rectdb &t = f.rdb[f.treeorder[i]];
+            if (t.size() > 0 && layerSelected(t.layer, layer_mask))
+                trees.push_back(f.treeorder[i]);
+        }
+    }
+    void selectTrees(const forest &f, uint64_t layer_mask, const rect &boxq, std::vector<int> &trees)
+    {
+        trees.clear();
+        for (unsigned int i = 0; i < f.treeorder.size(); i++)
+        {
+            const rectdb &t = f.rdb[f.treeorder[i]];
+            // a tree without nodes has no box to test
+            if (t.size() > 0 && layerSelected(t.layer, layer_mask) && (!t.indexed() || !outbox(t.box, boxq)))
+                trees.push_back(f.treeorder[i]);
+        }
+    }
     void initBuild(rectdb &rdb)
     {
         int n = rdb.r.size();
-        rdb.id.resize(n);
+        rdb.box = {INF, INF, -INF, -INF};
+        for (int i = 0; i < n; i++)
+        {
+            rdb.box.xl = std::min(rdb.r[i].xl, rdb.box.xl);
+            rdb.box.yl = std::min(rdb.r[i].yl, rdb.box.yl);
+            rdb.box.xr = std::max(rdb.r[i].xr, rdb.box.xr);
+            rdb.box.yr = std::max(rdb.r[i].yr, rdb.box.yr);
+        }
+        rdb.node.clear();
+        rdb.hnode.clear();
+        if (rdb.engine == ENGINE_HRTREE)
+            sortHilbert(rdb);
+        else if (n > 0)
+            buildBOXTree(rdb, 0, n - 1, rdb.box, 1);
+        rdb.node.shrink_to_fit();
+        rdb.xl.resize(n);
+        rdb.yl.resize(n);
+        rdb.xr.resize(n);
+        rdb.yr.resize(n);
+        for (int i = 0; i < n; i++)
+        {
+            const rect &tmp = rdb.r[i];
+            rdb.xl[i] = tmp.xl;
+            rdb.yl[i] = tmp.yl;
+            rdb.xr[i] = tmp.xr;
+            rdb.yr[i] = tmp.yr;
+        }
+        vector<rect>().swap(rdb.r);
+        rdb.owner.resize(n);
+        rdb.source.resize(n);
+        rdb.kind.resize(n);
         for (int i = 0; i < n; i++)
-            rdb.id[i] = i;
-        buildBOXTree(rdb, 1, 0, n - 1);
-        vector<rect> tmprect(n);
-        for (int i=0;i<n;i++)
-            tmprect[i]=rdb.r[rdb.id[i]];
-        for (int i=0;i<n;i++)
-            rdb.r[i]=tmprect[i];
+        {
+            rdb.owner[i] = rdb.rpayload[i].owner;
+            rdb.source[i] = rdb.rpayload[i].source;
+            rdb.kind[i] = rdb.rpayload[i].kind;
+        }
+        vector<payload>().swap(rdb.rpayload);
+        rdb.ndead = 0;
+        if (rdb.engine == ENGINE_HRTREE)
+            buildHRTree(rdb);
+        sumAreas(rdb);
         return;
     }
+    size_t treeMemory(const rectdb &rdb)
+    {
+        return rdb.node.capacity() * sizeof(treenode) + rdb.hnode.capacity() * sizeof(hrnode) +
+               (rdb.xl.capacity() + rdb.yl.capacity() + rdb.xr.capacity() + rdb.yr.capacity()) * sizeof(int) +
+               (rdb.owner.capacity() + rdb.source.capacity()) * sizeof(uint64_t) + rdb.kind.capacity() +
+               rdb.areasum.capacity() * sizeof(long long);
+    }
     int recttype(const rect &a)
     {
         if (a.yr - a.yl >= 4 * (a.xr - a.xl))
@@ -186,6 +452,17 @@ namespace boxtree
             return 1; // h net
         return 2;     //cell
     }
+    int shapeclass(const forest &f, const rect &a)
+    {
+        if (f.longside > 0 && std::max((long long)a.xr - a.xl, (long long)a.yr - a.yl) >= f.longside)
+            return LONG_CLASS;
+        return recttype(a);
+    }
+    void setLongSide(forest &f, const rect &extent)
+    {
+        long long side = std::max((long long)extent.xr - extent.xl, (long long)extent.yr - extent.yl);
+        f.longside = side > 0 ? std::max(side / LONG_RATIO, 1LL) : 0;
+    }
     bool inbox(const rect &a, const rect &b)
     {
         if (a.xl >= b.xl && a.xr <= b.xr && a.yl >= b.yl && a.yr <= b.yr)
@@ -198,79 +475,381 @@ namespace boxtree
             return true;
         return false;
     }
-    void binitBOXTreeNode(rectdb &rdb, int s, int L, int R)
+    // floor for the low side and ceil for the high side, so the decoded box covers b
+    treenode encodenode(const rect &p, const rect &b)
     {
-        while (rdb.node.size() < s + 1)
-            rdb.node.push_back({});
-        rdb.node[s].xmin = rdb.node[s].ymin = INF;
-        rdb.node[s].xmax = rdb.node[s].ymax = -INF;
-        rdb.node[s].l = L;
-        rdb.node[s].r = R;
+        long long w = (long long)p.xr - p.xl, h = (long long)p.yr - p.yl;
+        treenode nd;
+        nd.qxl = w ? ((long long)b.xl - p.xl) * QBOX_MAX / w : 0;
+        nd.qyl = h ? ((long long)b.yl - p.yl) * QBOX_MAX / h : 0;
+        nd.qxr = w ? (((long long)b.xr - p.xl) * QBOX_MAX + w - 1) / w : 0;
+        nd.qyr = h ? (((long long)b.yr - p.yl) * QBOX_MAX + h - 1) / h : 0;
+        nd.rc = 0;
+        return nd;
     }
-    void buildBOXTree(rectdb &rdb, int s, int L, int R)
+    static rect rangebox(const rectdb &rdb, int L, int R)
     {
-        binitBOXTreeNode(rdb, s, L, R);
-        int n = R - L + 1;
+        rect b = {INF, INF, -INF, -INF};
         for (int i = L; i <= R; i++)
         {
-            rect &tmp=rdb.r[rdb.id[i]];
-            rdb.node[s].xmin = std::min(tmp.xl, rdb.node[s].xmin);
-            rdb.node[s].xmax = std::max(tmp.xr, rdb.node[s].xmax);
-            rdb.node[s].ymin = std::min(tmp.yl, rdb.node[s].ymin);
-            rdb.node[s].ymax = std::max(tmp.yr, rdb.node[s].ymax);
+            const rect &tmp = rdb.r[i];
+            b.xl = std::min(tmp.xl, b.xl);
+            b.xr = std::max(tmp.xr, b.xr);
+            b.yl = std::min(tmp.yl, b.yl);
+            b.yr = std::max(tmp.yr, b.yr);
         }
-        if (n > MIN_NODE_SIZE)
+        return b;
+    }
+    // the cmpbox type rects L..R with box b are split by, -1 to keep their order
+    static int splittype(const rectdb &rdb, int L, int R, const rect &b, int side)
+    {
+        if (rdb.type == LONG_TREE)
         {
+            // split across the stripes: on the axis their low corners
+            // spread along, not the one they run along
+            rect low = {INF, INF, -INF, -INF};
+            for (int i = L; i <= R; i++)
+            {
+                low.xl = std::min(low.xl, rdb.r[i].xl);
+                low.yl = std::min(low.yl, rdb.r[i].yl);
+                low.xr = std::max(low.xr, rdb.r[i].xl);
+                low.yr = std::max(low.yr, rdb.r[i].yl);
+            }
+            return (long long)low.xr - low.xl >= (long long)low.yr - low.yl ? side : 2 + side;
+        }
+        if (rdb.type == 2 || rdb.type == INST_TREE)
+            return b.xr - b.xl > b.yr - b.yl ? side : 2 + side;
+        if (rdb.type == 0)
+            return (b.xr - b.xl) << 1 > (b.yr - b.yl) ? side : 2 + side;
+        if (rdb.type == 1)
+            return (b.xr - b.xl) > (b.yr - b.yl) << 1 ? side : 2 + side;
+        return -1;
+    }
+    // sorts rects L..R, at most LEAF_PACK of them, with their payloads
+    template <int cmptype>
+    static void packblockby(rectdb &rdb, int L, int R)
+    {
+        pair<rect, payload> block[LEAF_PACK];
+        int n = R - L + 1;
+        for (int i = 0; i < n; i++)
+            block[i] = make_pair(rdb.r[L + i], rdb.rpayload[L + i]);
+        std::sort(block, block + n, [](const pair<rect, payload> &a, const pair<rect, payload> &b) { return cmpbox(a.first, b.first, cmptype); });
+        for (int i = 0; i < n; i++)
+        {
+            rdb.r[L + i] = block[i].first;
+            rdb.rpayload[L + i] = block[i].second;
+        }
+    }
+    static void packblock(rectdb &rdb, int L, int R, int cmptype)
+    {
+        if (cmptype == 0)
+            packblockby<0>(rdb, L, R);
+        else if (cmptype == 1)
+            packblockby<1>(rdb, L, R);
+        else if (cmptype == 2)
+            packblockby<2>(rdb, L, R);
+        else
+            packblockby<3>(rdb, L, R);
+    }
+    // Nodes are laid out in dfs order from an explicit stack; a right child
+    // sets the rc of its parent when it is reached. A subtree of at most
+    // LEAF_PACK rects is sorted once on the axis it splits and its lower
+    // nodes only cut the sorted run in halves, instead of selecting a
+    // median for every node.
+    void buildBOXTree(rectdb &rdb, int L, int R, const rect &pbox, int side)
+    {
+        struct buildframe
+        {
+            int L, R, side, parent;
+            rect pbox;
+        };
+        vector<buildframe> stack(1, {L, R, side, -1, pbox});
+        int packL = 0, packR = -1;
+        while (!stack.empty())
+        {
+            buildframe f = stack.back();
+            stack.pop_back();
+            int s = rdb.node.size(), n = f.R - f.L + 1;
+            if (f.parent >= 0)
+                rdb.node[f.parent].rc = s;
+            rect b = rangebox(rdb, f.L, f.R);
+            rdb.node.push_back(encodenode(f.pbox, b));
+            if (n <= SCAN_BLOCK)
+                continue;
+            if (f.L < packL || f.R > packR)
+            {
+                int cmptype = splittype(rdb, f.L, f.R, b, f.side);
+                if (cmptype >= 0)
+                {
+                    if (n <= LEAF_PACK)
+                    {
+                        packblock(rdb, f.L, f.R, cmptype);
+                        packL = f.L;
+                        packR = f.R;
+                    }
+                    else
+                        qselect(rdb, f.L, 0, n - 1, n >> 1, cmptype);
+                }
+            }
             int h = n >> 1;
-            if (rdb.type == 2)
+            rect box = childbox(f.pbox, rdb.node[s]);
+            stack.push_back({f.L + h, f.R, 1, s, box});
+            stack.push_back({f.L, f.L + h - 1, 0, -1, box});
+        }
+    }
+    int countlive(const rectdb &rdb, int L, int R)
+    {
+        int cnt = 0;
+        for (int i = L; i <= R; i++)
+            cnt += !rdb.isdead(i);
+        return cnt;
+    }
+    bool walkrects::leaf(int L, int R)
+    {
+        int hits[SCAN_BLOCK];
+        int cnt = scanRects(t, L, R, boxq, hits);
+        for (int i = 0; i < cnt; i++)
+            ans.push_back(t.getrect(hits[i]));
+        return true;
+    }
+    bool walkindices::leaf(int L, int R)
+    {
+        int cnt = hits.size();
+        hits.resize(cnt + R - L + 1);
+        hits.resize(cnt + scanRects(t, L, R, boxq, &hits[cnt]));
+        return true;
+    }
+    bool walkcount::inside(int L, int R)
+    {
+        cnt += t.ndead == 0 ? R - L + 1 : countlive(t, L, R);
+        return true;
+    }
+    bool walkcount::leaf(int L, int R)
+    {
+        int hits[SCAN_BLOCK];
+        cnt += scanRects(t, L, R, boxq, hits);
+        return true;
+    }
+    bool walkany::inside(int L, int R)
+    {
+        found = t.ndead == 0 || countlive(t, L, R) > 0;
+        return !found;
+    }
+    bool walkany::leaf(int L, int R)
+    {
+        int hits[SCAN_BLOCK];
+        found = scanRects(t, L, R, boxq, hits) > 0;
+        return !found;
+    }
+
+    // Both children are decoded at their parent and only those touching the
+    // window are kept: the walk goes on with the left one and stacks the
+    // right one, which can be a whole left subtree away in memory. Its first
+    // node, or its rects if it is a leaf, are fetched while the left subtree
+    // is walked. The stack holds at most one frame per level, and a tree of
+    // any int rect count has fewer than 32 levels.
+    static inline void prefetchframe(const rectdb &rdb, const cursorframe &f)
+    {
+        if (f.R - f.L >= SCAN_BLOCK)
+        {
+            __builtin_prefetch(&rdb.node[f.s + 1]);
+            return;
+        }
+        __builtin_prefetch(&rdb.xl[f.L]);
+        __builtin_prefetch(&rdb.yl[f.L]);
+        __builtin_prefetch(&rdb.xr[f.L]);
+        __builtin_prefetch(&rdb.yr[f.L]);
+    }
+    // calls v.inside(L, R) and v.leaf(L, R) like hrwalk, left child first
+    template <class V>
+    static bool boxwalk(const rectdb &rdb, const rect &boxq, V &v)
+    {
+        cursorframe stack[64];
+        int top = 0;
+        cursorframe f = {0, 0, rdb.size() - 1, rdb.box};
+        if (outbox(f.box, boxq))
+            return true;
+        while (true)
+        {
+            if (inbox(f.box, boxq))
             {
-                if (rdb.node[s].xmax - rdb.node[s].xmin > rdb.node[s].ymax - rdb.node[s].ymin)
-                    qselect(rdb, L, 0, n - 1, h, s & 1);
-                else
-                    qselect(rdb, L, 0, n - 1, h, 2 + (s & 1));
+                if (!v.inside(f.L, f.R))
+                    return false;
             }
-            if (rdb.type == 0)
+            else if (f.R - f.L < SCAN_BLOCK)
             {
-                if ((rdb.node[s].xmax - rdb.node[s].xmin) << 1 > (rdb.node[s].ymax - rdb.node[s].ymin))
-                    qselect(rdb, L, 0, n - 1, h, s & 1);
-                else
-                    qselect(rdb, L, 0, n - 1, h, 2 + (s & 1));
+                if (!v.leaf(f.L, f.R))
+                    return false;
+            }
+            else
+            {
+                int h = (f.R - f.L + 1) >> 1, rc = rdb.node[f.s].rc;
+                rect lbox = childbox(f.box, rdb.node[f.s + 1]);
+                rect rbox = childbox(f.box, rdb.node[rc]);
+                if (!outbox(rbox, boxq))
+                {
+                    stack[top] = {rc, f.L + h, f.R, rbox};
+                    prefetchframe(rdb, stack[top++]);
+                }
+                if (!outbox(lbox, boxq))
+                {
+                    f = {f.s + 1, f.L, f.L + h - 1, lbox};
+                    continue;
+                }
+            }
+            if (top == 0)
+                return true;
+            f = stack[--top];
+        }
+    }
+    // a DELTA_TREE has no nodes and is scanned block by block
+    template <class V>
+    static void flatwalk(const rectdb &rdb, V &v)
+    {
+        for (int L = 0; L < rdb.size(); L += SCAN_BLOCK)
+            if (!v.leaf(L, std::min(L + SCAN_BLOCK, rdb.size()) - 1))
+                return;
+    }
+    void queryBOXTree(const rectdb &rdb, const rect &boxq, std::vector<rect> &ansrect)
+    {
+        walkrects v = {rdb, boxq, ansrect};
+        if (rdb.engine == ENGINE_HRTREE && rdb.indexed())
+            queryHRTree(rdb, boxq, ansrect);
+        else if (rdb.node.empty())
+            flatwalk(rdb, v);
+        else
+            boxwalk(rdb, boxq, v);
+    }
+    void queryIndexBOXTree(const rectdb &rdb, const rect &boxq, std::vector<int> &hits)
+    {
+        walkindices v = {rdb, boxq, hits};
+        if (rdb.engine == ENGINE_HRTREE && rdb.indexed())
+            queryIndexHRTree(rdb, boxq, hits);
+        else if (rdb.node.empty())
+            flatwalk(rdb, v);
+        else
+            boxwalk(rdb, boxq, v);
+    }
+    long long queryCountBOXTree(const rectdb &rdb, const rect &boxq)
+    {
+        walkcount v = {rdb, boxq, 0};
+        if (rdb.engine == ENGINE_HRTREE && rdb.indexed())
+            return queryCountHRTree(rdb, boxq);
+        if (rdb.node.empty())
+            flatwalk(rdb, v);
+        else
+            boxwalk(rdb, boxq, v);
+        return v.cnt;
+    }
+    bool queryAnyBOXTree(const rectdb &rdb, const rect &boxq)
+    {
+        walkany v = {rdb, boxq, false};
+        if (rdb.engine == ENGINE_HRTREE && rdb.indexed())
+            return queryAnyHRTree(rdb, boxq);
+        if (rdb.node.empty())
+            flatwalk(rdb, v);
+        else
+            boxwalk(rdb, boxq, v);
+        return v.found;
+    }
+    // boxwalk with walkcount, counting every decoded node and the pruned
+    // ones among them
+    static long long statswalk(const rectdb &rdb, const rect &boxq, querystats &st)
+    {
+        cursorframe stack[64];
+        int top = 0;
+        long long cnt = 0;
+        cursorframe f = {0, 0, rdb.size() - 1, rdb.box};
+        st.visited++;
+        if (outbox(f.box, boxq))
+        {
+            st.pruned++;
+            return 0;
+        }
+        while (true)
+        {
+            if (inbox(f.box, boxq))
+            {
+                st.inside++;
+                cnt += rdb.ndead == 0 ? f.R - f.L + 1 : countlive(rdb, f.L, f.R);
             }
-            if (rdb.type == 1)
+            else if (f.R - f.L < SCAN_BLOCK)
             {
-                if ((rdb.node[s].xmax - rdb.node[s].xmin) > (rdb.node[s].ymax - rdb.node[s].ymin) << 1)
-                    qselect(rdb, L, 0, n - 1, h, s & 1);
+                int hits[SCAN_BLOCK], n = scanRects(rdb, f.L, f.R, boxq, hits);
+                st.tested += f.R - f.L + 1;
+                st.matched += n;
+                cnt += n;
+            }
+            else
+            {
+                int h = (f.R - f.L + 1) >> 1, rc = rdb.node[f.s].rc;
+                rect lbox = childbox(f.box, rdb.node[f.s + 1]);
+                rect rbox = childbox(f.box, rdb.node[rc]);
+                st.visited += 2;
+                if (outbox(rbox, boxq))
+                    st.pruned++;
+                else
+                    stack[top++] = {rc, f.L + h, f.R, rbox};
+                if (outbox(lbox, boxq))
+                    st.pruned++;
                 else
-                    qselect(rdb, L, 0, n - 1, h, 2 + (s & 1));
+                {
+                    f = {f.s + 1, f.L, f.L + h - 1, lbox};
+                    continue;
+                }
             }
-            buildBOXTree(rdb, s << 1, L, L + h - 1);
-            buildBOXTree(rdb, (s << 1) + 1, L + h, R);
+            if (top == 0)
+                return cnt;
+            f = stack[--top];
         }
-
-        return;
     }
-    void queryBOXTree(const rectdb &rdb, int s, rect &boxq, std::vector<rect> &ansrect)
+    long long queryStatsBOXTree(const rectdb &rdb, const rect &boxq, querystats &st)
     {
-        rect boxs = {rdb.node[s].xmin, rdb.node[s].ymin, rdb.node[s].xmax, rdb.node[s].ymax};
-        int L = rdb.node[s].l, R = rdb.node[s].r;
-        if (outbox(boxs, boxq))
-            return;
-        if (inbox(boxs, boxq) || R == L)
+        long long cnt;
+        if (rdb.engine == ENGINE_HRTREE && rdb.indexed())
+            cnt = queryStatsHRTree(rdb, boxq, st);
+        else if (!rdb.node.empty())
+            cnt = statswalk(rdb, boxq, st);
+        else
         {
-            for (int i = L; i <= R; i++)
-                ansrect.push_back(rdb.r[i]);
-            return;
+            walkcount v = {rdb, boxq, 0};
+            flatwalk(rdb, v);
+            cnt = v.cnt;
+            st.visited += (rdb.size() + SCAN_BLOCK - 1) / SCAN_BLOCK;
+            st.tested += rdb.size();
+            st.matched += cnt;
         }
-        if (R - L < MIN_NODE_SIZE)
+        st.hits += cnt;
+        return cnt;
+    }
+    int expandNode(const rectdb &rdb, const cursorframe &f, cursorframe kids[HR_FANOUT])
+    {
+        if (rdb.engine == ENGINE_HRTREE)
+            return expandHRNode(rdb, f, kids);
+        int h = (f.R - f.L + 1) >> 1, rc = rdb.node[f.s].rc;
+        kids[0] = {f.s + 1, f.L, f.L + h - 1, childbox(f.box, rdb.node[f.s + 1])};
+        kids[1] = {rc, f.L + h, f.R, childbox(f.box, rdb.node[rc])};
+        return 2;
+    }
+    uint64_t hilbertKey(unsigned int x, unsigned int y, int order)
+    {
+        uint64_t d = 0;
+        for (unsigned int sz = 1u << (order - 1); sz > 0; sz >>= 1)
         {
-            for (int i = L; i <= R; i++)
-                if (!outbox(rdb.r[i], boxq))
-                    ansrect.push_back(rdb.r[i]);
-            return;
+            unsigned int rx = (x & sz) > 0;
+            unsigned int ry = (y & sz) > 0;
+            d += (uint64_t)sz * sz * ((3 * rx) ^ ry);
+            if (ry == 0)
+            {
+                if (rx == 1)
+                {
+                    x = sz - 1 - x;
+                    y = sz - 1 - y;
+                }
+                swap(x, y);
+            }
         }
-        queryBOXTree(rdb, s << 1, boxq, ansrect);
-        queryBOXTree(rdb, (s << 1) + 1, boxq, ansrect);
-        return;
+        return d;
     }
 
 } // namespace db
@@ -5,11 +5,42 @@
 #include <cstdio>
 #include <algorithm>
 #include <thread>
+#include <cstdint>
+#include <unordered_map>
 #define INF 1050000000
 
-#define NUM_TH 4
-#define NUM_TREE (NUM_TH + 2)
-#define MIN_NODE_SIZE 3
+// subtrees with at most SCAN_BLOCK rects are scanned linearly instead of descended
+#define SCAN_BLOCK 32
+// subtrees with at most LEAF_PACK rects are sorted once instead of split by median selects
+#define LEAF_PACK 256
+// hits handed to a visitor per call
+#define VISIT_BATCH 256
+// children per packed r-tree node; its leaf groups hold SCAN_BLOCK rects
+#define HR_FANOUT 16
+// pairs handed to a pairvisitor per call
+#define JOIN_BATCH 256
+#define QBOX_MAX 65535
+#define MAX_LAYER_NUM 64
+#define ALL_LAYERS (~(uint64_t)0)
+// type of the unsorted per-layer buffer that takes inserted shapes
+#define DELTA_TREE -1
+// type of the per-layer tree of long or large shapes, see forest::longside
+#define LONG_TREE -2
+// type of the per-layer tree of placed cells, see forest::cells
+#define INST_TREE -3
+// classes a layer is counted by: the three recttypes, LONG_CLASS, and
+// INST_CLASS for the cell placements of an instanced build
+#define RECT_CLASSES 5
+#define LONG_CLASS 3
+#define INST_CLASS 4
+// longside is the longer side of the design extent over LONG_RATIO
+#define LONG_RATIO 16
+// a layer is rebuilt once buffered plus removed shapes exceed
+// max(REBUILD_MIN, REBUILD_RATIO * shapes in the layer)
+#define REBUILD_MIN 4096
+#define REBUILD_RATIO 0.1
+// one in KEY_SAMPLE shapes of a layer and type feeds the spatial quantiles
+#define KEY_SAMPLE 16
 
 namespace boxtree
 {
@@ -18,30 +49,446 @@ namespace boxtree
     {
         int xl, yl, xr, yr;
     };
+    // where an indexed rect came from, opaque to the tree: owner is the
+    // object incremental updates are keyed by, source the object that
+    // produced the shape and kind what sort of shape it is
+    struct payload
+    {
+        uint64_t owner, source;
+        int kind;
+    };
+    // nodes are stored in dfs order: the left child of node s is s + 1 and
+    // the right child is rc. The rect range of a node follows from its
+    // parent's (left gets n >> 1), and its box is kept as 16 bit fractions
+    // of the parent's decoded box, rounded outwards. Subtrees of at most
+    // SCAN_BLOCK rects have no children.
     struct treenode
     {
-        int xmin, xmax, ymin, ymax;
-        int l, r;
+        unsigned short qxl, qyl, qxr, qyr;
+        int rc;
+    };
+    // ENGINE_BOXTREE builds the median split tree in node; ENGINE_HRTREE
+    // sorts the rects along a hilbert curve and packs them bottom up into
+    // hnode, see obtree_hrtree.cpp. Both keep the rects of any node in one
+    // index range, so leaf scans, cursors, nearest and join searches are
+    // shared and only the descent differs.
+    enum treeengine
+    {
+        ENGINE_BOXTREE = 0,
+        ENGINE_HRTREE = 1
     };
+    // the exact boxes of up to HR_FANOUT children as arrays, 256 bytes or
+    // four cache lines; unused slots hold an inverted box
+    struct hrnode
+    {
+        int xl[HR_FANOUT], yl[HR_FANOUT], xr[HR_FANOUT], yr[HR_FANOUT];
+    };
+    // r and rpayload only live during the build; initBuild sorts them in
+    // place and leaves the rects in tree order as the structure of arrays
+    // xl/yl/xr/yr, with the payload split into parallel arrays alongside so
+    // leaf scans only touch coordinates. A removed rect stays in place with an
+    // inverted box until the layer is rebuilt.
     struct rectdb
     {
         int type;
+        int layer;
+        int ndead;
+        int engine;
         std::vector<rect> r;
-        std::vector<int> id;
+        std::vector<payload> rpayload;
         std::vector<treenode> node;
+        std::vector<hrnode> hnode; // levels top down, the root first
+        std::vector<int> xl, yl, xr, yr;
+        std::vector<uint64_t> owner, source;
+        std::vector<unsigned char> kind;
+        std::vector<long long> areasum; // see sumAreas
+        rect box;
+        rectdb() : type(0), layer(0), ndead(0), engine(ENGINE_BOXTREE) {}
+        int size() const { return xl.size(); }
+        // whether there are nodes to descend: a built box tree always has its
+        // root, a hilbert tree only above SCAN_BLOCK rects, and a DELTA_TREE
+        // buffer is never built, so it keeps no box either
+        bool indexed() const { return !node.empty() || !hnode.empty(); }
+        bool isdead(int i) const { return xl[i] > xr[i]; }
+        rect getrect(int i) const { return {xl[i], yl[i], xr[i], yr[i]}; }
+        payload getpayload(int i) const { return {owner[i], source[i], kind[i]}; }
+    };
+
+    enum scanisa
+    {
+        SCAN_SCALAR = 0,
+        SCAN_AVX2 = 1,
+        SCAN_AVX512 = 2
+    };
+
+    // how the shapes of one layer are spread over its nth + 2 trees
+    // PARTITION_SHARD deals the shapes of a type round robin over its trees,
+    // so every tree spans the whole layer. PARTITION_SPATIAL cuts the layer
+    // into tiles at quantiles of rectkey, one tree per tile, so a window
+    // only descends the trees whose box it meets. Both are deterministic.
+    enum partitionmode
+    {
+        PARTITION_SHARD = 0,
+        PARTITION_SPATIAL = 1
+    };
+    struct treeplan
+    {
+        int base, nth, maxt, t1;
+        bool mixed;
+        int sth[3], intth[3], lastth[3];
+        double dnum[3], doubleth[3];
+        // PARTITION_SHARD: fractional shares handed out so far
+        double carry[3], carryextra;
+        // PARTITION_SPATIAL: trees of each type in tile order and the keys
+        // between consecutive tiles
+        int partition;
+        vector<int> tiles[3];
+        vector<uint64_t> bounds[3];
     };
 
-    extern rectdb rdb[NUM_TH + 2];
-    extern vector<rect> ans[NUM_TH + 2];
-    extern int treeorder[NUM_TREE];
+    // One index: a group of nth + 2 trees per layer starting at layertree[l],
+    // plus an optional LONG_TREE at layerlong[l], INST_TREE at layerinst[l]
+    // and DELTA_TREE buffer at layerdelta[l]. Any number of forests can
+    // coexist; a built forest is only read by queries.
+    //
+    // Power stripes and large blockages span much of the die; mixed into the
+    // trees they would blow up the boxes of every node holding them. Shapes
+    // with a side of at least longside go to the layer's LONG_TREE instead, a
+    // box tree that splits on the spread of their low corners, so stripes
+    // are ordered by their cross coordinate. It is just another tree of the
+    // layer, so every query combines both without knowing.
+    //
+    // An instanced build keeps the shapes of every cell master once, in the
+    // master's frame, as small trees in cells, one per cell and layer. The
+    // INST_TREE of a layer holds one rect per instance whose master has
+    // shapes there: the placed box of the cell tree, with the instance as
+    // owner and the cell tree and orientation in source, see placement.
+    // Those rects only bound the shapes, so callers expand their hits
+    // through placedHits; the nearest search does so itself.
+    struct forest
+    {
+        vector<rectdb> rdb;
+        vector<int> treeorder; // largest tree first
+        vector<int> layertree;
+        vector<int> layerlong;
+        vector<int> layerinst;
+        vector<int> layerdelta;
+        vector<rectdb> cells;
+        int nth;
+        int partition;
+        int engine;   // set before planForest, kept by clearForest
+        int longside; // likewise, see setLongSide; 0 keeps every shape in the trees
+        bool instanced; // likewise; the build was given cell masters
+        vector<treeplan> layerplan; // only used while placing shapes
+        // (owner, tree << 32 | index) over all built trees, sorted by owner,
+        // see buildOwnerIndex; the DELTA_TREE rects are kept apart in
+        // deltaowner as they are inserted
+        vector<pair<uint64_t, uint64_t> > ownerindex;
+        std::unordered_multimap<uint64_t, uint64_t> deltaowner;
+        forest() : nth(0), partition(PARTITION_SHARD), engine(ENGINE_BOXTREE), longside(0), instanced(false) {}
+    };
 
-    void allocatetree(std::vector<rect> &rects);
+    void clearForest(forest &f);
+    // streaming build: count[layerIndex(layer) * RECT_CLASSES + shapeclass(f, r)]
+    // over all shapes sizes the trees, then every shape is placed straight
+    // into its tree, and every tree needs initBuild. PARTITION_SPATIAL also
+    // needs keys, indexed like count, with a sample of the rectkey of those
+    // shapes (every KEY_SAMPLE-th is enough); the samples are sorted in place.
+    void planForest(forest &f, const std::vector<long long> &count, int num_th,
+                    int partition = PARTITION_SHARD, std::vector<std::vector<uint64_t> > *keys = nullptr);
+    void placeShape(forest &f, const rect &a, int layer, const payload &pl);
+    void allocateForest(forest &f, std::vector<rect> &rects, std::vector<int> &layers,
+                        std::vector<payload> &payloads, int num_th, int partition = PARTITION_SHARD);
+    // keys: the sorted key samples of the three types, PARTITION_SPATIAL only
+    void plantrees(forest &f, const long long count[3], int base, int nth, treeplan &plan,
+                   int partition, const std::vector<uint64_t> *keys);
+    int picktree(treeplan &plan, const rect &a);
+    // center of a on a hilbert curve over the whole coordinate range
+    uint64_t rectkey(const rect &a);
+    void allocatetree(forest &f, std::vector<rect> &rects, std::vector<payload> &payloads, int base, int nth);
+    void sortTreeOrder(forest &f);
+    bool layerSelected(int layer, uint64_t layer_mask);
+    void selectTrees(const forest &f, uint64_t layer_mask, std::vector<int> &trees);
+    // only the trees that may hold a rect hitting boxq
+    void selectTrees(const forest &f, uint64_t layer_mask, const rect &boxq, std::vector<int> &trees);
     int recttype(const rect &a);
-    void buildBOXTree(rectdb &rdb, int s, int L, int R);
-    void initBOXTreeNode(rectdb &rdb, int s, int L, int R);
+    // recttype, or LONG_CLASS for a shape with a side of at least f.longside
+    int shapeclass(const forest &f, const rect &a);
+    // longside from the bounding box of all shapes, before planForest
+    void setLongSide(forest &f, const rect &extent);
+    bool inbox(const rect &a, const rect &b);
+    bool outbox(const rect &a, const rect &b);
+    inline bool haspoint(const rect &a, int x, int y)
+    {
+        return a.xl <= x && x <= a.xr && a.yl <= y && y <= a.yr;
+    }
+    void buildBOXTree(rectdb &rdb, int L, int R, const rect &pbox, int side);
+    // builds the index of rdb.engine
     void initBuild(rectdb &rdb);
+    // bytes held by the built index of one tree
+    size_t treeMemory(const rectdb &rdb);
+
+    // box of node nd given the decoded box p of its parent
+    inline rect childbox(const rect &p, const treenode &nd)
+    {
+        long long w = (long long)p.xr - p.xl, h = (long long)p.yr - p.yl;
+        return {p.xl + (int)(nd.qxl * w / QBOX_MAX), p.yl + (int)(nd.qyl * h / QBOX_MAX),
+                p.xl + (int)((nd.qxr * w + QBOX_MAX - 1) / QBOX_MAX),
+                p.yl + (int)((nd.qyr * h + QBOX_MAX - 1) / QBOX_MAX)};
+    }
+
+    // What one window costs a tree. A node is a box tree node, a hr tree
+    // slot or a block of a flat tree; each one visited is pruned (outside
+    // the window), taken whole (inside it) or split further, and a leaf
+    // scan tests its rects one by one, of which matched hit.
+    struct querystats
+    {
+        long long visited, pruned, inside, tested, matched, hits;
+    };
+
+    // What a walk does with what it finds, for either engine: inside(L, R)
+    // takes a subtree inside the window, leaf(L, R) a leaf block it only
+    // meets; returning false stops the walk.
+    struct walkrects
+    {
+        const rectdb &t;
+        const rect &boxq;
+        std::vector<rect> &ans;
+        bool inside(int L, int R)
+        {
+            for (int i = L; i <= R; i++)
+                if (t.ndead == 0 || !t.isdead(i))
+                    ans.push_back(t.getrect(i));
+            return true;
+        }
+        bool leaf(int L, int R);
+    };
+    struct walkindices
+    {
+        const rectdb &t;
+        const rect &boxq;
+        std::vector<int> &hits;
+        bool inside(int L, int R)
+        {
+            for (int i = L; i <= R; i++)
+                if (t.ndead == 0 || !t.isdead(i))
+                    hits.push_back(i);
+            return true;
+        }
+        bool leaf(int L, int R);
+    };
+    struct walkcount
+    {
+        const rectdb &t;
+        const rect &boxq;
+        long long cnt;
+        bool inside(int L, int R);
+        bool leaf(int L, int R);
+    };
+    // stops the walk at the first hit
+    struct walkany
+    {
+        const rectdb &t;
+        const rect &boxq;
+        bool found;
+        bool inside(int L, int R);
+        bool leaf(int L, int R);
+    };
+
+    // packed hilbert r-tree, see obtree_hrtree.cpp; initBuild sorts r along
+    // the curve before the rects are laid out, buildHRTree packs hnode
+    void sortHilbert(rectdb &rdb);
+    void buildHRTree(rectdb &rdb);
+    void queryHRTree(const rectdb &rdb, const rect &boxq, std::vector<rect> &ansrect);
+    void queryIndexHRTree(const rectdb &rdb, const rect &boxq, std::vector<int> &hits);
+    long long queryCountHRTree(const rectdb &rdb, const rect &boxq);
+    bool queryAnyHRTree(const rectdb &rdb, const rect &boxq);
+    long long queryStatsHRTree(const rectdb &rdb, const rect &boxq, querystats &st);
+
+    // the queries below dispatch on rdb.engine
+    void queryBOXTree(const rectdb &rdb, const rect &boxq, std::vector<rect> &ansrect);
+    // a node covering rects L..R that lies inside the window adds R - L + 1 without being visited
+    long long queryCountBOXTree(const rectdb &rdb, const rect &boxq);
+    bool queryAnyBOXTree(const rectdb &rdb, const rect &boxq);
+    // the count of queryCountBOXTree, walking the same nodes; adds to st
+    long long queryStatsBOXTree(const rectdb &rdb, const rect &boxq, querystats &st);
+    // appends the indices of the rects hitting boxq, for callers that need
+    // the payload of a hit and not only its box
+    void queryIndexBOXTree(const rectdb &rdb, const rect &boxq, std::vector<int> &hits);
+
+    // resumable traversal of one tree with an explicit stack, so that the
+    // hits of a huge window can be taken in batches, see obtree_cursor.cpp
+    struct cursorframe
+    {
+        int s, L, R; // s < 0 for a range without nodes
+        rect box;
+    };
+    // children of node f.s of an indexed tree with more than SCAN_BLOCK
+    // rects, in rect order; for either engine
+    int expandNode(const rectdb &rdb, const cursorframe &f, cursorframe kids[HR_FANOUT]);
+    int expandHRNode(const rectdb &rdb, const cursorframe &f, cursorframe kids[HR_FANOUT]);
+    struct querycursor
+    {
+        const rectdb *rdb;
+        rect boxq;
+        vector<cursorframe> stack;
+        int nextL, lastR; // rest of a subtree inside the window
+    };
+    void startCursor(querycursor &cur, const rectdb &rdb, const rect &boxq);
+    // writes up to maxhits (at least SCAN_BLOCK) indices, 0 once the tree is done
+    int nextHits(querycursor &cur, int *hits, int maxhits);
+    class visitor
+    {
+    public:
+        virtual ~visitor() {}
+        // hits are indices into rdb; returning false stops the query
+        virtual bool visit(const rectdb &rdb, const int *hits, int n) = 0;
+    };
+    // false if the visitor stopped the query
+    bool visitBOXTree(const rectdb &rdb, const rect &boxq, visitor &v);
+
+    // point queries, see obtree_point.cpp. The walk only asks whether a box
+    // holds the point and keeps its frames on the stack, so it allocates
+    // nothing; hits reach the visitor VISIT_BATCH at a time.
+    struct pointbatch
+    {
+        const rectdb &t;
+        visitor &v;
+        rect boxq; // the point, as leaf scans take it
+        int cnt;
+        int hits[VISIT_BATCH];
+        // scans rects L..R, at most SCAN_BLOCK of them; false once v stops
+        bool leaf(int L, int R);
+        bool flush();
+    };
+    // the live rects holding (x, y); false if the visitor stopped the query
+    bool visitPointBOXTree(const rectdb &rdb, int x, int y, visitor &v);
+    // the walk of an indexed hr tree, leaves pb unflushed
+    bool visitPointHRTree(const rectdb &rdb, pointbatch &pb);
+
+    // area queries, see obtree_density.cpp. boxq is cut into nx by ny bins,
+    // bin (i, j) adding to area[j * nx + i]; bin i spans x from
+    // boxq.xl + w * i / nx, w the width of boxq, and likewise along y. Every
+    // live rect adds its area clipped to each bin, so overlaps count twice.
+    struct densitygrid
+    {
+        rect boxq;
+        int nx, ny;
+        double *area;
+        vector<int> xedge, yedge; // nx + 1 and ny + 1 bin edges
+        double xscale, yscale;    // bins per unit, to guess the bin of a coordinate
+        // the bins the part of a inside boxq lies in, false if that part has no area
+        bool bins(const rect &a, int &x0, int &y0, int &x1, int &y1) const;
+        void add(const rect &a);
+    };
+    void setGrid(densitygrid &g, const rect &boxq, int nx, int ny, double *area);
+    // areasum[i] is the area of the live rects before i, for i up to size().
+    // Every node of either engine holds one rect range, so this gives the
+    // area of any node; initBuild sets it, a loaded tree needs it again.
+    void sumAreas(rectdb &rdb);
+    // a node inside boxq and inside one bin adds its area without being visited
+    void densityBOXTree(const rectdb &rdb, densitygrid &g);
+
+    // writes the indices in [L, R] of rects hitting boxq to hits (room for R - L + 1)
+    int scanRects(const rectdb &rdb, int L, int R, const rect &boxq, int *hits);
+    // rects in [L, R] not removed
+    int countlive(const rectdb &rdb, int L, int R);
+    int detectScanISA();
+    // returns the isa actually used, never above what the cpu supports
+    int setScanISA(int isa);
+
+    // best-first nearest search, see obtree_nearest.cpp
+    enum distmetric
+    {
+        DIST_MANHATTAN = 0,
+        DIST_EUCLIDEAN = 1
+    };
+    // sub is the shape of the cell placed by rect index of an INST_TREE,
+    // -1 for the rect itself
+    struct nearesthit
+    {
+        double dist;
+        int tree, index, sub;
+    };
+    // 0 for a point inside a
+    double pointDistance(const rect &a, int x, int y, int metric);
+    // the k live rects of the given trees nearest to (x, y), at most maxdist
+    // away, nearest first; nodes are expanded in order of their distance
+    void nearestForest(const forest &f, const std::vector<int> &trees, int x, int y, int k, double maxdist,
+                       int metric, std::vector<nearesthit> &hits);
+
+    // dual-tree self join of the shapes on each layer, see obtree_join.cpp.
+    // A frame pairs a node of one tree with a node of the same or another
+    // tree of its layer; a frame of a node with itself is on the diagonal.
+    struct joinside
+    {
+        int tree, s, L, R; // s < 0 for a range without nodes
+        rect box;
+    };
+    struct joinframe
+    {
+        joinside a, b;
+    };
+    class pairvisitor
+    {
+    public:
+        virtual ~pairvisitor() {}
+        // rect ia[i] of ta and rect ib[i] of tb are within the bloat distance
+        // of each other; returning false stops the join
+        virtual bool visit(const rectdb &ta, const int *ia, const rectdb &tb, const int *ib, int n) = 0;
+    };
+    // frames covering every pair of trees on one layer, each tree with itself
+    // too, split until a frame holds at most grain rects; frames are
+    // independent and may be joined in parallel
+    void startJoin(const forest &f, const std::vector<int> &trees, int bloat, int grain,
+                   std::vector<joinframe> &frames);
+    // every unordered pair of live rects in the frame whose boxes come within
+    // bloat of each other, overlapping ones included; false if stopped
+    bool joinFrame(const forest &f, const joinframe &fr, int bloat, pairvisitor &v);
+
+    // incremental updates, see obtree_eco.cpp
+    int layerIndex(int layer);
+    void insertShape(forest &f, const rect &a, int layer, const payload &pl);
+    // a built or loaded forest needs its owner index before any removal
+    void buildOwnerIndex(forest &f);
+    // replaces the owner index entries of trees by their current rects
+    void indexOwners(forest &f, const std::vector<int> &trees);
+    int removeOwner(forest &f, uint64_t owner);
+    // true if owner has a live rect in the forest
+    bool ownerIndexed(const forest &f, uint64_t owner);
+    bool layerNeedsRebuild(const forest &f, int l);
+    // moves the live shapes of layer l back into fresh trees; the returned
+    // trees still need initBuild, then indexOwners
+    void relayoutLayer(forest &f, int l, std::vector<int> &trees);
+
+    // instanced cells, see obtree_inst.cpp. An orientation is a signed
+    // permutation: bit 0 swaps x and y, then bit 1 negates x and bit 2
+    // negates y.
+    rect orientRect(const rect &a, int orient);
+    rect unorientRect(const rect &a, int orient);
+    // how rect i of an INST_TREE places cells[cell]: a shape a of the cell
+    // lands at orientRect(a, orient) moved by (dx, dy)
+    struct placement
+    {
+        int cell, orient, dx, dy;
+    };
+    uint64_t placementSource(int cell, int orient);
+    placement instPlacement(const forest &f, const rectdb &t, int i);
+    rect placeRect(const placement &p, const rect &a);
+    // boxq in the cell's frame
+    rect unplaceRect(const placement &p, const rect &boxq);
+    // appends the indices in cells[p.cell] of the shapes hitting boxq once placed
+    void placedHits(const forest &f, const placement &p, const rect &boxq, std::vector<int> &hits);
+    // adds the shapes of the cell p places at box placed, see densitygrid
+    void densityPlaced(const forest &f, const placement &p, const rect &placed, densitygrid &g);
+    // the INST_TREE of layer l takes a placed cell box; needs the INST_CLASS count
+    void placeInstance(forest &f, const rect &a, int layer, const payload &pl);
+    // pairs (i, j), i < j, of shapes of one cell within bloat of each other;
+    // placing keeps them, as orientations keep distances along each axis
+    void cellPairs(const rectdb &cell, int bloat, std::vector<pair<int, int> > &pairs);
 
-    void queryBOXTree(const rectdb &rdb, int s, rect &boxq, std::vector<rect> &ansrect);
+    // position of (x, y) on a hilbert curve over a 2^order x 2^order grid
+    uint64_t hilbertKey(unsigned int x, unsigned int y, int order);
 
 } // namespace open_edi
 
@@ -0,0 +1,84 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    void startCursor(querycursor &cur, const rectdb &rdb, const rect &boxq)
+    {
+        cur.rdb = &rdb;
+        cur.boxq = boxq;
+        cur.stack.clear();
+        cur.nextL = 0;
+        cur.lastR = -1;
+        if (rdb.size() == 0)
+            return;
+        // a tree without nodes is one flat range, scanned block by block
+        cursorframe root = {rdb.indexed() ? 0 : -1, 0, rdb.size() - 1, rdb.box};
+        cur.stack.push_back(root);
+    }
+    int nextHits(querycursor &cur, int *hits, int maxhits)
+    {
+        const rectdb &rdb = *cur.rdb;
+        int cnt = 0;
+        while (true)
+        {
+            while (cur.nextL <= cur.lastR && cnt < maxhits)
+            {
+                int i = cur.nextL++;
+                if (rdb.ndead == 0 || !rdb.isdead(i))
+                    hits[cnt++] = i;
+            }
+            if (cnt == maxhits || cur.stack.empty())
+                return cnt;
+            cursorframe f = cur.stack.back();
+            if (f.s >= 0)
+            {
+                if (outbox(f.box, cur.boxq))
+                {
+                    cur.stack.pop_back();
+                    continue;
+                }
+                if (inbox(f.box, cur.boxq))
+                {
+                    cur.stack.pop_back();
+                    cur.nextL = f.L;
+                    cur.lastR = f.R;
+                    continue;
+                }
+            }
+            if (f.R - f.L < SCAN_BLOCK)
+            {
+                // a leaf is scanned in one go, so it waits for the next batch
+                if (maxhits - cnt < f.R - f.L + 1)
+                    return cnt;
+                cur.stack.pop_back();
+                cnt += scanRects(rdb, f.L, f.R, cur.boxq, hits + cnt);
+                continue;
+            }
+            cur.stack.pop_back();
+            if (f.s < 0)
+            {
+                cursorframe rest = {-1, f.L + SCAN_BLOCK, f.R, f.box};
+                cursorframe block = {-1, f.L, f.L + SCAN_BLOCK - 1, f.box};
+                cur.stack.push_back(rest);
+                cur.stack.push_back(block);
+                continue;
+            }
+            // pushed last to first so the hits come in rect order
+            cursorframe kids[HR_FANOUT];
+            for (int n = expandNode(rdb, f, kids); n > 0; n--)
+                cur.stack.push_back(kids[n - 1]);
+        }
+    }
+    bool visitBOXTree(const rectdb &rdb, const rect &boxq, visitor &v)
+    {
+        querycursor cur;
+        int hits[VISIT_BATCH];
+        startCursor(cur, rdb, boxq);
+        while (int cnt = nextHits(cur, hits, VISIT_BATCH))
+            if (!v.visit(rdb, hits, cnt))
+                return false;
+        return true;
+    }
+
+} // namespace boxtree
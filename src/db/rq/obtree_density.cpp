@@ -0,0 +1,128 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    static long long rectarea(const rect &a)
+    {
+        return (long long)(a.xr - a.xl) * (a.yr - a.yl);
+    }
+    void sumAreas(rectdb &rdb)
+    {
+        int n = rdb.size();
+        rdb.areasum.resize(n + 1);
+        rdb.areasum[0] = 0;
+        for (int i = 0; i < n; i++)
+            rdb.areasum[i + 1] = rdb.areasum[i] + (rdb.isdead(i) ? 0 : rectarea(rdb.getrect(i)));
+    }
+
+    void setGrid(densitygrid &g, const rect &boxq, int nx, int ny, double *area)
+    {
+        long long w = (long long)boxq.xr - boxq.xl, h = (long long)boxq.yr - boxq.yl;
+        g.boxq = boxq;
+        g.nx = nx;
+        g.ny = ny;
+        g.area = area;
+        g.xedge.resize(nx + 1);
+        g.yedge.resize(ny + 1);
+        for (int i = 0; i <= nx; i++)
+            g.xedge[i] = boxq.xl + (int)(w * i / nx);
+        for (int j = 0; j <= ny; j++)
+            g.yedge[j] = boxq.yl + (int)(h * j / ny);
+        g.xscale = (double)nx / w;
+        g.yscale = (double)ny / h;
+    }
+    // the last bin whose low edge is at most x; the guess is off by a bin
+    // at most, unless there are more bins than units and edges repeat
+    static int binof(const vector<int> &edge, double scale, int x)
+    {
+        int n = edge.size() - 1;
+        if (n == 1)
+            return 0;
+        int i = std::min(n - 1, (int)(((double)x - edge[0]) * scale));
+        while (i + 1 < n && edge[i + 1] <= x)
+            i++;
+        while (i > 0 && edge[i] > x)
+            i--;
+        return i;
+    }
+    bool densitygrid::bins(const rect &a, int &x0, int &y0, int &x1, int &y1) const
+    {
+        int xl = std::max(a.xl, boxq.xl), xr = std::min(a.xr, boxq.xr);
+        int yl = std::max(a.yl, boxq.yl), yr = std::min(a.yr, boxq.yr);
+        if (xl >= xr || yl >= yr)
+            return false;
+        x0 = binof(xedge, xscale, xl);
+        x1 = binof(xedge, xscale, xr - 1);
+        y0 = binof(yedge, yscale, yl);
+        y1 = binof(yedge, yscale, yr - 1);
+        return true;
+    }
+    void densitygrid::add(const rect &a)
+    {
+        int x0, y0, x1, y1;
+        if (!bins(a, x0, y0, x1, y1))
+            return;
+        for (int j = y0; j <= y1; j++)
+        {
+            double h = std::min(a.yr, yedge[j + 1]) - std::max(a.yl, yedge[j]);
+            for (int i = x0; i <= x1; i++)
+                area[j * nx + i] += h * (std::min(a.xr, xedge[i + 1]) - std::max(a.xl, xedge[i]));
+        }
+    }
+
+    // A node that falls in one bin, window included, adds the area of its
+    // rect range; a tree with removed rects is walked down to its leaves,
+    // which skip them, as areasum still holds them.
+    static void densitynode(const rectdb &t, const cursorframe &f, densitygrid &g)
+    {
+        int x0, y0, x1, y1;
+        if (!g.bins(f.box, x0, y0, x1, y1))
+            return;
+        if (x0 == x1 && y0 == y1 && t.ndead == 0 && inbox(f.box, g.boxq))
+        {
+            g.area[y0 * g.nx + x0] += t.areasum[f.R + 1] - t.areasum[f.L];
+            return;
+        }
+        if (f.R - f.L < SCAN_BLOCK)
+        {
+            int hits[SCAN_BLOCK];
+            for (int i = 0, n = scanRects(t, f.L, f.R, g.boxq, hits); i < n; i++)
+                g.add(t.getrect(hits[i]));
+            return;
+        }
+        cursorframe kids[HR_FANOUT];
+        for (int c = 0, n = expandNode(t, f, kids); c < n; c++)
+            densitynode(t, kids[c], g);
+    }
+    void densityBOXTree(const rectdb &rdb, densitygrid &g)
+    {
+        // delta buffers and hilbert trees of at most SCAN_BLOCK rects have no nodes
+        if (!rdb.indexed())
+        {
+            for (int i = 0; i < rdb.size(); i++)
+                g.add(rdb.getrect(i));
+            return;
+        }
+        cursorframe root = {0, 0, rdb.size() - 1, rdb.box};
+        densitynode(rdb, root, g);
+    }
+
+    // orientations keep areas, so a cell placed inside one bin adds the
+    // area of its tree
+    void densityPlaced(const forest &f, const placement &p, const rect &placed, densitygrid &g)
+    {
+        const rectdb &cell = f.cells[p.cell];
+        int x0, y0, x1, y1;
+        if (!g.bins(placed, x0, y0, x1, y1))
+            return;
+        if (x0 == x1 && y0 == y1 && cell.ndead == 0 && inbox(placed, g.boxq))
+        {
+            g.area[y0 * g.nx + x0] += cell.areasum[cell.size()];
+            return;
+        }
+        for (int i = 0; i < cell.size(); i++)
+            g.add(placeRect(p, cell.getrect(i)));
+    }
+
+} // namespace boxtree
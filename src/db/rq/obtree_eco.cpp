@@ -0,0 +1,257 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    static uint64_t ownerslot(int t, int i)
+    {
+        return ((uint64_t)t << 32) | i;
+    }
+    void buildOwnerIndex(forest &f)
+    {
+        vector<rectdb> &rdb = f.rdb;
+        vector<int> trees;
+        f.ownerindex.clear();
+        f.deltaowner.clear();
+        for (unsigned int t = 0; t < rdb.size(); t++)
+        {
+            if (rdb[t].type != DELTA_TREE)
+            {
+                trees.push_back(t);
+                continue;
+            }
+            for (int i = 0; i < rdb[t].size(); i++)
+                f.deltaowner.insert(make_pair(rdb[t].owner[i], ownerslot(t, i)));
+        }
+        indexOwners(f, trees);
+    }
+    // the new entries are sorted on their own and merged in, so a relaid
+    // out layer costs one pass over the index rather than a full sort
+    void indexOwners(forest &f, const std::vector<int> &trees)
+    {
+        const vector<rectdb> &rdb = f.rdb;
+        vector<pair<uint64_t, uint64_t> > &ownerindex = f.ownerindex;
+        vector<char> replaced(rdb.size(), 0);
+        for (unsigned int k = 0; k < trees.size(); k++)
+            replaced[trees[k]] = 1;
+        ownerindex.erase(remove_if(ownerindex.begin(), ownerindex.end(),
+                                   [&replaced](const pair<uint64_t, uint64_t> &e) { return replaced[e.second >> 32]; }),
+                         ownerindex.end());
+        size_t kept = ownerindex.size();
+        for (unsigned int k = 0; k < trees.size(); k++)
+        {
+            const rectdb &t = rdb[trees[k]];
+            for (int i = 0; i < t.size(); i++)
+                ownerindex.push_back(make_pair(t.owner[i], ownerslot(trees[k], i)));
+        }
+        sort(ownerindex.begin() + kept, ownerindex.end());
+        inplace_merge(ownerindex.begin(), ownerindex.begin() + kept, ownerindex.end());
+    }
+    static void killRect(rectdb &t, int i)
+    {
+        t.xl[i] = t.yl[i] = INF;
+        t.xr[i] = t.yr[i] = -INF;
+        t.ndead++;
+    }
+    int layerIndex(int layer)
+    {
+        if (layer < 0 || layer > MAX_LAYER_NUM)
+            return MAX_LAYER_NUM;
+        return layer;
+    }
+    void insertShape(forest &f, const rect &a, int layer, const payload &pl)
+    {
+        vector<rectdb> &rdb = f.rdb;
+        vector<int> &layerdelta = f.layerdelta;
+        int l = layerIndex(layer);
+        if (layerdelta[l] < 0)
+        {
+            layerdelta[l] = rdb.size();
+            rdb.push_back(rectdb());
+            rdb.back().type = DELTA_TREE;
+            rdb.back().layer = l;
+            rdb.back().ndead = 0;
+            sortTreeOrder(f);
+        }
+        rectdb &t = rdb[layerdelta[l]];
+        t.xl.push_back(a.xl);
+        t.yl.push_back(a.yl);
+        t.xr.push_back(a.xr);
+        t.yr.push_back(a.yr);
+        t.owner.push_back(pl.owner);
+        t.source.push_back(pl.source);
+        t.kind.push_back(pl.kind);
+        f.deltaowner.insert(make_pair(pl.owner, ownerslot(layerdelta[l], t.size() - 1)));
+    }
+    int removeOwner(forest &f, uint64_t owner)
+    {
+        vector<rectdb> &rdb = f.rdb;
+        const vector<pair<uint64_t, uint64_t> > &ownerindex = f.ownerindex;
+        int cnt = 0;
+        vector<pair<uint64_t, uint64_t> >::const_iterator it =
+            lower_bound(ownerindex.begin(), ownerindex.end(), make_pair(owner, (uint64_t)0));
+        for (; it != ownerindex.end() && it->first == owner; ++it)
+        {
+            rectdb &t = rdb[it->second >> 32];
+            int i = it->second & 0xffffffff;
+            if (t.isdead(i))
+                continue;
+            killRect(t, i);
+            cnt++;
+        }
+        auto range = f.deltaowner.equal_range(owner);
+        for (auto d = range.first; d != range.second; ++d)
+        {
+            rectdb &t = rdb[d->second >> 32];
+            int i = d->second & 0xffffffff;
+            if (t.isdead(i))
+                continue;
+            killRect(t, i);
+            cnt++;
+        }
+        return cnt;
+    }
+    bool ownerIndexed(const forest &f, uint64_t owner)
+    {
+        const vector<rectdb> &rdb = f.rdb;
+        const vector<pair<uint64_t, uint64_t> > &ownerindex = f.ownerindex;
+        vector<pair<uint64_t, uint64_t> >::const_iterator it =
+            lower_bound(ownerindex.begin(), ownerindex.end(), make_pair(owner, (uint64_t)0));
+        for (; it != ownerindex.end() && it->first == owner; ++it)
+            if (!rdb[it->second >> 32].isdead(it->second & 0xffffffff))
+                return true;
+        auto range = f.deltaowner.equal_range(owner);
+        for (auto d = range.first; d != range.second; ++d)
+            if (!rdb[d->second >> 32].isdead(d->second & 0xffffffff))
+                return true;
+        return false;
+    }
+    bool layerNeedsRebuild(const forest &f, int l)
+    {
+        const vector<rectdb> &rdb = f.rdb;
+        const vector<int> &layertree = f.layertree, &layerdelta = f.layerdelta;
+        int forestnth = f.nth;
+        long long total = 0, stale = 0;
+        if (layertree[l] >= 0)
+            for (int i = layertree[l]; i < layertree[l] + forestnth + 2; i++)
+            {
+                total += rdb[i].size();
+                stale += rdb[i].ndead;
+            }
+        if (f.layerlong[l] >= 0)
+        {
+            total += rdb[f.layerlong[l]].size();
+            stale += rdb[f.layerlong[l]].ndead;
+        }
+        if (f.layerinst[l] >= 0)
+        {
+            total += rdb[f.layerinst[l]].size();
+            stale += rdb[f.layerinst[l]].ndead;
+        }
+        if (layerdelta[l] >= 0)
+        {
+            total += rdb[layerdelta[l]].size();
+            stale += rdb[layerdelta[l]].size();
+        }
+        return stale > std::max((double)REBUILD_MIN, REBUILD_RATIO * total);
+    }
+    static void takeLive(rectdb &t, vector<rect> &rects, vector<payload> &payloads)
+    {
+        for (int i = 0; i < t.size(); i++)
+            if (!t.isdead(i))
+            {
+                rects.push_back(t.getrect(i));
+                payloads.push_back(t.getpayload(i));
+            }
+        int type = t.type, layer = t.layer, engine = t.engine;
+        t = rectdb();
+        t.type = type;
+        t.layer = layer;
+        t.engine = engine;
+    }
+    // long shapes inserted since the build join the layer's LONG_TREE, which
+    // is added if the layer had none; an INST_TREE only drops its removed
+    // instances, as inserted shapes come flat
+    void relayoutLayer(forest &f, int l, std::vector<int> &trees)
+    {
+        vector<rectdb> &rdb = f.rdb;
+        vector<int> &layertree = f.layertree, &layerlong = f.layerlong, &layerdelta = f.layerdelta;
+        int forestnth = f.nth;
+        vector<rect> rects, longrects;
+        vector<payload> payloads, longpayloads;
+        trees.clear();
+        if (layerlong[l] >= 0)
+            takeLive(rdb[layerlong[l]], longrects, longpayloads);
+        if (layertree[l] < 0)
+        {
+            layertree[l] = rdb.size();
+            rdb.resize(rdb.size() + forestnth + 2);
+            for (int i = layertree[l]; i < layertree[l] + forestnth + 2; i++)
+            {
+                rdb[i].layer = l;
+                rdb[i].ndead = 0;
+                rdb[i].engine = f.engine;
+            }
+        }
+        for (int i = layertree[l]; i < layertree[l] + forestnth + 2; i++)
+            takeLive(rdb[i], rects, payloads);
+        if (layerdelta[l] >= 0)
+        {
+            // the buffer empties, so its owners leave deltaowner
+            rectdb &delta = rdb[layerdelta[l]];
+            for (int i = 0; i < delta.size(); i++)
+            {
+                auto range = f.deltaowner.equal_range(delta.owner[i]);
+                for (auto d = range.first; d != range.second; ++d)
+                    if (d->second == ownerslot(layerdelta[l], i))
+                    {
+                        f.deltaowner.erase(d);
+                        break;
+                    }
+            }
+            takeLive(delta, rects, payloads);
+        }
+        int compact = 0;
+        for (unsigned int i = 0; i < rects.size(); i++)
+        {
+            if (shapeclass(f, rects[i]) != LONG_CLASS)
+            {
+                rects[compact] = rects[i];
+                payloads[compact++] = payloads[i];
+                continue;
+            }
+            longrects.push_back(rects[i]);
+            longpayloads.push_back(payloads[i]);
+        }
+        rects.resize(compact);
+        payloads.resize(compact);
+        if (!rects.empty())
+            allocatetree(f, rects, payloads, layertree[l], forestnth);
+        for (int i = layertree[l]; i < layertree[l] + forestnth + 2; i++)
+            trees.push_back(i);
+        if (!longrects.empty() && layerlong[l] < 0)
+        {
+            layerlong[l] = rdb.size();
+            rdb.push_back(rectdb());
+            rdb.back().type = LONG_TREE;
+            rdb.back().layer = l;
+        }
+        if (layerlong[l] >= 0)
+        {
+            rdb[layerlong[l]].r.swap(longrects);
+            rdb[layerlong[l]].rpayload.swap(longpayloads);
+            trees.push_back(layerlong[l]);
+        }
+        if (f.layerinst[l] >= 0)
+        {
+            vector<rect> instrects;
+            vector<payload> instpayloads;
+            rectdb &t = rdb[f.layerinst[l]];
+            takeLive(t, instrects, instpayloads);
+            t.r.swap(instrects);
+            t.rpayload.swap(instpayloads);
+            trees.push_back(f.layerinst[l]);
+        }
+    }
+
+} // namespace boxtree
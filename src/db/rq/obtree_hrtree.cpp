@@ -0,0 +1,274 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    // Level 0 are the leaf groups of SCAN_BLOCK rects, level h >= 1 nodes
+    // hold the boxes of HR_FANOUT nodes or groups of level h - 1. Node j of
+    // level h covers rects from j * span[h], so the layout follows from the
+    // rect count alone.
+    struct hrlayout
+    {
+        int top;
+        int cnt[10], off[10];
+        long long span[10];
+    };
+    static void hrlevels(int n, hrlayout &lv)
+    {
+        lv.top = 0;
+        lv.cnt[0] = (n + SCAN_BLOCK - 1) / SCAN_BLOCK;
+        lv.span[0] = SCAN_BLOCK;
+        while (lv.cnt[lv.top] > 1)
+        {
+            int h = ++lv.top;
+            lv.cnt[h] = (lv.cnt[h - 1] + HR_FANOUT - 1) / HR_FANOUT;
+            lv.span[h] = lv.span[h - 1] * HR_FANOUT;
+        }
+        int off = 0;
+        for (int h = lv.top; h >= 1; h--)
+        {
+            lv.off[h] = off;
+            off += lv.cnt[h];
+        }
+    }
+    static int hrlevelof(const hrlayout &lv, int s)
+    {
+        int h = lv.top;
+        while (h > 1 && s >= lv.off[h] + lv.cnt[h])
+            h--;
+        return h;
+    }
+    static void setslot(hrnode &nd, int c, const rect &b)
+    {
+        nd.xl[c] = b.xl;
+        nd.yl[c] = b.yl;
+        nd.xr[c] = b.xr;
+        nd.yr[c] = b.yr;
+    }
+
+    void sortHilbert(rectdb &rdb)
+    {
+        int n = rdb.r.size();
+        vector<pair<uint64_t, int> > keys(n);
+        for (int i = 0; i < n; i++)
+            keys[i] = make_pair(rectkey(rdb.r[i]), i);
+        sort(keys.begin(), keys.end());
+        vector<rect> r(n);
+        vector<payload> rpayload(n);
+        for (int i = 0; i < n; i++)
+        {
+            r[i] = rdb.r[keys[i].second];
+            rpayload[i] = rdb.rpayload[keys[i].second];
+        }
+        rdb.r.swap(r);
+        rdb.rpayload.swap(rpayload);
+    }
+    void buildHRTree(rectdb &rdb)
+    {
+        int n = rdb.size();
+        hrlayout lv;
+        hrlevels(n, lv);
+        rdb.hnode.clear();
+        if (lv.top == 0)
+            return;
+        hrnode empty;
+        for (int c = 0; c < HR_FANOUT; c++)
+            setslot(empty, c, {INF, INF, -INF, -INF});
+        rdb.hnode.assign(lv.off[1] + lv.cnt[1], empty);
+        for (int g = 0; g < lv.cnt[0]; g++)
+        {
+            rect b = {INF, INF, -INF, -INF};
+            for (int i = g * SCAN_BLOCK; i < std::min((g + 1) * SCAN_BLOCK, n); i++)
+            {
+                b.xl = std::min(b.xl, rdb.xl[i]);
+                b.yl = std::min(b.yl, rdb.yl[i]);
+                b.xr = std::max(b.xr, rdb.xr[i]);
+                b.yr = std::max(b.yr, rdb.yr[i]);
+            }
+            setslot(rdb.hnode[lv.off[1] + g / HR_FANOUT], g % HR_FANOUT, b);
+        }
+        for (int h = 2; h <= lv.top; h++)
+            for (int k = 0; k < lv.cnt[h - 1]; k++)
+            {
+                const hrnode &nd = rdb.hnode[lv.off[h - 1] + k];
+                rect b = {INF, INF, -INF, -INF};
+                for (int c = 0; c < HR_FANOUT; c++)
+                {
+                    b.xl = std::min(b.xl, nd.xl[c]);
+                    b.yl = std::min(b.yl, nd.yl[c]);
+                    b.xr = std::max(b.xr, nd.xr[c]);
+                    b.yr = std::max(b.yr, nd.yr[c]);
+                }
+                setslot(rdb.hnode[lv.off[h] + k / HR_FANOUT], k % HR_FANOUT, b);
+            }
+    }
+
+    // children of a frame, a leaf group keeps the id of its parent
+    int expandHRNode(const rectdb &rdb, const cursorframe &f, cursorframe kids[HR_FANOUT])
+    {
+        hrlayout lv;
+        hrlevels(rdb.size(), lv);
+        int h = hrlevelof(lv, f.s), j = f.s - lv.off[h], cnt = 0;
+        const hrnode &nd = rdb.hnode[f.s];
+        for (int c = 0; c < HR_FANOUT; c++)
+        {
+            long long L = j * lv.span[h] + c * lv.span[h - 1];
+            if (L > f.R)
+                break;
+            int R = std::min(L + lv.span[h - 1] - 1, (long long)f.R);
+            int s = h > 1 ? lv.off[h - 1] + j * HR_FANOUT + c : f.s;
+            kids[cnt++] = {s, (int)L, R, {nd.xl[c], nd.yl[c], nd.xr[c], nd.yr[c]}};
+        }
+        return cnt;
+    }
+
+    // Calls v.inside(L, R) for the subtrees inside the window and v.leaf(L, R)
+    // for the leaf groups it only meets; false once v asks to stop.
+    template <class V>
+    static bool hrwalk(const rectdb &t, const hrlayout &lv, int h, int j, const rect &boxq, V &v)
+    {
+        const hrnode &nd = t.hnode[lv.off[h] + j];
+        for (int c = 0; c < HR_FANOUT; c++)
+        {
+            long long L = j * lv.span[h] + c * lv.span[h - 1];
+            if (L >= t.size())
+                break;
+            int R = std::min(L + lv.span[h - 1], (long long)t.size()) - 1;
+            rect b = {nd.xl[c], nd.yl[c], nd.xr[c], nd.yr[c]};
+            if (outbox(b, boxq))
+                continue;
+            if (inbox(b, boxq))
+            {
+                if (!v.inside(L, R))
+                    return false;
+            }
+            else if (h == 1)
+            {
+                if (!v.leaf(L, R))
+                    return false;
+            }
+            else if (!hrwalk(t, lv, h - 1, j * HR_FANOUT + c, boxq, v))
+                return false;
+        }
+        return true;
+    }
+    template <class V>
+    static void hrsearch(const rectdb &t, const rect &boxq, V &v)
+    {
+        if (outbox(t.box, boxq))
+            return;
+        if (inbox(t.box, boxq))
+        {
+            v.inside(0, t.size() - 1);
+            return;
+        }
+        hrlayout lv;
+        hrlevels(t.size(), lv);
+        hrwalk(t, lv, lv.top, 0, boxq, v);
+    }
+
+    void queryHRTree(const rectdb &rdb, const rect &boxq, std::vector<rect> &ansrect)
+    {
+        walkrects v = {rdb, boxq, ansrect};
+        hrsearch(rdb, boxq, v);
+    }
+    void queryIndexHRTree(const rectdb &rdb, const rect &boxq, std::vector<int> &hits)
+    {
+        walkindices v = {rdb, boxq, hits};
+        hrsearch(rdb, boxq, v);
+    }
+    long long queryCountHRTree(const rectdb &rdb, const rect &boxq)
+    {
+        walkcount v = {rdb, boxq, 0};
+        hrsearch(rdb, boxq, v);
+        return v.cnt;
+    }
+    bool queryAnyHRTree(const rectdb &rdb, const rect &boxq)
+    {
+        walkany v = {rdb, boxq, false};
+        hrsearch(rdb, boxq, v);
+        return v.found;
+    }
+
+    // hrwalk for a point: a slot is only entered if its box holds it
+    static bool hrpointwalk(const rectdb &t, const hrlayout &lv, int h, int j, pointbatch &pb)
+    {
+        const hrnode &nd = t.hnode[lv.off[h] + j];
+        int x = pb.boxq.xl, y = pb.boxq.yl;
+        for (int c = 0; c < HR_FANOUT; c++)
+        {
+            long long L = j * lv.span[h] + c * lv.span[h - 1];
+            if (L >= t.size())
+                break;
+            if (nd.xl[c] > x || nd.xr[c] < x || nd.yl[c] > y || nd.yr[c] < y)
+                continue;
+            if (h > 1)
+            {
+                if (!hrpointwalk(t, lv, h - 1, j * HR_FANOUT + c, pb))
+                    return false;
+            }
+            else if (!pb.leaf(L, std::min(L + SCAN_BLOCK, (long long)t.size()) - 1))
+                return false;
+        }
+        return true;
+    }
+    bool visitPointHRTree(const rectdb &rdb, pointbatch &pb)
+    {
+        if (!haspoint(rdb.box, pb.boxq.xl, pb.boxq.yl))
+            return true;
+        hrlayout lv;
+        hrlevels(rdb.size(), lv);
+        return hrpointwalk(rdb, lv, lv.top, 0, pb);
+    }
+
+    // hrwalk taking stats of every slot it looks at
+    static long long hrstatswalk(const rectdb &t, const hrlayout &lv, int h, int j, const rect &boxq, querystats &st)
+    {
+        const hrnode &nd = t.hnode[lv.off[h] + j];
+        long long cnt = 0;
+        for (int c = 0; c < HR_FANOUT; c++)
+        {
+            long long L = j * lv.span[h] + c * lv.span[h - 1];
+            if (L >= t.size())
+                break;
+            int R = std::min(L + lv.span[h - 1], (long long)t.size()) - 1;
+            rect b = {nd.xl[c], nd.yl[c], nd.xr[c], nd.yr[c]};
+            st.visited++;
+            if (outbox(b, boxq))
+                st.pruned++;
+            else if (inbox(b, boxq))
+            {
+                st.inside++;
+                cnt += t.ndead == 0 ? R - L + 1 : countlive(t, L, R);
+            }
+            else if (h == 1)
+            {
+                int hits[SCAN_BLOCK], k = scanRects(t, L, R, boxq, hits);
+                st.tested += R - L + 1;
+                st.matched += k;
+                cnt += k;
+            }
+            else
+                cnt += hrstatswalk(t, lv, h - 1, j * HR_FANOUT + c, boxq, st);
+        }
+        return cnt;
+    }
+    long long queryStatsHRTree(const rectdb &rdb, const rect &boxq, querystats &st)
+    {
+        st.visited++;
+        if (outbox(rdb.box, boxq))
+        {
+            st.pruned++;
+            return 0;
+        }
+        if (inbox(rdb.box, boxq))
+        {
+            st.inside++;
+            return rdb.ndead == 0 ? rdb.size() : countlive(rdb, 0, rdb.size() - 1);
+        }
+        hrlayout lv;
+        hrlevels(rdb.size(), lv);
+        return hrstatswalk(rdb, lv, lv.top, 0, boxq, st);
+    }
+
+} // namespace boxtree
@@ -0,0 +1,88 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    rect orientRect(const rect &a, int orient)
+    {
+        rect b = a;
+        if (orient & 1)
+            b = {a.yl, a.xl, a.yr, a.xr};
+        if (orient & 2)
+            b = {-b.xr, b.yl, -b.xl, b.yr};
+        if (orient & 4)
+            b = {b.xl, -b.yr, b.xr, -b.yl};
+        return b;
+    }
+    rect unorientRect(const rect &a, int orient)
+    {
+        rect b = a;
+        if (orient & 4)
+            b = {b.xl, -b.yr, b.xr, -b.yl};
+        if (orient & 2)
+            b = {-b.xr, b.yl, -b.xl, b.yr};
+        if (orient & 1)
+            b = {b.yl, b.xl, b.yr, b.xr};
+        return b;
+    }
+    static int clampcoord(long long v)
+    {
+        return (int)std::min(std::max(v, (long long)-INF), (long long)INF);
+    }
+
+    uint64_t placementSource(int cell, int orient)
+    {
+        return (uint64_t)cell << 3 | orient;
+    }
+    // the offset is not stored: the rect is the placed box of the cell tree
+    placement instPlacement(const forest &f, const rectdb &t, int i)
+    {
+        placement p;
+        p.cell = t.source[i] >> 3;
+        p.orient = t.source[i] & 7;
+        rect b = orientRect(f.cells[p.cell].box, p.orient);
+        p.dx = t.xl[i] - b.xl;
+        p.dy = t.yl[i] - b.yl;
+        return p;
+    }
+    rect placeRect(const placement &p, const rect &a)
+    {
+        rect b = orientRect(a, p.orient);
+        return {b.xl + p.dx, b.yl + p.dy, b.xr + p.dx, b.yr + p.dy};
+    }
+    rect unplaceRect(const placement &p, const rect &boxq)
+    {
+        rect b = {clampcoord((long long)boxq.xl - p.dx), clampcoord((long long)boxq.yl - p.dy),
+                  clampcoord((long long)boxq.xr - p.dx), clampcoord((long long)boxq.yr - p.dy)};
+        return unorientRect(b, p.orient);
+    }
+    void placedHits(const forest &f, const placement &p, const rect &boxq, std::vector<int> &hits)
+    {
+        queryIndexBOXTree(f.cells[p.cell], unplaceRect(p, boxq), hits);
+    }
+
+    void placeInstance(forest &f, const rect &a, int layer, const payload &pl)
+    {
+        rectdb &t = f.rdb[f.layerinst[layerIndex(layer)]];
+        t.r.push_back(a);
+        t.rpayload.push_back(pl);
+    }
+
+    void cellPairs(const rectdb &cell, int bloat, std::vector<pair<int, int> > &pairs)
+    {
+        pairs.clear();
+        int hits[SCAN_BLOCK];
+        for (int i = 0; i < cell.size(); i++)
+        {
+            rect q = {clampcoord((long long)cell.xl[i] - bloat), clampcoord((long long)cell.yl[i] - bloat),
+                      clampcoord((long long)cell.xr[i] + bloat), clampcoord((long long)cell.yr[i] + bloat)};
+            for (int L = i + 1; L < cell.size(); L += SCAN_BLOCK)
+            {
+                int cnt = scanRects(cell, L, std::min(L + SCAN_BLOCK, cell.size()) - 1, q, hits);
+                for (int k = 0; k < cnt; k++)
+                    pairs.push_back(make_pair(i, hits[k]));
+            }
+        }
+    }
+
+} // namespace boxtree
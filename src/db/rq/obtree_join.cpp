@@ -0,0 +1,187 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    // bounds of rects L..R of a tree without nodes; removed rects are
+    // inverted and leave the bounds alone
+    static rect rangebox(const rectdb &t, int L, int R)
+    {
+        rect b = {INF, INF, -INF, -INF};
+        for (int i = L; i <= R; i++)
+        {
+            b.xl = std::min(b.xl, t.xl[i]);
+            b.yl = std::min(b.yl, t.yl[i]);
+            b.xr = std::max(b.xr, t.xr[i]);
+            b.yr = std::max(b.yr, t.yr[i]);
+        }
+        return b;
+    }
+    // frames a diagonal frame of a packed r-tree node splits into
+    const int JOIN_SPLIT = HR_FANOUT * (HR_FANOUT + 1) / 2;
+
+    static bool joinmeets(const rect &a, const rect &b, int bloat)
+    {
+        return (long long)a.xl - bloat <= b.xr && (long long)b.xl - bloat <= a.xr &&
+               (long long)a.yl - bloat <= b.yr && (long long)b.yl - bloat <= a.yr;
+    }
+    static bool isleaf(const joinside &x)
+    {
+        return x.R - x.L < SCAN_BLOCK;
+    }
+    static bool isdiagonal(const joinframe &fr)
+    {
+        return fr.a.tree == fr.b.tree && fr.a.L == fr.b.L;
+    }
+    // the children of a node, or two halves of a range without nodes
+    static int splitside(const rectdb &t, const joinside &x, joinside kids[HR_FANOUT])
+    {
+        if (x.s >= 0)
+        {
+            cursorframe f = {x.s, x.L, x.R, x.box}, sub[HR_FANOUT];
+            int n = expandNode(t, f, sub);
+            for (int i = 0; i < n; i++)
+                kids[i] = {x.tree, sub[i].s, sub[i].L, sub[i].R, sub[i].box};
+            return n;
+        }
+        int h = (x.R - x.L + 1) >> 1;
+        kids[0] = {x.tree, -1, x.L, x.L + h - 1, rangebox(t, x.L, x.L + h - 1)};
+        kids[1] = {x.tree, -1, x.L + h, x.R, rangebox(t, x.L + h, x.R)};
+        return 2;
+    }
+    // a frame that is not two leaves becomes smaller ones: a diagonal frame
+    // pairs the children of its side among themselves, any other splits its
+    // larger side
+    static int splitframe(const forest &f, const joinframe &fr, joinframe kids[JOIN_SPLIT])
+    {
+        joinside sub[HR_FANOUT];
+        int cnt = 0;
+        if (isdiagonal(fr))
+        {
+            int n = splitside(f.rdb[fr.a.tree], fr.a, sub);
+            for (int i = 0; i < n; i++)
+                for (int j = i; j < n; j++)
+                    kids[cnt++] = {sub[i], sub[j]};
+            return cnt;
+        }
+        if (isleaf(fr.b) || (!isleaf(fr.a) && fr.a.R - fr.a.L >= fr.b.R - fr.b.L))
+        {
+            int n = splitside(f.rdb[fr.a.tree], fr.a, sub);
+            for (int i = 0; i < n; i++)
+                kids[cnt++] = {sub[i], fr.b};
+        }
+        else
+        {
+            int n = splitside(f.rdb[fr.b.tree], fr.b, sub);
+            for (int i = 0; i < n; i++)
+                kids[cnt++] = {fr.a, sub[i]};
+        }
+        return cnt;
+    }
+    static bool framemeets(const joinframe &fr, int bloat)
+    {
+        return isdiagonal(fr) || joinmeets(fr.a.box, fr.b.box, bloat);
+    }
+
+    struct joinbuffer
+    {
+        const rectdb &ta, &tb;
+        pairvisitor &v;
+        int n;
+        int ia[JOIN_BATCH], ib[JOIN_BATCH];
+        joinbuffer(const rectdb &a, const rectdb &b, pairvisitor &vis) : ta(a), tb(b), v(vis), n(0) {}
+        bool flush()
+        {
+            int cnt = n;
+            n = 0;
+            return cnt == 0 || v.visit(ta, ia, tb, ib, cnt);
+        }
+    };
+
+    // each live rect of a is bloated and scanned against b; on the diagonal
+    // only the rects after it are scanned so every pair comes once
+    static bool leafjoin(const joinframe &fr, int bloat, joinbuffer &buf)
+    {
+        const rectdb &ta = buf.ta, &tb = buf.tb;
+        bool diagonal = isdiagonal(fr);
+        int hits[SCAN_BLOCK];
+        for (int i = fr.a.L; i <= fr.a.R; i++)
+        {
+            if (ta.ndead != 0 && ta.isdead(i))
+                continue;
+            int L = diagonal ? i + 1 : fr.b.L;
+            if (L > fr.b.R)
+                continue;
+            rect q = {(int)std::max((long long)ta.xl[i] - bloat, (long long)-INF),
+                      (int)std::max((long long)ta.yl[i] - bloat, (long long)-INF),
+                      (int)std::min((long long)ta.xr[i] + bloat, (long long)INF),
+                      (int)std::min((long long)ta.yr[i] + bloat, (long long)INF)};
+            int cnt = scanRects(tb, L, fr.b.R, q, hits);
+            if (buf.n + cnt > JOIN_BATCH && !buf.flush())
+                return false;
+            for (int j = 0; j < cnt; j++)
+            {
+                buf.ia[buf.n] = i;
+                buf.ib[buf.n++] = hits[j];
+            }
+        }
+        return true;
+    }
+    static bool joinrec(const forest &f, const joinframe &fr, int bloat, joinbuffer &buf)
+    {
+        if (!framemeets(fr, bloat))
+            return true;
+        if (isleaf(fr.a) && isleaf(fr.b))
+            return leafjoin(fr, bloat, buf);
+        joinframe kids[JOIN_SPLIT];
+        int n = splitframe(f, fr, kids);
+        for (int i = 0; i < n; i++)
+            if (!joinrec(f, kids[i], bloat, buf))
+                return false;
+        return true;
+    }
+
+    static joinside rootside(const forest &f, int tree)
+    {
+        const rectdb &t = f.rdb[tree];
+        if (!t.indexed())
+            return {tree, -1, 0, t.size() - 1, rangebox(t, 0, t.size() - 1)};
+        return {tree, 0, 0, t.size() - 1, t.box};
+    }
+    void startJoin(const forest &f, const std::vector<int> &trees, int bloat, int grain,
+                   std::vector<joinframe> &frames)
+    {
+        vector<joinframe> todo;
+        for (unsigned int i = 0; i < trees.size(); i++)
+            for (unsigned int j = i; j < trees.size(); j++)
+            {
+                if (f.rdb[trees[i]].layer != f.rdb[trees[j]].layer)
+                    continue;
+                joinframe fr = {rootside(f, trees[i]), rootside(f, trees[j])};
+                if (framemeets(fr, bloat))
+                    todo.push_back(fr);
+            }
+        frames.clear();
+        while (!todo.empty())
+        {
+            joinframe fr = todo.back();
+            todo.pop_back();
+            if ((isleaf(fr.a) && isleaf(fr.b)) || fr.a.R - fr.a.L + fr.b.R - fr.b.L + 2 <= grain)
+            {
+                frames.push_back(fr);
+                continue;
+            }
+            joinframe kids[JOIN_SPLIT];
+            int n = splitframe(f, fr, kids);
+            for (int i = 0; i < n; i++)
+                if (framemeets(kids[i], bloat))
+                    todo.push_back(kids[i]);
+        }
+    }
+    bool joinFrame(const forest &f, const joinframe &fr, int bloat, pairvisitor &v)
+    {
+        joinbuffer buf(f.rdb[fr.a.tree], f.rdb[fr.b.tree], v);
+        return joinrec(f, fr, bloat, buf) && buf.flush();
+    }
+
+} // namespace boxtree
@@ -0,0 +1,124 @@
+#include "db/rq/obtree.h"
+
+#include <cmath>
+#include <queue>
+
+namespace boxtree
+{
+
+    double pointDistance(const rect &a, int x, int y, int metric)
+    {
+        double dx = std::max(0.0, std::max((double)a.xl - x, (double)x - a.xr));
+        double dy = std::max(0.0, std::max((double)a.yl - y, (double)y - a.yr));
+        if (metric == DIST_EUCLIDEAN)
+            return std::sqrt(dx * dx + dy * dy);
+        return dx + dy;
+    }
+
+    // a node of some tree (s >= 0), a single rect L of it (NEAREST_RECT),
+    // or for an INST_TREE the placed cell of rect L (NEAREST_CELL) or its
+    // shape R (NEAREST_PLACED); keyed by a lower bound of the distance to
+    // everything below it
+    enum
+    {
+        NEAREST_RECT = -1,
+        NEAREST_CELL = -2,
+        NEAREST_PLACED = -3
+    };
+    struct nearestentry
+    {
+        double dist;
+        int tree, s, L, R;
+        rect box;
+        bool ishit() const { return s == NEAREST_RECT || s == NEAREST_PLACED; }
+        bool operator<(const nearestentry &b) const
+        {
+            // priority_queue pops the largest; rects win ties so that a
+            // k-th rect is not held back by nodes at the same distance
+            if (dist != b.dist)
+                return dist > b.dist;
+            return ishit() < b.ishit();
+        }
+    };
+
+    static void pushRects(const rectdb &t, int tree, int L, int R, int x, int y, int metric, double maxdist,
+                          std::priority_queue<nearestentry> &pq)
+    {
+        for (int i = L; i <= R; i++)
+        {
+            if (t.ndead != 0 && t.isdead(i))
+                continue;
+            rect a = t.getrect(i);
+            int s = t.type == INST_TREE ? NEAREST_CELL : NEAREST_RECT;
+            nearestentry e = {pointDistance(a, x, y, metric), tree, s, i, i, a};
+            if (e.dist <= maxdist)
+                pq.push(e);
+        }
+    }
+
+    void nearestForest(const forest &f, const std::vector<int> &trees, int x, int y, int k, double maxdist,
+                       int metric, std::vector<nearesthit> &hits)
+    {
+        hits.clear();
+        if (k <= 0)
+            return;
+        std::priority_queue<nearestentry> pq;
+        for (unsigned int i = 0; i < trees.size(); i++)
+        {
+            const rectdb &t = f.rdb[trees[i]];
+            if (t.size() == 0)
+                continue;
+            if (!t.indexed())
+            {
+                // delta buffers have no box to bound them, small hilbert
+                // trees no nodes
+                pushRects(t, trees[i], 0, t.size() - 1, x, y, metric, maxdist, pq);
+                continue;
+            }
+            nearestentry e = {pointDistance(t.box, x, y, metric), trees[i], 0, 0, t.size() - 1, t.box};
+            if (e.dist <= maxdist)
+                pq.push(e);
+        }
+        while (!pq.empty() && (int)hits.size() < k)
+        {
+            nearestentry e = pq.top();
+            pq.pop();
+            if (e.ishit())
+            {
+                nearesthit h = {e.dist, e.tree, e.L, e.s == NEAREST_PLACED ? e.R : -1};
+                hits.push_back(h);
+                continue;
+            }
+            const rectdb &t = f.rdb[e.tree];
+            if (e.s == NEAREST_CELL)
+            {
+                // the shapes lie inside the placed box, so they are no nearer
+                placement p = instPlacement(f, t, e.L);
+                const rectdb &cell = f.cells[p.cell];
+                for (int c = 0; c < cell.size(); c++)
+                {
+                    rect a = placeRect(p, cell.getrect(c));
+                    nearestentry placed = {pointDistance(a, x, y, metric), e.tree, NEAREST_PLACED, e.L, c, a};
+                    if (placed.dist <= maxdist)
+                        pq.push(placed);
+                }
+                continue;
+            }
+            if (e.R - e.L < SCAN_BLOCK)
+            {
+                pushRects(t, e.tree, e.L, e.R, x, y, metric, maxdist, pq);
+                continue;
+            }
+            cursorframe frame = {e.s, e.L, e.R, e.box}, kids[HR_FANOUT];
+            int n = expandNode(t, frame, kids);
+            for (int i = 0; i < n; i++)
+            {
+                nearestentry c = {pointDistance(kids[i].box, x, y, metric), e.tree, kids[i].s, kids[i].L, kids[i].R,
+                                  kids[i].box};
+                if (c.dist <= maxdist)
+                    pq.push(c);
+            }
+        }
+    }
+
+} // namespace boxtree
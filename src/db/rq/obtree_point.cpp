@@ -0,0 +1,61 @@
+#include "db/rq/obtree.h"
+
+namespace boxtree
+{
+
+    bool pointbatch::leaf(int L, int R)
+    {
+        if (cnt + R - L + 1 > VISIT_BATCH && !flush())
+            return false;
+        cnt += scanRects(t, L, R, boxq, hits + cnt);
+        return true;
+    }
+    bool pointbatch::flush()
+    {
+        int n = cnt;
+        cnt = 0;
+        return n == 0 || v.visit(t, hits, n);
+    }
+
+    // A point lies in few boxes, so the walk rarely holds more than one
+    // frame per level: at most one per level plus a sibling, and a box
+    // tree of any int rect count has fewer than 32 levels.
+    bool visitPointBOXTree(const rectdb &rdb, int x, int y, visitor &v)
+    {
+        pointbatch pb = {rdb, v, {x, y, x, y}, 0};
+        if (rdb.engine == ENGINE_HRTREE && rdb.indexed())
+            return visitPointHRTree(rdb, pb) && pb.flush();
+        if (rdb.node.empty())
+        {
+            for (int L = 0; L < rdb.size(); L += SCAN_BLOCK)
+                if (!pb.leaf(L, std::min(L + SCAN_BLOCK, rdb.size()) - 1))
+                    return false;
+            return pb.flush();
+        }
+        if (!haspoint(rdb.box, x, y))
+            return true;
+        cursorframe stack[64];
+        int top = 0;
+        stack[top++] = {0, 0, rdb.size() - 1, rdb.box};
+        while (top > 0)
+        {
+            cursorframe f = stack[--top];
+            if (f.R - f.L < SCAN_BLOCK)
+            {
+                if (!pb.leaf(f.L, f.R))
+                    return false;
+                continue;
+            }
+            // the right child is pushed first so the hits come in rect order
+            int h = (f.R - f.L + 1) >> 1, rc = rdb.node[f.s].rc;
+            rect b = childbox(f.box, rdb.node[rc]);
+            if (haspoint(b, x, y))
+                stack[top++] = {rc, f.L + h, f.R, b};
+            b = childbox(f.box, rdb.node[f.s + 1]);
+            if (haspoint(b, x, y))
+                stack[top++] = {f.s + 1, f.L, f.L + h - 1, b};
+        }
+        return pb.flush();
+    }
+
+} // namespace boxtree
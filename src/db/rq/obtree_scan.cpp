@@ -0,0 +1,105 @@
+#include "db/rq/obtree.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BOXTREE_X86_SIMD
+#endif
+
+namespace boxtree
+{
+
+    // hit test is !outbox(): xr >= q.xl && xl <= q.xr && yr >= q.yl && yl <= q.yr
+    static int scanRectsScalar(const rectdb &rdb, int L, int R, const rect &boxq, int *hits)
+    {
+        int cnt = 0;
+        const int *xl = rdb.xl.data(), *yl = rdb.yl.data(), *xr = rdb.xr.data(), *yr = rdb.yr.data();
+        for (int i = L; i <= R; i++)
+        {
+            hits[cnt] = i;
+            cnt += (xr[i] >= boxq.xl) & (xl[i] <= boxq.xr) & (yr[i] >= boxq.yl) & (yl[i] <= boxq.yr);
+        }
+        return cnt;
+    }
+
+#ifdef BOXTREE_X86_SIMD
+    __attribute__((target("avx2"))) static int scanRectsAVX2(const rectdb &rdb, int L, int R, const rect &boxq, int *hits)
+    {
+        int cnt = 0;
+        const int *xl = rdb.xl.data(), *yl = rdb.yl.data(), *xr = rdb.xr.data(), *yr = rdb.yr.data();
+        const __m256i qxl = _mm256_set1_epi32(boxq.xl), qyl = _mm256_set1_epi32(boxq.yl);
+        const __m256i qxr = _mm256_set1_epi32(boxq.xr), qyr = _mm256_set1_epi32(boxq.yr);
+        int i = L;
+        for (; i + 7 <= R; i += 8)
+        {
+            __m256i miss = _mm256_cmpgt_epi32(qxl, _mm256_loadu_si256((const __m256i *)(xr + i)));
+            miss = _mm256_or_si256(miss, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(xl + i)), qxr));
+            miss = _mm256_or_si256(miss, _mm256_cmpgt_epi32(qyl, _mm256_loadu_si256((const __m256i *)(yr + i))));
+            miss = _mm256_or_si256(miss, _mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(yl + i)), qyr));
+            unsigned int mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xff;
+            while (mask)
+            {
+                hits[cnt++] = i + __builtin_ctz(mask);
+                mask &= mask - 1;
+            }
+        }
+        for (; i <= R; i++)
+        {
+            hits[cnt] = i;
+            cnt += (xr[i] >= boxq.xl) & (xl[i] <= boxq.xr) & (yr[i] >= boxq.yl) & (yl[i] <= boxq.yr);
+        }
+        return cnt;
+    }
+
+    __attribute__((target("avx512f"))) static int scanRectsAVX512(const rectdb &rdb, int L, int R, const rect &boxq, int *hits)
+    {
+        int cnt = 0;
+        const int *xl = rdb.xl.data(), *yl = rdb.yl.data(), *xr = rdb.xr.data(), *yr = rdb.yr.data();
+        const __m512i qxl = _mm512_set1_epi32(boxq.xl), qyl = _mm512_set1_epi32(boxq.yl);
+        const __m512i qxr = _mm512_set1_epi32(boxq.xr), qyr = _mm512_set1_epi32(boxq.yr);
+        const __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        for (int i = L; i <= R; i += 16)
+        {
+            __mmask16 valid = R - i >= 15 ? (__mmask16)0xffff : (__mmask16)((1u << (R - i + 1)) - 1);
+            __mmask16 hit = _mm512_mask_cmpge_epi32_mask(valid, _mm512_maskz_loadu_epi32(valid, xr + i), qxl);
+            hit = _mm512_mask_cmple_epi32_mask(hit, _mm512_maskz_loadu_epi32(valid, xl + i), qxr);
+            hit = _mm512_mask_cmpge_epi32_mask(hit, _mm512_maskz_loadu_epi32(valid, yr + i), qyl);
+            hit = _mm512_mask_cmple_epi32_mask(hit, _mm512_maskz_loadu_epi32(valid, yl + i), qyr);
+            _mm512_mask_compressstoreu_epi32(hits + cnt, hit, _mm512_add_epi32(iota, _mm512_set1_epi32(i)));
+            cnt += __builtin_popcount(hit);
+        }
+        return cnt;
+    }
+#endif
+
+    int detectScanISA()
+    {
+#ifdef BOXTREE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+            return SCAN_AVX512;
+        if (__builtin_cpu_supports("avx2"))
+            return SCAN_AVX2;
+#endif
+        return SCAN_SCALAR;
+    }
+
+    static int scan_isa = detectScanISA();
+
+    int setScanISA(int isa)
+    {
+        scan_isa = std::min(isa, detectScanISA());
+        return scan_isa;
+    }
+
+    int scanRects(const rectdb &rdb, int L, int R, const rect &boxq, int *hits)
+    {
+#ifdef BOXTREE_X86_SIMD
+        if (scan_isa == SCAN_AVX512)
+            return scanRectsAVX512(rdb, L, R, boxq, hits);
+        if (scan_isa == SCAN_AVX2)
+            return scanRectsAVX2(rdb, L, R, boxq, hits);
+#endif
+        return scanRectsScalar(rdb, L, R, boxq, hits);
+    }
+
+} // namespace boxtree
@@ -10,112 +10,540 @@
  */
 
 #include "db/rq/rq.h"
-#include "db/rq/obtree.h"
+
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+#include "db/rq/rq_executor.h"
+#include "db/rq/rq_index_io.h"
 
 namespace open_edi {
 namespace db {
 
 DataModel dm;
 
-std::thread threads[NUM_TH];
-int thCnt;
-std::mutex mtx;
-void multThBuild(int thid)
-{
-    int treeid;
-    while (1)
-    {
-        mtx.lock();
-        treeid=thCnt++;
-        mtx.unlock();
-        if (treeid>=NUM_TREE)
-            return;
-        // printf("init tree %d in thread %d\n",boxtree::treeorder[treeid],thid);
-        boxtree::initBuild(boxtree::rdb[boxtree::treeorder[treeid]]);      
-    }
-    return;   
-}
-void multThQuery(int thid, boxtree::rect search_box)
-{
-    int treeid;
-    while (1)
-    {
-        mtx.lock();
-        treeid=thCnt++;
-        mtx.unlock();
-        if (treeid>=NUM_TREE)
-            return;
-        boxtree::queryBOXTree(boxtree::rdb[boxtree::treeorder[treeid]],1,search_box,boxtree::ans[boxtree::treeorder[treeid]]);       
-    }
-    return;   
-}
-bool cmpans(boxtree::rect a, boxtree::rect b)
-{
-    if (a.xl!=b.xl) return a.xl<b.xl;
-    if (a.yl!=b.yl) return a.yl<b.yl;
-    if (a.xr!=b.xr) return a.xr<b.xr;
-    return a.yr<b.yr;
-}
-int initQuery() {    
+RQExecutor *executor = nullptr;
+// the index behind the Tcl commands and the free functions below
+RectQueryIndex *query_index = nullptr;
+
+static int checkQueryIndex() {
+    if (!query_index) {
+        message->issueMsg(kError, "query data is not initialized, run init_query first.\n");
+        return 1;
+    }
+    return 0;
+}
+
+typedef std::chrono::steady_clock TraceClock;
+
+// checked without the lock by every query, written under it
+static std::atomic<FILE *> trace_file(nullptr);
+static std::mutex trace_mutex;
+static TraceClock::time_point trace_start;
+
+static double secondsSince(TraceClock::time_point start) {
+    return std::chrono::duration<double>(TraceClock::now() - start).count();
+}
+
+// one line of the query trace; where is the "window" or "point" member,
+// extra holds more members to append, each with its leading comma
+static void traceQuery(const char *op, const char *where, uint64_t layer_mask,
+                       TraceClock::time_point start, double seconds, uint64_t results,
+                       const char *extra = "") {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (!trace_file) return;
+    fprintf(trace_file,
+            "{\"t\":%.6f,\"op\":\"%s\",%s,\"layer_mask\":\"0x%lx\",\"seconds\":%.9f,"
+            "\"results\":%lu%s}\n",
+            std::chrono::duration<double>(start - trace_start).count(), op, where,
+            layer_mask, seconds, results, extra);
+}
+
+static void traceWindow(const char *op, const Box &search_area, uint64_t layer_mask,
+                        TraceClock::time_point start, uint64_t results) {
+    if (!trace_file) return;
+    char where[128];
+    snprintf(where, sizeof(where), "\"window\":[%d,%d,%d,%d]", search_area.getLLX(),
+             search_area.getLLY(), search_area.getURX(), search_area.getURY());
+    traceQuery(op, where, layer_mask, start, secondsSince(start), results);
+}
+
+// counts the hits passed on, for the trace
+class TracingVisitor : public RQVisitor {
+  public:
+    explicit TracingVisitor(RQVisitor &visitor) : visitor_(visitor), count_(0) {}
+    bool visit(const RQHit *hits, int num_hits) {
+        count_ += num_hits;
+        return visitor_.visit(hits, num_hits);
+    }
+    uint64_t getCount() const { return count_; }
+
+  private:
+    RQVisitor &visitor_;
+    uint64_t count_;
+};
+
+int setQueryTrace(const std::string &file_name) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = nullptr;
+    }
+    if (file_name.empty()) return 0;
+    trace_file = fopen(file_name.c_str(), "w");
+    if (!trace_file) {
+        message->issueMsg(kError, "cannot open query trace %s.\n", file_name.c_str());
+        return 1;
+    }
+    trace_start = TraceClock::now();
+    return 0;
+}
+
+static void resetQueryIndex(int num_threads) {
+    delete query_index;
+    delete executor;
+    executor = new RQExecutor(num_threads);
+    query_index = new RectQueryIndex(executor);
+}
+
+const RectQueryIndex *getQueryIndex() {
+    return query_index;
+}
+
+int initQuery(int num_threads, RQPartition partition, RQEngine engine, bool instanced) {
     // add your code here to do initialization for query 
     Monitor monitor; 
-    dm.importAllGeometries();
+    resetQueryIndex(num_threads);
+
+    // shapes go from the import buffers straight into their trees, a buffer
+    // is freed as soon as it is placed
+    std::vector<std::vector<LRect> > chunks;
+    LInstances instances;
+    dm.importGeometryChunks(executor, chunks, instanced ? &instances : nullptr);
     monitor.print("import geometries");
 
     monitor.reset();
-    std::vector<LRect> rects = dm.getGeometries();
-    std::vector<boxtree::rect> tmprect;
-    int tmpsize=rects.size();
-    for (int i=0;i<tmpsize;i++)
-        tmprect.push_back({rects[i].rect_.getLLX(),rects[i].rect_.getLLY(),rects[i].rect_.getURX(),rects[i].rect_.getURY()});
-    boxtree::allocatetree(tmprect);
-
-    thCnt=0;
-    for (int i=0;i<NUM_TH;i++)
-        threads[i]=std::thread(multThBuild,i);
-    for (int i=0;i<NUM_TH;i++) 
-        threads[i].join();
+    query_index->build(chunks, partition, engine, instanced ? &instances : nullptr);
         
     monitor.printInternal("build");
     return 0;
 }
 
+// a saved index is tied to the .db written by WriteDesign it was built
+// from, so that any edit to the design makes it stale
+static int getDesignKey(const std::string &db_file, RQDesignKey &design) {
+    if (db_file.empty()) {
+        message->issueMsg(kError, "a saved query index needs the .db file of its design.\n");
+        return 1;
+    }
+    return hashDesignFile(db_file, design) ? 0 : 1;
+}
+
+int saveQuery(const std::string &file_name, const std::string &db_file) {
+    if (checkQueryIndex() != 0) return 1;
+    RQDesignKey design;
+    if (getDesignKey(db_file, design) != 0) return 1;
+    Monitor monitor;
+    if (!query_index->save(file_name, design)) return 1;
+    monitor.printInternal("save query index");
+    return 0;
+}
+
+// falls back to a full build when the index is missing or stale
+int loadQuery(const std::string &file_name, const std::string &db_file, int num_threads,
+              RQPartition partition, RQEngine engine, bool instanced, bool save_rebuilt) {
+    RQDesignKey design;
+    if (getDesignKey(db_file, design) != 0) return 1;
+    Monitor monitor;
+    resetQueryIndex(num_threads);
+    if (query_index->load(file_name, design, partition, engine, instanced)) {
+        monitor.printInternal("load query index");
+        return 0;
+    }
+    message->info("rebuilding query index %s.\n", file_name.c_str());
+    initQuery(num_threads, partition, engine, instanced);
+    return save_rebuilt ? saveQuery(file_name, db_file) : 0;
+}
+
+void reportMemory() {
+    if (checkQueryIndex() != 0) return;
+    query_index->reportMemory();
+}
+
 int query(const Box &search_area) {
+    return query(search_area, ALL_LAYERS);
+}
+
+// only the trees built for layers set in layer_mask (bit = LEF layer index) are visited
+int query(const Box &search_area, uint64_t layer_mask) {
+    if (checkQueryIndex() != 0) return 1;
     Monitor monitor;
     // add your code here to query data
-    boxtree::rect search_box={search_area.getLLX(),search_area.getLLY(),search_area.getURX(),search_area.getURY()};
-    thCnt=0;
-    for (int i=0;i<NUM_TH;i++)
-        threads[i]=std::thread(multThQuery,i,search_box);
-    for (int i=0;i<NUM_TH;i++) 
-        threads[i].join();
-    for (int i=0;i<NUM_TREE;i++)
-        printf("result: %ld\n",boxtree::ans[i].size());
+    // hits are only counted, so even the full core box needs no memory for
+    // them
+    TraceClock::time_point start = TraceClock::now();
+    std::vector<uint64_t> counts;
+    query_index->queryTreeCounts(search_area, layer_mask, counts);
+    uint64_t total = 0;
+    for (unsigned int i=0;i<counts.size();i++) {
+        printf("result: %ld\n",counts[i]);
+        total += counts[i];
+    }
+    traceWindow("query", search_area, layer_mask, start, total);
     monitor.printInternal("query");
+    return 0;
+}
+
+int query(const Box &search_area, uint64_t layer_mask, RQVisitor &visitor) {
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    TracingVisitor tracing(visitor);
+    query_index->query(search_area, layer_mask, tracing);
+    traceWindow("query_visit", search_area, layer_mask, start, tracing.getCount());
+    return 0;
+}
+
+int queryObjects(const Box &search_area, uint64_t layer_mask, std::vector<RQHit> &hits) {
+    hits.clear();
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryObjects(search_area, layer_mask, hits);
+    traceWindow("query_objects", search_area, layer_mask, start, hits.size());
+    return 0;
+}
+
+int querySorted(const Box &search_area, uint64_t layer_mask, bool unique,
+                std::vector<RQHit> &hits) {
+    hits.clear();
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->querySorted(search_area, layer_mask, unique, hits);
+    traceWindow(unique ? "query_unique" : "query_sorted", search_area, layer_mask, start,
+                hits.size());
+    return 0;
+}
+
+int queryCount(const Box &search_area, uint64_t layer_mask, uint64_t &count) {
+    count = 0;
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    count = query_index->queryCount(search_area, layer_mask);
+    traceWindow("query_count", search_area, layer_mask, start, count);
+    return 0;
+}
+
+int queryAny(const Box &search_area, uint64_t layer_mask, bool &found) {
+    found = false;
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    found = query_index->queryAny(search_area, layer_mask);
+    traceWindow("query_any", search_area, layer_mask, start, found);
+    return 0;
+}
+
+int queryStats(const Box &search_area, uint64_t layer_mask, RQQueryStats &stats) {
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryStats(search_area, layer_mask, stats);
+    traceWindow("query_stats", search_area, layer_mask, start, stats.hits);
+    return 0;
+}
+
+int queryDensity(const Box &search_area, int num_x, int num_y, uint64_t layer_mask,
+                 std::vector<double> &areas) {
+    areas.clear();
+    if (checkQueryIndex() != 0) return 1;
+    if (num_x < 1 || num_y < 1 || search_area.getURX() <= search_area.getLLX() ||
+        search_area.getURY() <= search_area.getLLY()) {
+        message->issueMsg(kError, "query_density needs a window with area and at least one bin.\n");
+        return 1;
+    }
+    if ((long long)num_x * num_y > kMaxDensityBins) {
+        message->issueMsg(kError, "query_density takes at most %d bins.\n", kMaxDensityBins);
+        return 1;
+    }
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryDensity(search_area, num_x, num_y, layer_mask, areas);
+    if (trace_file) {
+        char where[128], extra[64];
+        snprintf(where, sizeof(where), "\"window\":[%d,%d,%d,%d]", search_area.getLLX(),
+                 search_area.getLLY(), search_area.getURX(), search_area.getURY());
+        snprintf(extra, sizeof(extra), ",\"bins\":[%d,%d]", num_x, num_y);
+        traceQuery("query_density", where, layer_mask, start, secondsSince(start), areas.size(),
+                   extra);
+    }
+    return 0;
+}
+
+int queryBatch(const std::vector<Box> &search_areas, uint64_t layer_mask,
+               std::vector<RQHit> &hits, std::vector<size_t> &offsets) {
+    hits.clear();
+    offsets.assign(1, 0);
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryBatch(search_areas, layer_mask, hits, offsets);
+    // the windows of a batch run interleaved, so each line gets an even
+    // share of the time of the whole batch
+    if (trace_file && !search_areas.empty()) {
+        double seconds = secondsSince(start);
+        for (unsigned int i = 0; i < search_areas.size(); i++) {
+            char where[128], extra[64];
+            const Box &area = search_areas[i];
+            snprintf(where, sizeof(where), "\"window\":[%d,%d,%d,%d]", area.getLLX(),
+                     area.getLLY(), area.getURX(), area.getURY());
+            snprintf(extra, sizeof(extra), ",\"batch_seconds\":%.9f,\"batch_size\":%lu",
+                     seconds, search_areas.size());
+            traceQuery("query_batch", where, layer_mask, start, seconds / search_areas.size(),
+                       offsets[i + 1] - offsets[i], extra);
+        }
+    }
+    return 0;
+}
+
+int queryBatch(const std::vector<Box> &search_areas, std::vector<RQHit> &hits,
+               std::vector<size_t> &offsets) {
+    return queryBatch(search_areas, ALL_LAYERS, hits, offsets);
+}
+
+static void tracePoint(const char *op, const Point &point, uint64_t layer_mask,
+                       TraceClock::time_point start, double seconds, uint64_t results,
+                       const char *extra = "") {
+    char where[64];
+    snprintf(where, sizeof(where), "\"point\":[%d,%d]", point.getX(), point.getY());
+    traceQuery(op, where, layer_mask, start, seconds, results, extra);
+}
+
+int queryPoint(const Point &point, uint64_t layer_mask, RQPointHits &hits) {
+    hits.clear();
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryPoint(point, layer_mask, hits);
+    if (trace_file) {
+        tracePoint("query_point", point, layer_mask, start, secondsSince(start), hits.size());
+    }
+    return 0;
+}
+
+int queryPointBatch(const std::vector<Point> &points, uint64_t layer_mask,
+                    std::vector<RQHit> &hits, std::vector<size_t> &offsets) {
+    hits.clear();
+    offsets.assign(1, 0);
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryPointBatch(points, layer_mask, hits, offsets);
+    // like query_batch, every point gets an even share of the batch time
+    if (trace_file && !points.empty()) {
+        double seconds = secondsSince(start);
+        char extra[64];
+        snprintf(extra, sizeof(extra), ",\"batch_seconds\":%.9f,\"batch_size\":%lu", seconds,
+                 points.size());
+        for (unsigned int i = 0; i < points.size(); i++) {
+            tracePoint("query_point_batch", points[i], layer_mask, start,
+                       seconds / points.size(), offsets[i + 1] - offsets[i], extra);
+        }
+    }
+    return 0;
+}
+
+int queryNearest(const Point &point, int k, uint64_t layer_mask, double max_distance,
+                 RQDistanceMetric metric, std::vector<RQHit> &hits,
+                 std::vector<double> &distances) {
+    hits.clear();
+    distances.clear();
+    if (checkQueryIndex() != 0) return 1;
+    TraceClock::time_point start = TraceClock::now();
+    query_index->queryNearest(point, k, layer_mask, max_distance, metric, hits, distances);
+    if (trace_file) {
+        char extra[96];
+        // json has no infinity: an unbounded search leaves max_distance out
+        int len = snprintf(extra, sizeof(extra), ",\"k\":%d,\"metric\":\"%s\"", k,
+                           metric == kRQEuclidean ? "euclidean" : "manhattan");
+        if (max_distance < std::numeric_limits<double>::infinity()) {
+            snprintf(extra + len, sizeof(extra) - len, ",\"max_distance\":%.17g", max_distance);
+        }
+        tracePoint("query_nearest", point, layer_mask, start, secondsSince(start), hits.size(),
+                   extra);
+    }
+    return 0;
+}
 
-    // message->info("search result is :\n");
-    // std::vector<boxtree::rect> tmpans;
-    // for (int i = 0; i < NUM_TREE; i++)
-    //     for (unsigned int j = 0; j < boxtree::ans[i].size(); j++) 
-    //         tmpans.push_back(boxtree::ans[i][j]);
-    // sort(tmpans.begin(),tmpans.end(),cmpans);
-    // for (unsigned int i = 0; i < tmpans.size(); i++) 
-    // {      
-    //     message->info("%d %d %d %d\n", tmpans[i].xl, tmpans[i].yl, tmpans[i].xr, tmpans[i].yr);
-    // }
+int queryPairs(uint64_t layer_mask, int spacing, RQPairVisitor &visitor) {
+    if (checkQueryIndex() != 0) return 1;
+    query_index->queryPairs(layer_mask, spacing, visitor);
+    return 0;
+}
+
+int rqInsert(const std::vector<ObjectId> &owners) {
+    if (checkQueryIndex() != 0) return 1;
+    DataModel eco;
+    std::set<ObjectId> taken;
+    for (unsigned int i = 0; i < owners.size(); i++) {
+        // a live owner would be indexed twice; rq_update replaces its shapes
+        if (query_index->indexed(owners[i]) || !taken.insert(owners[i]).second) {
+            message->issueMsg(kWarn, "object %lu is already indexed, skipped.\n", owners[i]);
+            continue;
+        }
+        if (!eco.importObject(owners[i])) {
+            message->issueMsg(kWarn, "object %lu has no shapes to index, skipped.\n", owners[i]);
+        }
+    }
+    query_index->insert(eco.getGeometries());
+    query_index->rebuildDegradedLayers();
     return 0;
 }
 
+int rqRemove(const std::vector<ObjectId> &owners) {
+    if (checkQueryIndex() != 0) return 1;
+    for (unsigned int i = 0; i < owners.size(); i++) {
+        query_index->remove(owners[i]);
+    }
+    query_index->rebuildDegradedLayers();
+    return 0;
+}
+
+// re-reads the owners from the db after they were moved or rerouted
+int rqUpdate(const std::vector<ObjectId> &owners) {
+    if (checkQueryIndex() != 0) return 1;
+    for (unsigned int i = 0; i < owners.size(); i++) {
+        query_index->remove(owners[i]);
+    }
+    return rqInsert(owners);
+}
+
 int cleanupQuery() {
     // add your code here to do cleanup for query
+    setQueryTrace("");
+    delete query_index;
+    query_index = nullptr;
+    dm.clear();
+    delete executor;
+    executor = nullptr;
+    return 0;
+}
+
+int getLayerMask(const std::vector<std::string> &layer_names, uint64_t &layer_mask) {
+    Tech *lib = getTopCell()->getTechLib();
+    layer_mask = 0;
+    for (unsigned int i = 0; i < layer_names.size(); i++) {
+        Layer *layer = lib->getLayerByName(layer_names[i].c_str());
+        if (!layer) {
+            message->issueMsg(kError, "cannot find layer %s.\n", layer_names[i].c_str());
+            return 1;
+        }
+        if (layer->getIndexInLef() >= MAX_LAYER_NUM) {
+            message->issueMsg(kError, "layer %s exceeds the maximum %d layers of query.\n",
+                              layer_names[i].c_str(), MAX_LAYER_NUM);
+            return 1;
+        }
+        layer_mask |= (uint64_t)1 << layer->getIndexInLef();
+    }
     return 0;
 }
 
 int cmdInitQuery(Command* cmd) {
-    initQuery();
+    int num_threads = kDefaultQueryThreads;
+    if (cmd->isOptionSet("-threads")) {
+        cmd->getOptionValue("-threads", num_threads);
+    }
+    std::string db_file;
+    if (cmd->isOptionSet("-db")) {
+        cmd->getOptionValue("-db", db_file);
+    }
+    RQPartition partition = kRQPartitionShard;
+    if (cmd->isOptionSet("-partition")) {
+        std::string mode;
+        cmd->getOptionValue("-partition", mode);
+        if (mode == "spatial") {
+            partition = kRQPartitionSpatial;
+        } else if (mode != "shard") {
+            message->issueMsg(kError, "unknown partition %s, expect shard or spatial.\n",
+                              mode.c_str());
+            return TCL_ERROR;
+        }
+    }
+    RQEngine engine = kRQEngineBoxTree;
+    if (cmd->isOptionSet("-engine")) {
+        std::string name;
+        cmd->getOptionValue("-engine", name);
+        if (name == "hrtree") {
+            engine = kRQEngineHRTree;
+        } else if (name != "boxtree") {
+            message->issueMsg(kError, "unknown engine %s, expect boxtree or hrtree.\n",
+                              name.c_str());
+            return TCL_ERROR;
+        }
+    }
+    bool instanced = cmd->isOptionSet("-instanced");
+    // checked before the build, which may take long
+    if ((cmd->isOptionSet("-save") || cmd->isOptionSet("-load")) && db_file.empty()) {
+        message->issueMsg(kError, "-save and -load need -db.\n");
+        return TCL_ERROR;
+    }
+    std::string save_file;
+    if (cmd->isOptionSet("-save")) {
+        cmd->getOptionValue("-save", save_file);
+    }
+    if (cmd->isOptionSet("-load")) {
+        std::string file_name;
+        cmd->getOptionValue("-load", file_name);
+        // with -save a rebuilt index is only written there, once
+        if (loadQuery(file_name, db_file, num_threads, partition, engine, instanced,
+                      save_file.empty()) != 0) {
+            return TCL_ERROR;
+        }
+    } else {
+        initQuery(num_threads, partition, engine, instanced);
+    }
+    if (!save_file.empty() && saveQuery(save_file, db_file) != 0) return TCL_ERROR;
+    if (cmd->isOptionSet("-report_memory")) {
+        reportMemory();
+    }
     return TCL_OK;
 }
 
+static const char *kind_names[kRQShapeKindNum] = {
+    "wire", "via", "patch", "inst_pin", "inst_obs", "io_pin", "routing_blockage"};
+
+// the false positive ratio is the share of rects tested in leaf scans
+// that missed the window
+static double falsePositiveRatio(const boxtree::querystats &counts) {
+    return counts.tested ? (double)(counts.tested - counts.matched) / counts.tested : 0;
+}
+
+static void printQueryStats(const RQQueryStats &stats) {
+    message->info("%-6s %-6s %-5s %10s %10s %10s %10s %10s %6s %10s\n", "tree", "layer", "type",
+                  "visited", "pruned", "inside", "tested", "hits", "fp", "ms");
+    boxtree::querystats total = boxtree::querystats();
+    for (unsigned int i = 0; i < stats.trees.size(); i++) {
+        const RQTreeStats &tree = stats.trees[i];
+        const boxtree::querystats &counts = tree.counts;
+        message->info("%-6d %-6d %-5d %10lld %10lld %10lld %10lld %10lld %6.3f %10.3f\n",
+                      tree.tree, tree.layer, tree.type, counts.visited, counts.pruned,
+                      counts.inside, counts.tested, counts.hits, falsePositiveRatio(counts),
+                      tree.seconds * 1e3);
+        total.visited += counts.visited;
+        total.pruned += counts.pruned;
+        total.inside += counts.inside;
+        total.tested += counts.tested;
+        total.matched += counts.matched;
+        total.hits += counts.hits;
+    }
+    message->info("%-18s %10lld %10lld %10lld %10lld %10lld %6.3f %10.3f\n", "total",
+                  total.visited, total.pruned, total.inside, total.tested, total.hits,
+                  falsePositiveRatio(total), stats.seconds * 1e3);
+    for (unsigned int i = 0; i < stats.thread_seconds.size(); i++) {
+        message->info("thread %u: %.3f ms\n", i, stats.thread_seconds[i] * 1e3);
+    }
+    message->info("result: %lu\n", stats.hits);
+}
+
 int cmdQuery(Command* cmd) {
     Box search_area;
     if (cmd->isOptionSet("area")) {
@@ -124,7 +552,391 @@ int cmdQuery(Command* cmd) {
         search_area = getTopCell()->getFloorplan()->getCoreBox();
         // if core box is not set, use die area as searching area
     }
-    query(search_area);
+    uint64_t layer_mask = ALL_LAYERS;
+    if (cmd->isOptionSet("-layers")) {
+        std::vector<std::string> layer_names;
+        cmd->getOptionValue("-layers", layer_names);
+        if (getLayerMask(layer_names, layer_mask) != 0) {
+            return TCL_ERROR;
+        }
+    }
+    if (cmd->isOptionSet("-stats")) {
+        RQQueryStats stats;
+        if (queryStats(search_area, layer_mask, stats) != 0) {
+            return TCL_ERROR;
+        }
+        printQueryStats(stats);
+        return TCL_OK;
+    }
+    bool sorted = cmd->isOptionSet("-sorted") || cmd->isOptionSet("-unique");
+    if (!cmd->isOptionSet("-objects") && !sorted) {
+        query(search_area, layer_mask);
+        return TCL_OK;
+    }
+    Monitor monitor;
+    std::vector<RQHit> hits;
+    int result = sorted ? querySorted(search_area, layer_mask, cmd->isOptionSet("-unique"), hits)
+                        : queryObjects(search_area, layer_mask, hits);
+    if (result != 0) {
+        return TCL_ERROR;
+    }
+    for (unsigned int i = 0; i < hits.size(); i++) {
+        message->info("%d %d %d %d layer %d %s object %lu owner %lu\n",
+                      hits[i].rect.getLLX(), hits[i].rect.getLLY(),
+                      hits[i].rect.getURX(), hits[i].rect.getURY(), hits[i].layer,
+                      kind_names[hits[i].kind], hits[i].object, hits[i].owner);
+    }
+    message->info("result: %lu\n", hits.size());
+    monitor.printInternal("query");
+    return TCL_OK;
+}
+
+// num_coords integers per line, appended to coords; '#' starts a comment
+// and braces are ignored, so Tcl lists can be pasted in
+static int readCoordsFile(const std::string &file_name, const char *what, int num_coords,
+                          const char *format, std::vector<int> &coords) {
+    std::ifstream in(file_name.c_str());
+    if (!in.is_open()) {
+        message->issueMsg(kError, "cannot open %s file %s.\n", what, file_name.c_str());
+        return 1;
+    }
+    std::string line;
+    int line_num = 0;
+    while (std::getline(in, line)) {
+        ++line_num;
+        std::size_t comment = line.find('#');
+        if (comment != std::string::npos) line.erase(comment);
+        if (line.find_first_not_of(" \t\r{}") == std::string::npos) continue;
+        for (unsigned int i = 0; i < line.size(); i++) {
+            if (line[i] == '{' || line[i] == '}') line[i] = ' ';
+        }
+        std::istringstream fields(line);
+        for (int i = 0; i < num_coords; i++) {
+            int coord;
+            if (!(fields >> coord)) {
+                message->issueMsg(kError, "%s:%d: expect \"%s\".\n", file_name.c_str(),
+                                  line_num, format);
+                return 1;
+            }
+            coords.push_back(coord);
+        }
+    }
+    return 0;
+}
+
+// one window per line: llx lly urx ury
+static int readAreasFile(const std::string &file_name, std::vector<Box> &search_areas) {
+    std::vector<int> coords;
+    if (readCoordsFile(file_name, "areas", 4, "llx lly urx ury", coords) != 0) return 1;
+    for (unsigned int i = 0; i < coords.size(); i += 4) {
+        search_areas.push_back(Box(coords[i], coords[i + 1], coords[i + 2], coords[i + 3]));
+    }
+    return 0;
+}
+
+// one point per line: x y
+static int readPointsFile(const std::string &file_name, std::vector<Point> &points) {
+    std::vector<int> coords;
+    if (readCoordsFile(file_name, "points", 2, "x y", coords) != 0) return 1;
+    for (unsigned int i = 0; i < coords.size(); i += 2) {
+        points.push_back(Point(coords[i], coords[i + 1]));
+    }
+    return 0;
+}
+
+int cmdQueryBatch(Command* cmd) {
+    std::string file_name;
+    cmd->getOptionValue("-areas_file", file_name);
+    uint64_t layer_mask = ALL_LAYERS;
+    if (cmd->isOptionSet("-layers")) {
+        std::vector<std::string> layer_names;
+        cmd->getOptionValue("-layers", layer_names);
+        if (getLayerMask(layer_names, layer_mask) != 0) {
+            return TCL_ERROR;
+        }
+    }
+    std::vector<Box> search_areas;
+    if (readAreasFile(file_name, search_areas) != 0) {
+        return TCL_ERROR;
+    }
+    std::vector<RQHit> hits;
+    std::vector<size_t> offsets;
+    Monitor monitor;
+    if (queryBatch(search_areas, layer_mask, hits, offsets) != 0) {
+        return TCL_ERROR;
+    }
+    double elapsed = monitor.getElapsedTime();
+    message->info("query_batch: %lu windows, %lu results, %.0f queries/sec\n",
+                  search_areas.size(), hits.size(),
+                  elapsed > 0 ? search_areas.size() / elapsed : 0.0);
+    monitor.printInternal("query_batch");
+    return TCL_OK;
+}
+
+int cmdQueryPoint(Command* cmd) {
+    uint64_t layer_mask = ALL_LAYERS;
+    if (cmd->isOptionSet("-layers")) {
+        std::vector<std::string> layer_names;
+        cmd->getOptionValue("-layers", layer_names);
+        if (getLayerMask(layer_names, layer_mask) != 0) {
+            return TCL_ERROR;
+        }
+    }
+    Monitor monitor;
+    if (cmd->isOptionSet("-points_file")) {
+        std::string file_name;
+        cmd->getOptionValue("-points_file", file_name);
+        std::vector<Point> points;
+        if (readPointsFile(file_name, points) != 0) {
+            return TCL_ERROR;
+        }
+        monitor.reset();
+        std::vector<RQHit> hits;
+        std::vector<size_t> offsets;
+        if (queryPointBatch(points, layer_mask, hits, offsets) != 0) {
+            return TCL_ERROR;
+        }
+        double elapsed = monitor.getElapsedTime();
+        message->info("query_point: %lu points, %lu results, %.0f queries/sec\n", points.size(),
+                      hits.size(), elapsed > 0 ? points.size() / elapsed : 0.0);
+        monitor.printInternal("query_point");
+        return TCL_OK;
+    }
+    if (!cmd->isOptionSet("-point")) {
+        message->issueMsg(kError, "query_point needs -point or -points_file.\n");
+        return TCL_ERROR;
+    }
+    Point point;
+    cmd->getOptionValue("-point", point);
+    RQPointHits hits;
+    if (queryPoint(point, layer_mask, hits) != 0) {
+        return TCL_ERROR;
+    }
+    for (int i = 0; i < hits.size(); i++) {
+        message->info("%d %d %d %d layer %d %s object %lu owner %lu\n",
+                      hits[i].rect.getLLX(), hits[i].rect.getLLY(),
+                      hits[i].rect.getURX(), hits[i].rect.getURY(), hits[i].layer,
+                      kind_names[hits[i].kind], hits[i].object, hits[i].owner);
+    }
+    message->info("result: %d\n", hits.size());
+    monitor.printInternal("query_point");
+    return TCL_OK;
+}
+
+// low edge of bin i of num_bins over [low, high], as RectQueryIndex::queryDensity cuts them
+static int binEdge(int low, int high, int num_bins, int i) {
+    return low + (int)(((long long)high - low) * i / num_bins);
+}
+
+int cmdQueryDensity(Command* cmd) {
+    Box search_area;
+    if (cmd->isOptionSet("area")) {
+        cmd->getOptionValue("area", search_area);
+    } else {
+        search_area = getTopCell()->getFloorplan()->getCoreBox();
+    }
+    int num_x = 1, num_y = 1;
+    if (cmd->isOptionSet("-bins")) {
+        std::vector<int> bins;
+        cmd->getOptionValue("-bins", bins);
+        if (bins.size() != 2 || bins[0] < 1 || bins[1] < 1) {
+            message->issueMsg(kError, "-bins expects two positive counts: {x y}.\n");
+            return TCL_ERROR;
+        }
+        num_x = bins[0];
+        num_y = bins[1];
+    }
+    uint64_t layer_mask = ALL_LAYERS;
+    if (cmd->isOptionSet("-layers")) {
+        std::vector<std::string> layer_names;
+        cmd->getOptionValue("-layers", layer_names);
+        if (getLayerMask(layer_names, layer_mask) != 0) {
+            return TCL_ERROR;
+        }
+    }
+    Monitor monitor;
+    std::vector<double> areas;
+    if (queryDensity(search_area, num_x, num_y, layer_mask, areas) != 0) {
+        return TCL_ERROR;
+    }
+    int llx = search_area.getLLX(), lly = search_area.getLLY();
+    int urx = search_area.getURX(), ury = search_area.getURY();
+    // one line per row of bins, the top row first as on a layout view
+    if (num_x * num_y > 1) {
+        for (int j = num_y - 1; j >= 0; j--) {
+            double height = binEdge(lly, ury, num_y, j + 1) - binEdge(lly, ury, num_y, j);
+            std::string row;
+            for (int i = 0; i < num_x; i++) {
+                double width = binEdge(llx, urx, num_x, i + 1) - binEdge(llx, urx, num_x, i);
+                char density[32];
+                snprintf(density, sizeof(density), i ? " %.4f" : "%.4f",
+                         width > 0 && height > 0 ? areas[j * num_x + i] / (width * height) : 0.0);
+                row += density;
+            }
+            message->info("row %d: %s\n", j, row.c_str());
+        }
+    }
+    double covered = 0;
+    for (unsigned int i = 0; i < areas.size(); i++) {
+        covered += areas[i];
+    }
+    message->info("area: %.0f density: %.4f\n", covered,
+                  covered / ((double)(urx - llx) * (ury - lly)));
+    monitor.printInternal("query_density");
+    return TCL_OK;
+}
+
+int cmdQueryNearest(Command* cmd) {
+    Point point;
+    cmd->getOptionValue("-point", point);
+    int k = 1;
+    if (cmd->isOptionSet("-k")) {
+        cmd->getOptionValue("-k", k);
+    }
+    double max_distance = std::numeric_limits<double>::infinity();
+    if (cmd->isOptionSet("-max_distance")) {
+        cmd->getOptionValue("-max_distance", max_distance);
+    }
+    RQDistanceMetric metric = cmd->isOptionSet("-euclidean") ? kRQEuclidean : kRQManhattan;
+    uint64_t layer_mask = ALL_LAYERS;
+    if (cmd->isOptionSet("-layers")) {
+        std::vector<std::string> layer_names;
+        cmd->getOptionValue("-layers", layer_names);
+        if (getLayerMask(layer_names, layer_mask) != 0) {
+            return TCL_ERROR;
+        }
+    }
+    Monitor monitor;
+    std::vector<RQHit> hits;
+    std::vector<double> distances;
+    if (queryNearest(point, k, layer_mask, max_distance, metric, hits, distances) != 0) {
+        return TCL_ERROR;
+    }
+    for (unsigned int i = 0; i < hits.size(); i++) {
+        message->info("%.1f %d %d %d %d layer %d %s object %lu owner %lu\n", distances[i],
+                      hits[i].rect.getLLX(), hits[i].rect.getLLY(),
+                      hits[i].rect.getURX(), hits[i].rect.getURY(), hits[i].layer,
+                      kind_names[hits[i].kind], hits[i].object, hits[i].owner);
+    }
+    message->info("result: %lu\n", hits.size());
+    monitor.printInternal("query_nearest");
+    return TCL_OK;
+}
+
+// counts the pairs each thread sees, summed once the join is done
+class PairCounter : public RQPairVisitor {
+  public:
+    explicit PairCounter(int num_threads) : counts_(num_threads, 0) {}
+    bool visit(const RQHit *first, const RQHit *second, int num_pairs, int thread_id) {
+        counts_[thread_id] += num_pairs;
+        return true;
+    }
+    uint64_t getCount() const {
+        uint64_t count = 0;
+        for (unsigned int i = 0; i < counts_.size(); i++) count += counts_[i];
+        return count;
+    }
+
+  private:
+    std::vector<uint64_t> counts_;
+};
+
+int cmdQueryPairs(Command* cmd) {
+    int spacing = 0;
+    if (cmd->isOptionSet("-spacing")) {
+        cmd->getOptionValue("-spacing", spacing);
+    }
+    uint64_t layer_mask = ALL_LAYERS;
+    if (cmd->isOptionSet("-layers")) {
+        std::vector<std::string> layer_names;
+        cmd->getOptionValue("-layers", layer_names);
+        if (getLayerMask(layer_names, layer_mask) != 0) {
+            return TCL_ERROR;
+        }
+    }
+    if (checkQueryIndex() != 0) return TCL_ERROR;
+    Monitor monitor;
+    PairCounter counter(executor->getNumThreads());
+    if (queryPairs(layer_mask, spacing, counter) != 0) {
+        return TCL_ERROR;
+    }
+    message->info("result: %lu pairs\n", counter.getCount());
+    monitor.printInternal("query_pairs");
+    return TCL_OK;
+}
+
+static int getEcoOwners(Command* cmd, std::vector<ObjectId> &owners) {
+    Cell *top_cell = getTopCell();
+    std::vector<std::string> names;
+    if (cmd->isOptionSet("-insts")) {
+        cmd->getOptionValue("-insts", names);
+        for (unsigned int i = 0; i < names.size(); i++) {
+            Inst *inst = top_cell->getInstance(names[i]);
+            if (!inst) {
+                message->issueMsg(kError, "cannot find instance %s.\n", names[i].c_str());
+                return 1;
+            }
+            owners.push_back(inst->getId());
+        }
+    }
+    if (cmd->isOptionSet("-nets")) {
+        cmd->getOptionValue("-nets", names);
+        for (unsigned int i = 0; i < names.size(); i++) {
+            Net *net = top_cell->getNet(names[i]);
+            SpecialNet *special_net = net ? nullptr : top_cell->getSpecialNet(names[i]);
+            if (!net && !special_net) {
+                message->issueMsg(kError, "cannot find net %s.\n", names[i].c_str());
+                return 1;
+            }
+            owners.push_back(net ? net->getId() : special_net->getId());
+        }
+    }
+    if (cmd->isOptionSet("-io_pins")) {
+        cmd->getOptionValue("-io_pins", names);
+        for (unsigned int i = 0; i < names.size(); i++) {
+            Pin *pin = top_cell->getIOPin(names[i]);
+            if (!pin) {
+                message->issueMsg(kError, "cannot find io pin %s.\n", names[i].c_str());
+                return 1;
+            }
+            owners.push_back(pin->getId());
+        }
+    }
+    return 0;
+}
+
+int cmdQueryTrace(Command* cmd) {
+    std::string file_name;
+    if (cmd->isOptionSet("-file")) {
+        cmd->getOptionValue("-file", file_name);
+    }
+    return setQueryTrace(file_name) == 0 ? TCL_OK : TCL_ERROR;
+}
+
+int cmdRQInsert(Command* cmd) {
+    std::vector<ObjectId> owners;
+    if (getEcoOwners(cmd, owners) != 0) return TCL_ERROR;
+    Monitor monitor;
+    if (rqInsert(owners) != 0) return TCL_ERROR;
+    monitor.printInternal("rq_insert");
+    return TCL_OK;
+}
+
+int cmdRQRemove(Command* cmd) {
+    std::vector<ObjectId> owners;
+    if (getEcoOwners(cmd, owners) != 0) return TCL_ERROR;
+    Monitor monitor;
+    if (rqRemove(owners) != 0) return TCL_ERROR;
+    monitor.printInternal("rq_remove");
+    return TCL_OK;
+}
+
+int cmdRQUpdate(Command* cmd) {
+    std::vector<ObjectId> owners;
+    if (getEcoOwners(cmd, owners) != 0) return TCL_ERROR;
+    Monitor monitor;
+    if (rqUpdate(owners) != 0) return TCL_ERROR;
+    monitor.printInternal("rq_update");
     return TCL_OK;
 }
 
@@ -13,18 +13,88 @@
 
 #include "infra/command_manager.h"
 #include "db/rq/data_model.h"
+#include "db/rq/obtree.h"
+#include "db/rq/rq_index.h"
 
 namespace open_edi {
 namespace db {
 
 using namespace open_edi::infra;
 
-int initQuery();
+const int kDefaultQueryThreads = 4;
+// query_density keeps a copy of the bins per thread
+const int kMaxDensityBins = 1 << 24;
+
+// the index built by init_query, nullptr before it and after cleanup_query;
+// iterate it with RQQueryIterator
+const RectQueryIndex *getQueryIndex();
+// instanced indexes the pin and OBS shapes of each master once and every
+// Inst as a placement of them, see LInstances
+int initQuery(int num_threads = kDefaultQueryThreads,
+              RQPartition partition = kRQPartitionShard,
+              RQEngine engine = kRQEngineBoxTree,
+              bool instanced = false);
+// db_file is the .db the design was read from, it ties the saved index to it
+int saveQuery(const std::string &file_name, const std::string &db_file);
+// an index saved with another partition, engine or instanced layout counts
+// as stale and is rebuilt with these; a rebuilt index is written back to
+// file_name unless save_rebuilt is false, for a caller saving it elsewhere
+int loadQuery(const std::string &file_name, const std::string &db_file,
+              int num_threads = kDefaultQueryThreads,
+              RQPartition partition = kRQPartitionShard,
+              RQEngine engine = kRQEngineBoxTree,
+              bool instanced = false, bool save_rebuilt = true);
+void reportMemory();
 int query(const Box &search_area);
+int query(const Box &search_area, uint64_t layer_mask);
+// runs on the calling thread, so the visitor needs no locking
+int query(const Box &search_area, uint64_t layer_mask, RQVisitor &visitor);
+int queryObjects(const Box &search_area, uint64_t layer_mask, std::vector<RQHit> &hits);
+int querySorted(const Box &search_area, uint64_t layer_mask, bool unique,
+                std::vector<RQHit> &hits);
+int queryCount(const Box &search_area, uint64_t layer_mask, uint64_t &count);
+int queryAny(const Box &search_area, uint64_t layer_mask, bool &found);
+int queryStats(const Box &search_area, uint64_t layer_mask, RQQueryStats &stats);
+// areas[j * num_x + i] is the area covered in bin (i, j) of num_x by num_y
+// bins over search_area, see RectQueryIndex::queryDensity
+int queryDensity(const Box &search_area, int num_x, int num_y, uint64_t layer_mask,
+                 std::vector<double> &areas);
+// the hits of search_areas[i] are hits[offsets[i]] up to hits[offsets[i + 1]]
+int queryBatch(const std::vector<Box> &search_areas, std::vector<RQHit> &hits,
+               std::vector<size_t> &offsets);
+int queryBatch(const std::vector<Box> &search_areas, uint64_t layer_mask,
+               std::vector<RQHit> &hits, std::vector<size_t> &offsets);
+int queryPoint(const Point &point, uint64_t layer_mask, RQPointHits &hits);
+// the hits of points[i] are hits[offsets[i]] up to hits[offsets[i + 1]]
+int queryPointBatch(const std::vector<Point> &points, uint64_t layer_mask,
+                    std::vector<RQHit> &hits, std::vector<size_t> &offsets);
+int queryNearest(const Point &point, int k, uint64_t layer_mask, double max_distance,
+                 RQDistanceMetric metric, std::vector<RQHit> &hits,
+                 std::vector<double> &distances);
+// the visitor is called from all executor threads, see RQPairVisitor
+int queryPairs(uint64_t layer_mask, int spacing, RQPairVisitor &visitor);
+// shapes are keyed by their owner: inst, net, special net, io pin or routing blockage
+int rqInsert(const std::vector<ObjectId> &owners);
+int rqRemove(const std::vector<ObjectId> &owners);
+int rqUpdate(const std::vector<ObjectId> &owners);
 int cleanupQuery();
+// while a trace file is open every window and nearest query appends one
+// JSON line to it: start time, op, window or point, layer mask, seconds and
+// result count; an empty name closes it
+int setQueryTrace(const std::string &file_name);
+int getLayerMask(const std::vector<std::string> &layer_names, uint64_t &layer_mask);
 
 int cmdInitQuery(Command* cmd);
 int cmdQuery(Command* cmd);
+int cmdQueryBatch(Command* cmd);
+int cmdQueryPoint(Command* cmd);
+int cmdQueryDensity(Command* cmd);
+int cmdQueryNearest(Command* cmd);
+int cmdQueryPairs(Command* cmd);
+int cmdQueryTrace(Command* cmd);
+int cmdRQInsert(Command* cmd);
+int cmdRQRemove(Command* cmd);
+int cmdRQUpdate(Command* cmd);
 int cmdCleanupQuery(Command* cmd);
 
 }  // namespace db
@@ -0,0 +1,95 @@
+/* @file  rq_executor.cpp
+ * @date  <date>
+ * @brief Long-lived worker pool shared by rq build and query
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+
+#include "db/rq/rq_executor.h"
+
+namespace open_edi {
+namespace db {
+
+// queries are often shorter than a futex wake-up, so poll a while first
+static const int kSpinBeforePark = 2000;
+
+RQExecutor::RQExecutor(int num_threads)
+    : num_threads_(num_threads < 1 ? 1 : num_threads),
+      task_(nullptr),
+      num_tasks_(0),
+      next_task_(0),
+      pending_workers_(0),
+      generation_(0),
+      stop_(false) {
+    for (int i = 1; i < num_threads_; i++) {
+        workers_.push_back(std::thread(&RQExecutor::__workerLoop, this, i));
+    }
+}
+
+RQExecutor::~RQExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        generation_.fetch_add(1);
+    }
+    wake_cv_.notify_all();
+    for (unsigned int i = 0; i < workers_.size(); i++) {
+        workers_[i].join();
+    }
+}
+
+void RQExecutor::parallelFor(int num_tasks, const Task &task) {
+    if (num_tasks <= 0) return;
+    std::unique_lock<std::mutex> job(job_mutex_, std::defer_lock);
+    if (workers_.empty() || num_tasks == 1 || !job.try_lock()) {
+        for (int i = 0; i < num_tasks; i++) task(i, 0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        num_tasks_ = num_tasks;
+        next_task_.store(0);
+        pending_workers_.store(workers_.size());
+        generation_.fetch_add(1);
+    }
+    wake_cv_.notify_all();
+    __runTasks(0);
+    while (pending_workers_.load() > 0) {
+        std::this_thread::yield();
+    }
+    task_ = nullptr;
+}
+
+void RQExecutor::__runTasks(int thread_id) {
+    int task_id;
+    while ((task_id = next_task_.fetch_add(1)) < num_tasks_) {
+        (*task_)(task_id, thread_id);
+    }
+}
+
+void RQExecutor::__workerLoop(int thread_id) {
+    unsigned int seen = 0;
+    while (true) {
+        int spin = 0;
+        while (generation_.load() == seen && spin < kSpinBeforePark) {
+            ++spin;
+            std::this_thread::yield();
+        }
+        if (generation_.load() == seen) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_cv_.wait(lock, [&] { return generation_.load() != seen; });
+        }
+        seen = generation_.load();
+        if (stop_) return;
+        __runTasks(thread_id);
+        pending_workers_.fetch_sub(1);
+    }
+}
+
+}  // namespace db
+}  // namespace open_edi
@@ -0,0 +1,61 @@
+/* @file  rq_executor.h
+ * @date  <date>
+ * @brief Long-lived worker pool shared by rq build and query
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#ifndef SRC_DB_RQ_EXECUTOR_H_
+#define SRC_DB_RQ_EXECUTOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace open_edi {
+namespace db {
+
+// Workers are started once and parked between jobs. Inside a job, tasks are
+// claimed with an atomic counter, so no lock is taken on the hot path. The
+// calling thread works as thread 0, so an executor of n threads owns n - 1
+// workers. Only one job owns the workers at a time: a parallelFor issued
+// while another is running (from a second query thread) runs its tasks on
+// the calling thread instead of waiting. parallelFor must not be called from
+// inside a task.
+class RQExecutor {
+  public:
+    typedef std::function<void(int task_id, int thread_id)> Task;
+
+    explicit RQExecutor(int num_threads);
+    ~RQExecutor();
+
+    int getNumThreads() const { return num_threads_; }
+    void parallelFor(int num_tasks, const Task &task);
+
+  private:
+    void __workerLoop(int thread_id);
+    void __runTasks(int thread_id);
+
+    int num_threads_;
+    std::vector<std::thread> workers_;
+    std::mutex job_mutex_;  // held by the caller that owns the workers
+    std::mutex mutex_;
+    std::condition_variable wake_cv_;
+    const Task *task_;
+    int num_tasks_;
+    std::atomic<int> next_task_;
+    std::atomic<int> pending_workers_;
+    std::atomic<unsigned int> generation_;
+    bool stop_;
+};
+
+}  // namespace db
+}  // namespace open_edi
+
+#endif  // SRC_DB_RQ_EXECUTOR_H_
@@ -0,0 +1,993 @@
+/* @file  rq_index.cpp
+ * @date  <date>
+ * @brief A built rectangle query index, read by any number of threads
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+
+#include "db/rq/rq_index.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#include "db/rq/rq_index_io.h"
+
+namespace open_edi {
+namespace db {
+
+static void makeHit(const boxtree::rectdb &tree, int k, RQHit &hit) {
+    hit.rect = Box(tree.xl[k], tree.yl[k], tree.xr[k], tree.yr[k]);
+    hit.object = tree.source[k];
+    hit.owner = tree.owner[k];
+    hit.kind = static_cast<RQShapeKind>(tree.kind[k]);
+    hit.layer = tree.layer;
+}
+
+// shape k of the cell that rect i of an INST_TREE places
+static void makePlacedHit(const boxtree::forest &forest, const boxtree::rectdb &tree, int i,
+                          const boxtree::placement &p, int k, RQHit &hit) {
+    const boxtree::rectdb &cell = forest.cells[p.cell];
+    boxtree::rect a = boxtree::placeRect(p, cell.getrect(k));
+    hit.rect = Box(a.xl, a.yl, a.xr, a.yr);
+    hit.object = cell.source[k];
+    hit.owner = tree.owner[i];
+    hit.kind = static_cast<RQShapeKind>(cell.kind[k]);
+    hit.layer = tree.layer;
+}
+
+// The rects of an INST_TREE only bound the cells they place: emit(hit) is
+// called for the placed shapes of rects indices[0, n) that hit search_box.
+template <class Emit>
+static void expandPlaced(const boxtree::forest &forest, const boxtree::rectdb &tree,
+                         const int *indices, int n, const boxtree::rect &search_box,
+                         Emit emit) {
+    std::vector<int> sub;
+    for (int j = 0; j < n; j++) {
+        boxtree::placement p = boxtree::instPlacement(forest, tree, indices[j]);
+        sub.clear();
+        boxtree::placedHits(forest, p, search_box, sub);
+        for (unsigned int k = 0; k < sub.size(); k++) {
+            RQHit hit;
+            makePlacedHit(forest, tree, indices[j], p, sub[k], hit);
+            emit(hit);
+        }
+    }
+}
+
+// the shapes of tree in search_box; only an INST_TREE has its hits
+// expanded, other trees count inside subtrees without visiting them
+static long long countTree(const boxtree::forest &forest, const boxtree::rectdb &tree,
+                           const boxtree::rect &search_box) {
+    if (tree.type != INST_TREE) return boxtree::queryCountBOXTree(tree, search_box);
+    long long count = 0;
+    std::vector<int> indices, sub;
+    boxtree::queryIndexBOXTree(tree, search_box, indices);
+    for (unsigned int i = 0; i < indices.size(); i++) {
+        sub.clear();
+        boxtree::placedHits(forest, boxtree::instPlacement(forest, tree, indices[i]), search_box,
+                            sub);
+        count += sub.size();
+    }
+    return count;
+}
+
+// Walks an INST_TREE for any placed shape in search_box: every instance
+// found is expanded on its own and the walk stops at the first hit.
+class PlacedAnyVisitor : public boxtree::visitor {
+  public:
+    PlacedAnyVisitor(const boxtree::forest &forest, const boxtree::rect &search_box)
+        : forest_(forest), search_box_(search_box) {}
+    bool visit(const boxtree::rectdb &tree, const int *indices, int n) {
+        for (int i = 0; i < n; i++) {
+            sub_.clear();
+            boxtree::placedHits(forest_, boxtree::instPlacement(forest_, tree, indices[i]),
+                                search_box_, sub_);
+            if (!sub_.empty()) return false;
+        }
+        return true;
+    }
+
+  private:
+    const boxtree::forest &forest_;
+    const boxtree::rect &search_box_;
+    std::vector<int> sub_;
+};
+
+// Adds the hits of a point walk to Hits, RQPointHits or a vector. A rect of
+// an INST_TREE holds the point, so its cell is walked with the point moved
+// into the cell's frame.
+template <class Hits>
+class PointCollector : public boxtree::visitor {
+  public:
+    PointCollector(const boxtree::forest &forest, int x, int y, Hits &hits)
+        : forest_(forest), x_(x), y_(y), hits_(hits), inst_tree_(nullptr), inst_(0) {}
+    bool visit(const boxtree::rectdb &tree, const int *indices, int n) {
+        for (int i = 0; i < n; i++) {
+            RQHit hit;
+            if (inst_tree_) {
+                makePlacedHit(forest_, *inst_tree_, inst_, placement_, indices[i], hit);
+            } else if (tree.type != INST_TREE) {
+                makeHit(tree, indices[i], hit);
+            } else {
+                __walkCell(tree, indices[i]);
+                continue;
+            }
+            hits_.push_back(hit);
+        }
+        return true;
+    }
+
+  private:
+    void __walkCell(const boxtree::rectdb &tree, int i) {
+        PointCollector placed(forest_, x_, y_, hits_);
+        placed.inst_tree_ = &tree;
+        placed.inst_ = i;
+        placed.placement_ = boxtree::instPlacement(forest_, tree, i);
+        boxtree::rect at = boxtree::unplaceRect(placed.placement_, {x_, y_, x_, y_});
+        boxtree::visitPointBOXTree(forest_.cells[placed.placement_.cell], at.xl, at.yl, placed);
+    }
+
+    const boxtree::forest &forest_;
+    int x_, y_;
+    Hits &hits_;
+    // set while walking the cell placed by rect inst_ of inst_tree_
+    const boxtree::rectdb *inst_tree_;
+    int inst_;
+    boxtree::placement placement_;
+};
+
+// every tree whose layer is selected, without building a tree list; the
+// walk itself skips a tree whose box misses the point
+template <class Hits>
+static void pointHits(const boxtree::forest &forest, int x, int y, uint64_t layer_mask,
+                      Hits &hits) {
+    PointCollector<Hits> collector(forest, x, y, hits);
+    for (unsigned int i = 0; i < forest.treeorder.size(); i++) {
+        const boxtree::rectdb &tree = forest.rdb[forest.treeorder[i]];
+        if (tree.size() > 0 && boxtree::layerSelected(tree.layer, layer_mask)) {
+            boxtree::visitPointBOXTree(tree, x, y, collector);
+        }
+    }
+}
+
+static boxtree::rect toRect(const Box &box) {
+    boxtree::rect a = {box.getLLX(), box.getLLY(), box.getURX(), box.getURY()};
+    return a;
+}
+
+static boxtree::rect bloatRect(const Box &box, int bloat) {
+    return {box.getLLX() - bloat, box.getLLY() - bloat, box.getURX() + bloat,
+            box.getURY() + bloat};
+}
+
+// turns the index pairs of a join frame into hits for the caller; a rect of
+// an INST_TREE stands for its placed shapes, each paired with the shapes of
+// the other side within spacing of it
+class PairAdapter : public boxtree::pairvisitor {
+  public:
+    PairAdapter(const boxtree::forest &forest, int spacing, RQPairVisitor &visitor,
+                int thread_id)
+        : forest_(forest), spacing_(spacing), visitor_(visitor), thread_id_(thread_id),
+          num_pairs_(0) {}
+    bool visit(const boxtree::rectdb &ta, const int *ia,
+               const boxtree::rectdb &tb, const int *ib, int n) {
+        for (int i = 0; i < n; i++) {
+            if (ta.type != INST_TREE && tb.type != INST_TREE) {
+                makeHit(ta, ia[i], first_[num_pairs_]);
+                makeHit(tb, ib[i], second_[num_pairs_++]);
+                if (num_pairs_ == JOIN_BATCH && !flush()) return false;
+                continue;
+            }
+            first_hits_.clear();
+            second_hits_.clear();
+            __sideHits(ta, ia[i], first_hits_);
+            __sideHits(tb, ib[i], second_hits_);
+            for (unsigned int a = 0; a < first_hits_.size(); a++) {
+                boxtree::rect q = bloatRect(first_hits_[a].rect, spacing_);
+                for (unsigned int b = 0; b < second_hits_.size(); b++) {
+                    if (!boxtree::outbox(toRect(second_hits_[b].rect), q) &&
+                        !add(first_hits_[a], second_hits_[b])) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return flush();
+    }
+    bool add(const RQHit &first, const RQHit &second) {
+        first_[num_pairs_] = first;
+        second_[num_pairs_++] = second;
+        return num_pairs_ < JOIN_BATCH || flush();
+    }
+    bool flush() {
+        int n = num_pairs_;
+        num_pairs_ = 0;
+        return n == 0 || visitor_.visit(first_, second_, n, thread_id_);
+    }
+
+  private:
+    void __sideHits(const boxtree::rectdb &tree, int i, std::vector<RQHit> &hits) {
+        if (tree.type != INST_TREE) {
+            hits.resize(1);
+            makeHit(tree, i, hits[0]);
+            return;
+        }
+        boxtree::placement p = boxtree::instPlacement(forest_, tree, i);
+        const boxtree::rectdb &cell = forest_.cells[p.cell];
+        hits.resize(cell.size());
+        for (int k = 0; k < cell.size(); k++) {
+            makePlacedHit(forest_, tree, i, p, k, hits[k]);
+        }
+    }
+
+    const boxtree::forest &forest_;
+    int spacing_;
+    RQPairVisitor &visitor_;
+    int thread_id_;
+    int num_pairs_;
+    std::vector<RQHit> first_hits_, second_hits_;
+    RQHit first_[JOIN_BATCH];
+    RQHit second_[JOIN_BATCH];
+};
+
+static boxtree::payload toPayload(const LRect &shape) {
+    boxtree::payload pl = {shape.owner_, shape.source_, shape.kind_};
+    return pl;
+}
+
+RectQueryIndex::RectQueryIndex(RQExecutor *executor) : executor_(executor) {
+    boxtree::clearForest(forest_);
+}
+
+// spatial tiles are cut at quantiles of a key sample taken while counting:
+// the first of every KEY_SAMPLE shapes of a layer and type in each chunk
+void RectQueryIndex::build(std::vector<std::vector<LRect> > &chunks, RQPartition partition,
+                           RQEngine engine, LInstances *instances) {
+    const int num_counts = (MAX_LAYER_NUM + 1) * RECT_CLASSES;
+    bool spatial = partition == kRQPartitionSpatial;
+    std::vector<boxtree::rectdb> cells;
+    std::map<ObjectId, std::vector<int> > cell_trees;
+    if (instances) {
+        __groupCells(*instances, cells, cell_trees);
+    }
+    int num_placements = instances ? instances->placements_.size() : 0;
+    // the design extent sets which shapes count as long, so it is taken first
+    std::vector<boxtree::rect> chunk_extents(chunks.size(), {INF, INF, -INF, -INF});
+    executor_->parallelFor(chunks.size(), [&](int chunk, int thid) {
+        boxtree::rect &extent = chunk_extents[chunk];
+        for (unsigned int i = 0; i < chunks[chunk].size(); i++) {
+            boxtree::rect a = toRect(chunks[chunk][i].rect_);
+            extent.xl = std::min(extent.xl, a.xl);
+            extent.yl = std::min(extent.yl, a.yl);
+            extent.xr = std::max(extent.xr, a.xr);
+            extent.yr = std::max(extent.yr, a.yr);
+        }
+        for (int i = 0; chunk < num_placements && i < (int)instances->placements_[chunk].size(); i++) {
+            const LPlacement &pl = instances->placements_[chunk][i];
+            const std::vector<int> &trees = cell_trees.find(pl.cell_)->second;
+            for (unsigned int k = 0; k < trees.size(); k++) {
+                boxtree::placement p = {trees[k], pl.orient_, pl.x_, pl.y_};
+                boxtree::rect a = boxtree::placeRect(p, cells[trees[k]].box);
+                extent.xl = std::min(extent.xl, a.xl);
+                extent.yl = std::min(extent.yl, a.yl);
+                extent.xr = std::max(extent.xr, a.xr);
+                extent.yr = std::max(extent.yr, a.yr);
+            }
+        }
+    });
+    boxtree::rect extent = {INF, INF, -INF, -INF};
+    for (unsigned int chunk = 0; chunk < chunk_extents.size(); chunk++) {
+        extent.xl = std::min(extent.xl, chunk_extents[chunk].xl);
+        extent.yl = std::min(extent.yl, chunk_extents[chunk].yl);
+        extent.xr = std::max(extent.xr, chunk_extents[chunk].xr);
+        extent.yr = std::max(extent.yr, chunk_extents[chunk].yr);
+    }
+    boxtree::setLongSide(forest_, extent);
+    std::vector<long long> chunk_counts(chunks.size() * num_counts, 0);
+    std::vector<std::vector<std::pair<int, uint64_t> > > chunk_keys(chunks.size());
+    executor_->parallelFor(chunks.size(), [&](int chunk, int thid) {
+        long long *count = &chunk_counts[(size_t)chunk * num_counts];
+        for (unsigned int i = 0; i < chunks[chunk].size(); i++) {
+            const LRect &shape = chunks[chunk][i];
+            boxtree::rect a = toRect(shape.rect_);
+            int c = boxtree::layerIndex(shape.layer_id_) * RECT_CLASSES +
+                    boxtree::shapeclass(forest_, a);
+            if (spatial && count[c] % KEY_SAMPLE == 0) {
+                chunk_keys[chunk].push_back(std::make_pair(c, boxtree::rectkey(a)));
+            }
+            count[c]++;
+        }
+        for (int i = 0; chunk < num_placements && i < (int)instances->placements_[chunk].size(); i++) {
+            const std::vector<int> &trees = cell_trees.find(instances->placements_[chunk][i].cell_)->second;
+            for (unsigned int k = 0; k < trees.size(); k++) {
+                count[boxtree::layerIndex(cells[trees[k]].layer) * RECT_CLASSES + INST_CLASS]++;
+            }
+        }
+    });
+    std::vector<long long> counts(num_counts, 0);
+    for (unsigned int i = 0; i < chunk_counts.size(); i++) {
+        counts[i % num_counts] += chunk_counts[i];
+    }
+    std::vector<std::vector<uint64_t> > keys(num_counts);
+    for (unsigned int chunk = 0; chunk < chunk_keys.size(); chunk++) {
+        for (unsigned int i = 0; i < chunk_keys[chunk].size(); i++) {
+            keys[chunk_keys[chunk][i].first].push_back(chunk_keys[chunk][i].second);
+        }
+    }
+    forest_.engine = engine;
+    forest_.instanced = instances != nullptr;
+    boxtree::planForest(forest_, counts, executor_->getNumThreads(), partition, &keys);
+    for (unsigned int chunk = 0; chunk < chunks.size(); chunk++) {
+        for (unsigned int i = 0; i < chunks[chunk].size(); i++) {
+            const LRect &shape = chunks[chunk][i];
+            boxtree::placeShape(forest_, toRect(shape.rect_), shape.layer_id_, toPayload(shape));
+        }
+        std::vector<LRect>().swap(chunks[chunk]);
+    }
+    forest_.cells.swap(cells);
+    for (int chunk = 0; chunk < num_placements; chunk++) {
+        const std::vector<LPlacement> &placements = instances->placements_[chunk];
+        for (unsigned int i = 0; i < placements.size(); i++) {
+            const LPlacement &pl = placements[i];
+            const std::vector<int> &trees = cell_trees.find(pl.cell_)->second;
+            for (unsigned int k = 0; k < trees.size(); k++) {
+                boxtree::placement p = {trees[k], pl.orient_, pl.x_, pl.y_};
+                boxtree::payload payload = {pl.inst_, boxtree::placementSource(trees[k], pl.orient_), 0};
+                boxtree::placeInstance(forest_, boxtree::placeRect(p, forest_.cells[trees[k]].box),
+                                       forest_.cells[trees[k]].layer, payload);
+            }
+        }
+        std::vector<LPlacement>().swap(instances->placements_[chunk]);
+    }
+    boxtree::sortTreeOrder(forest_);
+
+    executor_->parallelFor(forest_.rdb.size(), [&](int treeid, int thid) {
+        boxtree::initBuild(forest_.rdb[forest_.treeorder[treeid]]);
+    });
+    boxtree::buildOwnerIndex(forest_);
+}
+
+// One cell tree per master and layer, built here as the placements only
+// need their boxes.
+void RectQueryIndex::__groupCells(LInstances &instances, std::vector<boxtree::rectdb> &cells,
+                                  std::map<ObjectId, std::vector<int> > &cell_trees) {
+    std::map<std::pair<ObjectId, int>, int> cell_of;
+    for (unsigned int i = 0; i < instances.cell_shapes_.size(); i++) {
+        const LRect &shape = instances.cell_shapes_[i];
+        std::pair<ObjectId, int> key(shape.owner_, shape.layer_id_);
+        auto iter = cell_of.find(key);
+        if (iter == cell_of.end()) {
+            iter = cell_of.insert(std::make_pair(key, (int)cells.size())).first;
+            cells.push_back(boxtree::rectdb());
+            cells.back().type = 2;
+            cells.back().layer = shape.layer_id_;
+            cell_trees[shape.owner_].push_back(iter->second);
+        }
+        cells[iter->second].r.push_back(toRect(shape.rect_));
+        cells[iter->second].rpayload.push_back(toPayload(shape));
+    }
+    std::vector<LRect>().swap(instances.cell_shapes_);
+    executor_->parallelFor(cells.size(), [&](int cell, int thid) {
+        boxtree::initBuild(cells[cell]);
+    });
+    // masters without pins or OBS still get an entry, with no trees
+    for (unsigned int chunk = 0; chunk < instances.placements_.size(); chunk++) {
+        for (unsigned int i = 0; i < instances.placements_[chunk].size(); i++) {
+            cell_trees[instances.placements_[chunk][i].cell_];
+        }
+    }
+}
+
+bool RectQueryIndex::save(const std::string &file_name, const RQDesignKey &design) const {
+    return saveQueryIndex(file_name, design, forest_);
+}
+
+bool RectQueryIndex::load(const std::string &file_name, const RQDesignKey &design,
+                          RQPartition partition, RQEngine engine, bool instanced) {
+    return loadQueryIndex(file_name, design, partition, engine, instanced, *executor_, forest_);
+}
+
+void RectQueryIndex::clear() {
+    boxtree::clearForest(forest_);
+}
+
+void RectQueryIndex::reportMemory() const {
+    size_t total_rects = 0, total_nodes = 0, total_bytes = 0;
+    message->info("%-6s %-6s %-5s %10s %10s %12s\n", "tree", "layer", "type", "rects", "nodes", "index(KB)");
+    for (unsigned int i = 0; i < forest_.rdb.size(); i++) {
+        const boxtree::rectdb &tree = forest_.rdb[i];
+        if (tree.size() == 0) continue;
+        size_t bytes = boxtree::treeMemory(tree);
+        size_t nodes = tree.node.size() + tree.hnode.size();
+        message->info("%-6u %-6d %-5d %10d %10lu %12.1f\n", i, tree.layer, tree.type,
+                      tree.size(), nodes, bytes / 1024.0);
+        total_rects += tree.size();
+        total_nodes += nodes;
+        total_bytes += bytes;
+    }
+    // the cell trees are many and small, so they get one line
+    if (!forest_.cells.empty()) {
+        size_t cell_rects = 0, cell_nodes = 0, cell_bytes = 0;
+        for (unsigned int i = 0; i < forest_.cells.size(); i++) {
+            const boxtree::rectdb &cell = forest_.cells[i];
+            cell_rects += cell.size();
+            cell_nodes += cell.node.size() + cell.hnode.size();
+            cell_bytes += boxtree::treeMemory(cell);
+        }
+        message->info("%-6s %-12lu %10lu %10lu %12.1f\n", "cells", forest_.cells.size(), cell_rects,
+                      cell_nodes, cell_bytes / 1024.0);
+        total_rects += cell_rects;
+        total_nodes += cell_nodes;
+        total_bytes += cell_bytes;
+    }
+    message->info("%-18s %10lu %10lu %12.1f\n", "total", total_rects, total_nodes, total_bytes / 1024.0);
+}
+
+void RectQueryIndex::queryTreeCounts(const Box &search_area, uint64_t layer_mask,
+                                     std::vector<uint64_t> &counts) const {
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    counts.assign(trees.size(), 0);
+    executor_->parallelFor(trees.size(), [&](int treeid, int thid) {
+        counts[treeid] = countTree(forest_, forest_.rdb[trees[treeid]], search_box);
+    });
+}
+
+void RectQueryIndex::query(const Box &search_area, uint64_t layer_mask,
+                           RQVisitor &visitor) const {
+    RQQueryIterator iter(*this, search_area, layer_mask);
+    std::vector<RQHit> hits;
+    while (iter.next(hits)) {
+        if (!visitor.visit(hits.data(), hits.size())) break;
+    }
+}
+
+void RectQueryIndex::queryObjects(const Box &search_area, uint64_t layer_mask,
+                                  std::vector<RQHit> &hits) const {
+    hits.clear();
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    std::vector<std::vector<int> > tree_hits(trees.size());
+    executor_->parallelFor(trees.size(), [&](int treeid, int thid) {
+        boxtree::queryIndexBOXTree(forest_.rdb[trees[treeid]], search_box, tree_hits[treeid]);
+    });
+    for (unsigned int i = 0; i < trees.size(); i++) {
+        const boxtree::rectdb &tree = forest_.rdb[trees[i]];
+        if (tree.type == INST_TREE) {
+            expandPlaced(forest_, tree, tree_hits[i].data(), tree_hits[i].size(), search_box,
+                         [&](const RQHit &hit) { hits.push_back(hit); });
+            continue;
+        }
+        for (unsigned int j = 0; j < tree_hits[i].size(); j++) {
+            RQHit hit;
+            makeHit(tree, tree_hits[i][j], hit);
+            hits.push_back(hit);
+        }
+    }
+}
+
+// the order of querySorted; rect and layer come first so that hits at the
+// same place are adjacent
+static bool samePlace(const RQHit &a, const RQHit &b) {
+    return a.rect.getLLX() == b.rect.getLLX() && a.rect.getLLY() == b.rect.getLLY() &&
+           a.rect.getURX() == b.rect.getURX() && a.rect.getURY() == b.rect.getURY() &&
+           a.layer == b.layer;
+}
+
+static bool placeLess(const RQHit &a, const RQHit &b) {
+    if (a.rect.getLLX() != b.rect.getLLX()) return a.rect.getLLX() < b.rect.getLLX();
+    if (a.rect.getLLY() != b.rect.getLLY()) return a.rect.getLLY() < b.rect.getLLY();
+    if (a.rect.getURX() != b.rect.getURX()) return a.rect.getURX() < b.rect.getURX();
+    if (a.rect.getURY() != b.rect.getURY()) return a.rect.getURY() < b.rect.getURY();
+    return a.layer < b.layer;
+}
+
+static bool hitLess(const RQHit &a, const RQHit &b) {
+    if (!samePlace(a, b)) return placeLess(a, b);
+    if (a.kind != b.kind) return a.kind < b.kind;
+    if (a.object != b.object) return a.object < b.object;
+    return a.owner < b.owner;
+}
+
+// Every tree sorts its own hits, then the runs are cut at common splitters
+// into ranges that are k-way merged in parallel. Splitters cut between
+// places, never inside one, so unique needs no look across ranges.
+void RectQueryIndex::querySorted(const Box &search_area, uint64_t layer_mask, bool unique,
+                                 std::vector<RQHit> &hits) const {
+    const int samples_per_range = 16;
+    hits.clear();
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    std::vector<std::vector<RQHit> > runs(trees.size());
+    executor_->parallelFor(trees.size(), [&](int treeid, int thid) {
+        const boxtree::rectdb &tree = forest_.rdb[trees[treeid]];
+        std::vector<int> indices;
+        boxtree::queryIndexBOXTree(tree, search_box, indices);
+        std::vector<RQHit> &run = runs[treeid];
+        if (tree.type == INST_TREE) {
+            expandPlaced(forest_, tree, indices.data(), indices.size(), search_box,
+                         [&](const RQHit &hit) { run.push_back(hit); });
+        } else {
+            run.resize(indices.size());
+            for (unsigned int i = 0; i < indices.size(); i++) {
+                makeHit(tree, indices[i], run[i]);
+            }
+        }
+        std::sort(run.begin(), run.end(), hitLess);
+        if (unique) run.erase(std::unique(run.begin(), run.end(), samePlace), run.end());
+    });
+
+    int num_ranges = 4 * executor_->getNumThreads();
+    size_t total = 0;
+    for (unsigned int r = 0; r < runs.size(); r++) total += runs[r].size();
+    size_t stride = std::max<size_t>(1, total / (num_ranges * samples_per_range));
+    std::vector<RQHit> samples;
+    for (unsigned int r = 0; r < runs.size(); r++) {
+        for (size_t i = 0; i < runs[r].size(); i += stride) samples.push_back(runs[r][i]);
+    }
+    std::sort(samples.begin(), samples.end(), hitLess);
+    num_ranges = std::max<int>(1, std::min<size_t>(num_ranges, samples.size()));
+    // cut[r][k] is where range k starts in run r
+    std::vector<std::vector<size_t> > cut(runs.size(), std::vector<size_t>(num_ranges + 1));
+    for (unsigned int r = 0; r < runs.size(); r++) {
+        cut[r][0] = 0;
+        cut[r][num_ranges] = runs[r].size();
+        for (int k = 1; k < num_ranges; k++) {
+            const RQHit &splitter = samples[k * samples.size() / num_ranges];
+            cut[r][k] = std::lower_bound(runs[r].begin(), runs[r].end(), splitter, placeLess) -
+                        runs[r].begin();
+        }
+    }
+    std::vector<std::vector<RQHit> > ranges(num_ranges);
+    executor_->parallelFor(num_ranges, [&](int k, int thid) {
+        // heads of the runs, smallest first; equal hits go by run
+        typedef std::pair<const RQHit *, int> Head;
+        auto later = [](const Head &a, const Head &b) {
+            if (hitLess(*a.first, *b.first)) return false;
+            if (hitLess(*b.first, *a.first)) return true;
+            return a.second > b.second;
+        };
+        std::vector<Head> heap;
+        std::vector<size_t> pos(runs.size());
+        for (unsigned int r = 0; r < runs.size(); r++) {
+            pos[r] = cut[r][k];
+            if (pos[r] < cut[r][k + 1]) heap.push_back(Head(&runs[r][pos[r]], r));
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+        std::vector<RQHit> &out = ranges[k];
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Head head = heap.back();
+            heap.pop_back();
+            if (!unique || out.empty() || !samePlace(out.back(), *head.first)) {
+                out.push_back(*head.first);
+            }
+            int r = head.second;
+            if (++pos[r] < cut[r][k + 1]) {
+                heap.push_back(Head(&runs[r][pos[r]], r));
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+    });
+    std::vector<size_t> offset(num_ranges + 1, 0);
+    for (int k = 0; k < num_ranges; k++) offset[k + 1] = offset[k] + ranges[k].size();
+    hits.resize(offset[num_ranges]);
+    executor_->parallelFor(num_ranges, [&](int k, int thid) {
+        std::copy(ranges[k].begin(), ranges[k].end(), hits.begin() + offset[k]);
+    });
+}
+
+uint64_t RectQueryIndex::queryCount(const Box &search_area, uint64_t layer_mask) const {
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    std::vector<long long> counts(trees.size(), 0);
+    executor_->parallelFor(trees.size(), [&](int treeid, int thid) {
+        counts[treeid] = countTree(forest_, forest_.rdb[trees[treeid]], search_box);
+    });
+    uint64_t count = 0;
+    for (unsigned int i = 0; i < counts.size(); i++) {
+        count += counts[i];
+    }
+    return count;
+}
+
+void RectQueryIndex::queryStats(const Box &search_area, uint64_t layer_mask,
+                                RQQueryStats &stats) const {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    stats.trees.assign(trees.size(), RQTreeStats());
+    stats.thread_seconds.assign(executor_->getNumThreads(), 0);
+    executor_->parallelFor(trees.size(), [&](int treeid, int thid) {
+        Clock::time_point tree_start = Clock::now();
+        const boxtree::rectdb &tree = forest_.rdb[trees[treeid]];
+        RQTreeStats &tree_stats = stats.trees[treeid];
+        boxtree::querystats &counts = tree_stats.counts;
+        counts = boxtree::querystats();
+        boxtree::queryStatsBOXTree(tree, search_box, counts);
+        if (tree.type == INST_TREE) {
+            std::vector<int> indices;
+            boxtree::queryIndexBOXTree(tree, search_box, indices);
+            counts.hits = 0;
+            for (unsigned int i = 0; i < indices.size(); i++) {
+                boxtree::placement p = boxtree::instPlacement(forest_, tree, indices[i]);
+                boxtree::queryStatsBOXTree(forest_.cells[p.cell], boxtree::unplaceRect(p, search_box),
+                                           counts);
+            }
+        }
+        tree_stats.tree = trees[treeid];
+        tree_stats.layer = tree.layer;
+        tree_stats.type = tree.type;
+        tree_stats.seconds = std::chrono::duration<double>(Clock::now() - tree_start).count();
+        stats.thread_seconds[thid] += tree_stats.seconds;
+    });
+    stats.hits = 0;
+    for (unsigned int i = 0; i < stats.trees.size(); i++) {
+        stats.hits += stats.trees[i].counts.hits;
+    }
+    stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// runs on the calling thread, trees are tried largest first and the
+// search stops at the first hit
+bool RectQueryIndex::queryAny(const Box &search_area, uint64_t layer_mask) const {
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    for (unsigned int i = 0; i < trees.size(); i++) {
+        const boxtree::rectdb &tree = forest_.rdb[trees[i]];
+        if (tree.type != INST_TREE) {
+            if (boxtree::queryAnyBOXTree(tree, search_box)) return true;
+            continue;
+        }
+        PlacedAnyVisitor visitor(forest_, search_box);
+        if (!boxtree::visitBOXTree(tree, search_box, visitor)) return true;
+    }
+    return false;
+}
+
+void RectQueryIndex::queryDensity(const Box &search_area, int num_x, int num_y,
+                                  uint64_t layer_mask, std::vector<double> &areas) const {
+    boxtree::rect search_box = toRect(search_area);
+    std::vector<int> trees;
+    boxtree::selectTrees(forest_, layer_mask, search_box, trees);
+    // every thread adds to bins of its own, summed once all trees are done
+    int num_threads = executor_->getNumThreads();
+    std::vector<std::vector<double> > thread_areas(num_threads);
+    std::vector<boxtree::densitygrid> grids(num_threads);
+    executor_->parallelFor(trees.size(), [&](int treeid, int thid) {
+        const boxtree::rectdb &tree = forest_.rdb[trees[treeid]];
+        std::vector<double> &bins = thread_areas[thid];
+        boxtree::densitygrid &grid = grids[thid];
+        if (bins.empty()) {
+            bins.assign(num_x * num_y, 0);
+            boxtree::setGrid(grid, search_box, num_x, num_y, &bins[0]);
+        }
+        if (tree.type != INST_TREE) {
+            boxtree::densityBOXTree(tree, grid);
+            return;
+        }
+        std::vector<int> indices;
+        boxtree::queryIndexBOXTree(tree, search_box, indices);
+        for (unsigned int i = 0; i < indices.size(); i++) {
+            boxtree::densityPlaced(forest_, boxtree::instPlacement(forest_, tree, indices[i]),
+                                   tree.getrect(indices[i]), grid);
+        }
+    });
+    areas.assign(num_x * num_y, 0);
+    for (unsigned int t = 0; t < thread_areas.size(); t++) {
+        const std::vector<double> &bins = thread_areas[t];
+        for (unsigned int i = 0; i < bins.size(); i++) {
+            areas[i] += bins[i];
+        }
+    }
+}
+
+// windows are visited in hilbert order of their centers so that neighbouring
+// windows land in the same task and reuse the tree paths already in cache;
+// box_of(i) is window i
+template <class BoxOf>
+static void sortWindows(int n, BoxOf box_of, std::vector<int> &order) {
+    order.resize(n);
+    if (n == 0) return;
+    int64_t xmin = box_of(0).getLLX(), xmax = box_of(0).getURX();
+    int64_t ymin = box_of(0).getLLY(), ymax = box_of(0).getURY();
+    for (int i = 1; i < n; i++) {
+        xmin = std::min<int64_t>(xmin, box_of(i).getLLX());
+        xmax = std::max<int64_t>(xmax, box_of(i).getURX());
+        ymin = std::min<int64_t>(ymin, box_of(i).getLLY());
+        ymax = std::max<int64_t>(ymax, box_of(i).getURY());
+    }
+    const int order_bits = 16;
+    int64_t w = std::max<int64_t>(xmax - xmin, 1), h = std::max<int64_t>(ymax - ymin, 1);
+    std::vector<std::pair<uint64_t, int> > keys(n);
+    for (int i = 0; i < n; i++) {
+        int64_t cx = ((int64_t)box_of(i).getLLX() + box_of(i).getURX()) / 2 - xmin;
+        int64_t cy = ((int64_t)box_of(i).getLLY() + box_of(i).getURY()) / 2 - ymin;
+        keys[i].first = boxtree::hilbertKey(cx * ((1 << order_bits) - 1) / w,
+                                            cy * ((1 << order_bits) - 1) / h, order_bits);
+        keys[i].second = i;
+    }
+    std::sort(keys.begin(), keys.end());
+    for (int i = 0; i < n; i++) order[i] = keys[i].second;
+}
+
+// Each task answers a run of queries in the given order, keeping the hits
+// in that order; answer(i, thid, run) appends the hits of query i. Once
+// every query's count is known the runs are copied to where the offsets put
+// them, in parallel again.
+template <class Answer>
+static void batchHits(RQExecutor *executor, const std::vector<int> &order, int per_task,
+                      Answer answer, std::vector<RQHit> &hits, std::vector<size_t> &offsets) {
+    int num_tasks = (order.size() + per_task - 1) / per_task;
+    std::vector<std::vector<RQHit> > task_hits(num_tasks);
+    // offsets[i + 1] first holds the hit count of query i
+    offsets.assign(order.size() + 1, 0);
+    executor->parallelFor(num_tasks, [&](int task_id, int thid) {
+        int end = std::min<int>((task_id + 1) * per_task, order.size());
+        std::vector<RQHit> &run = task_hits[task_id];
+        for (int i = task_id * per_task; i < end; i++) {
+            size_t first = run.size();
+            answer(order[i], thid, run);
+            offsets[order[i] + 1] = run.size() - first;
+        }
+    });
+    for (unsigned int i = 0; i < order.size(); i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    hits.resize(offsets.back());
+    executor->parallelFor(num_tasks, [&](int task_id, int thid) {
+        int end = std::min<int>((task_id + 1) * per_task, order.size());
+        const std::vector<RQHit> &run = task_hits[task_id];
+        size_t pos = 0;
+        for (int i = task_id * per_task; i < end; i++) {
+            size_t count = offsets[order[i] + 1] - offsets[order[i]];
+            std::copy(run.begin() + pos, run.begin() + pos + count, hits.begin() + offsets[order[i]]);
+            pos += count;
+        }
+    });
+}
+
+// each task answers a run of windows against all selected trees, so small
+// windows are parallel across queries instead of across trees
+void RectQueryIndex::queryBatch(const std::vector<Box> &search_areas, uint64_t layer_mask,
+                                std::vector<RQHit> &hits, std::vector<size_t> &offsets) const {
+    const int windows_per_task = 64;
+    std::vector<int> order;
+    std::vector<int> trees;
+    sortWindows(search_areas.size(), [&](int i) -> const Box & { return search_areas[i]; },
+                order);
+    boxtree::selectTrees(forest_, layer_mask, trees);
+    std::vector<std::vector<int> > thread_indices(executor_->getNumThreads());
+    auto answer = [&](int window, int thid, std::vector<RQHit> &run) {
+        boxtree::rect search_box = toRect(search_areas[window]);
+        std::vector<int> &indices = thread_indices[thid];
+        for (unsigned int j = 0; j < trees.size(); j++) {
+            const boxtree::rectdb &tree = forest_.rdb[trees[j]];
+            indices.clear();
+            boxtree::queryIndexBOXTree(tree, search_box, indices);
+            if (tree.type == INST_TREE) {
+                expandPlaced(forest_, tree, indices.data(), indices.size(), search_box,
+                             [&](const RQHit &hit) { run.push_back(hit); });
+                continue;
+            }
+            size_t first = run.size();
+            run.resize(first + indices.size());
+            for (unsigned int k = 0; k < indices.size(); k++) {
+                makeHit(tree, indices[k], run[first + k]);
+            }
+        }
+    };
+    batchHits(executor_, order, windows_per_task, answer, hits, offsets);
+}
+
+// a point needs no tree list, no threads and no scratch vectors, so a
+// query costs little more than the walk itself
+void RectQueryIndex::queryPoint(const Point &point, uint64_t layer_mask,
+                                RQPointHits &hits) const {
+    hits.clear();
+    pointHits(forest_, point.getX(), point.getY(), layer_mask, hits);
+}
+
+// like queryBatch, each task answers a run of points in hilbert order
+void RectQueryIndex::queryPointBatch(const std::vector<Point> &points, uint64_t layer_mask,
+                                     std::vector<RQHit> &hits,
+                                     std::vector<size_t> &offsets) const {
+    const int points_per_task = 1024;
+    std::vector<int> order;
+    sortWindows(points.size(), [&](int i) {
+        return Box(points[i].getX(), points[i].getY(), points[i].getX(), points[i].getY());
+    }, order);
+    batchHits(executor_, order, points_per_task, [&](int i, int thid, std::vector<RQHit> &run) {
+        pointHits(forest_, points[i].getX(), points[i].getY(), layer_mask, run);
+    }, hits, offsets);
+}
+
+// runs on the calling thread: one priority queue over the nodes of all
+// selected trees, so only the trees near the point are descended
+void RectQueryIndex::queryNearest(const Point &point, int k, uint64_t layer_mask,
+                                  double max_distance, RQDistanceMetric metric,
+                                  std::vector<RQHit> &hits,
+                                  std::vector<double> &distances) const {
+    std::vector<int> trees;
+    std::vector<boxtree::nearesthit> nearest;
+    boxtree::selectTrees(forest_, layer_mask, trees);
+    boxtree::nearestForest(forest_, trees, point.getX(), point.getY(), k, max_distance,
+                           metric, nearest);
+    hits.resize(nearest.size());
+    distances.resize(nearest.size());
+    for (unsigned int i = 0; i < nearest.size(); i++) {
+        const boxtree::rectdb &tree = forest_.rdb[nearest[i].tree];
+        if (nearest[i].sub < 0) {
+            makeHit(tree, nearest[i].index, hits[i]);
+        } else {
+            boxtree::placement p = boxtree::instPlacement(forest_, tree, nearest[i].index);
+            makePlacedHit(forest_, tree, nearest[i].index, p, nearest[i].sub, hits[i]);
+        }
+        distances[i] = nearest[i].dist;
+    }
+}
+
+// the tree pairs of every layer are cut into frames of about an eighth of a
+// thread's share of the shapes, so a few dense layers still keep all
+// threads busy
+void RectQueryIndex::queryPairs(uint64_t layer_mask, int spacing,
+                                RQPairVisitor &visitor) const {
+    const int min_grain = 4096;
+    std::vector<int> trees;
+    std::vector<boxtree::joinframe> frames;
+    boxtree::selectTrees(forest_, layer_mask, trees);
+    long long num_rects = 0;
+    for (unsigned int i = 0; i < trees.size(); i++) {
+        num_rects += forest_.rdb[trees[i]].size();
+    }
+    int grain = std::max<long long>(min_grain, num_rects / (8 * executor_->getNumThreads()));
+    boxtree::startJoin(forest_, trees, spacing, grain, frames);
+    std::atomic<bool> stopped(false);
+    executor_->parallelFor(frames.size(), [&](int frame, int thid) {
+        if (stopped.load()) return;
+        PairAdapter adapter(forest_, spacing, visitor, thid);
+        if (!boxtree::joinFrame(forest_, frames[frame], spacing, adapter)) {
+            stopped.store(true);
+        }
+    });
+
+    // the shapes of one instance are never apart in the trees: their pairs
+    // are found once per cell and placed for every instance of it
+    const int placed_block = 4096;
+    std::vector<std::vector<std::pair<int, int> > > cell_pairs(forest_.cells.size());
+    executor_->parallelFor(forest_.cells.size(), [&](int cell, int thid) {
+        if (boxtree::layerSelected(forest_.cells[cell].layer, layer_mask)) {
+            boxtree::cellPairs(forest_.cells[cell], spacing, cell_pairs[cell]);
+        }
+    });
+    std::vector<std::pair<int, int> > blocks;  // (tree, first rect)
+    for (unsigned int i = 0; i < trees.size(); i++) {
+        const boxtree::rectdb &tree = forest_.rdb[trees[i]];
+        if (tree.type != INST_TREE) continue;
+        for (int first = 0; first < tree.size(); first += placed_block) {
+            blocks.push_back(std::make_pair(trees[i], first));
+        }
+    }
+    executor_->parallelFor(blocks.size(), [&](int block, int thid) {
+        if (stopped.load()) return;
+        const boxtree::rectdb &tree = forest_.rdb[blocks[block].first];
+        PairAdapter adapter(forest_, spacing, visitor, thid);
+        int end = std::min(blocks[block].second + placed_block, tree.size());
+        for (int i = blocks[block].second; i < end; i++) {
+            if (tree.isdead(i)) continue;
+            boxtree::placement p = boxtree::instPlacement(forest_, tree, i);
+            const std::vector<std::pair<int, int> > &pairs = cell_pairs[p.cell];
+            for (unsigned int k = 0; k < pairs.size(); k++) {
+                RQHit first, second;
+                makePlacedHit(forest_, tree, i, p, pairs[k].first, first);
+                makePlacedHit(forest_, tree, i, p, pairs[k].second, second);
+                if (!adapter.add(first, second)) {
+                    stopped.store(true);
+                    return;
+                }
+            }
+        }
+        if (!adapter.flush()) stopped.store(true);
+    });
+}
+
+void RectQueryIndex::insert(const std::vector<LRect> &shapes) {
+    for (unsigned int i = 0; i < shapes.size(); i++) {
+        boxtree::insertShape(forest_, toRect(shapes[i].rect_), shapes[i].layer_id_,
+                             toPayload(shapes[i]));
+    }
+}
+
+int RectQueryIndex::remove(ObjectId owner) {
+    return boxtree::removeOwner(forest_, owner);
+}
+
+bool RectQueryIndex::indexed(ObjectId owner) const {
+    return boxtree::ownerIndexed(forest_, owner);
+}
+
+void RectQueryIndex::rebuildDegradedLayers() {
+    std::vector<int> trees, rebuilt;
+    for (int l = 0; l <= MAX_LAYER_NUM; l++) {
+        if (!boxtree::layerNeedsRebuild(forest_, l)) continue;
+        boxtree::relayoutLayer(forest_, l, trees);
+        executor_->parallelFor(trees.size(), [&](int i, int thid) {
+            boxtree::initBuild(forest_.rdb[trees[i]]);
+        });
+        rebuilt.insert(rebuilt.end(), trees.begin(), trees.end());
+    }
+    // one pass over the owner index for all the rebuilt layers
+    if (!rebuilt.empty()) boxtree::indexOwners(forest_, rebuilt);
+    boxtree::sortTreeOrder(forest_);
+}
+
+RQQueryIterator::RQQueryIterator(const RectQueryIndex &index, const Box &search_area,
+                                 uint64_t layer_mask, int batch_size)
+    : forest_(index.getForest()),
+      search_box_(toRect(search_area)),
+      tree_pos_(0),
+      batch_size_(std::max(batch_size, SCAN_BLOCK)),
+      pending_pos_(0) {
+    boxtree::selectTrees(forest_, layer_mask, search_box_, trees_);
+    indices_.resize(batch_size_);
+    if (!trees_.empty()) {
+        boxtree::startCursor(cursor_, forest_.rdb[trees_[0]], search_box_);
+    }
+}
+
+bool RQQueryIterator::next(std::vector<RQHit> &hits) {
+    hits.clear();
+    // placed shapes that did not fit the last batch go first
+    size_t take = std::min<size_t>(pending_.size() - pending_pos_, batch_size_);
+    hits.assign(pending_.begin() + pending_pos_, pending_.begin() + pending_pos_ + take);
+    pending_pos_ += take;
+    if (pending_pos_ == pending_.size()) {
+        pending_.clear();
+        pending_pos_ = 0;
+    }
+    while (tree_pos_ < trees_.size() && pending_.empty()) {
+        // a leaf block is never split across batches
+        int room = batch_size_ - hits.size();
+        if (room < SCAN_BLOCK) break;
+        int num_hits = boxtree::nextHits(cursor_, indices_.data(), room);
+        if (num_hits == 0) {
+            if (++tree_pos_ < trees_.size()) {
+                boxtree::startCursor(cursor_, forest_.rdb[trees_[tree_pos_]], search_box_);
+            }
+            continue;
+        }
+        const boxtree::rectdb &tree = forest_.rdb[trees_[tree_pos_]];
+        if (tree.type == INST_TREE) {
+            expandPlaced(forest_, tree, indices_.data(), num_hits, search_box_,
+                         [&](const RQHit &hit) {
+                             if ((int)hits.size() < batch_size_) {
+                                 hits.push_back(hit);
+                             } else {
+                                 pending_.push_back(hit);
+                             }
+                         });
+            continue;
+        }
+        size_t first = hits.size();
+        hits.resize(first + num_hits);
+        for (int i = 0; i < num_hits; i++) {
+            makeHit(tree, indices_[i], hits[first + i]);
+        }
+    }
+    return !hits.empty();
+}
+
+}  // namespace db
+}  // namespace open_edi
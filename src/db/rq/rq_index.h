@@ -0,0 +1,240 @@
+/* @file  rq_index.h
+ * @date  <date>
+ * @brief A built rectangle query index, read by any number of threads
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#ifndef SRC_DB_RQ_INDEX_H_
+#define SRC_DB_RQ_INDEX_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "db/rq/data_model.h"
+#include "db/rq/obtree.h"
+#include "db/rq/rq_executor.h"
+#include "db/rq/rq_index_io.h"
+
+namespace open_edi {
+namespace db {
+
+// an indexed shape hit by a query
+struct RQHit {
+    Box rect;
+    ObjectId object;  // the db object that produced the shape, see RQShapeKind
+    ObjectId owner;   // the inst, net, special net, io pin or blockage it belongs to
+    RQShapeKind kind;
+    int layer;        // LEF layer index
+};
+
+const int kDefaultHitBatch = 1024;
+const int kPointHitsInline = 8;
+
+// The hits of one point query. A point lies on a few shapes at most, so the
+// first kPointHitsInline hits are kept in place and only more go to the
+// heap; reused across queries it stops allocating.
+class RQPointHits {
+  public:
+    RQPointHits() : size_(0) {}
+    int size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const RQHit &operator[](int i) const {
+        return i < kPointHitsInline ? inline_[i] : more_[i - kPointHitsInline];
+    }
+    void clear() {
+        size_ = 0;
+        more_.clear();
+    }
+    void push_back(const RQHit &hit) {
+        if (size_ < kPointHitsInline) {
+            inline_[size_] = hit;
+        } else {
+            more_.push_back(hit);
+        }
+        size_++;
+    }
+
+  private:
+    RQHit inline_[kPointHitsInline];
+    std::vector<RQHit> more_;
+    int size_;
+};
+
+enum RQDistanceMetric {
+    kRQManhattan = boxtree::DIST_MANHATTAN,
+    kRQEuclidean = boxtree::DIST_EUCLIDEAN
+};
+
+// how the shapes of a layer are spread over its trees, see
+// boxtree::partitionmode
+enum RQPartition {
+    kRQPartitionShard = boxtree::PARTITION_SHARD,
+    kRQPartitionSpatial = boxtree::PARTITION_SPATIAL
+};
+
+// the structure each tree is built as, see boxtree::treeengine
+enum RQEngine {
+    kRQEngineBoxTree = boxtree::ENGINE_BOXTREE,
+    kRQEngineHRTree = boxtree::ENGINE_HRTREE
+};
+
+// what one window cost a tree it met, see RectQueryIndex::queryStats
+struct RQTreeStats {
+    int tree;  // index in the forest
+    int layer;
+    int type;
+    boxtree::querystats counts;
+    double seconds;
+};
+
+struct RQQueryStats {
+    std::vector<RQTreeStats> trees;
+    std::vector<double> thread_seconds;  // busy time of each executor thread
+    uint64_t hits;
+    double seconds;
+};
+
+// Receives the hits of a query in batches; return false to stop early.
+class RQVisitor {
+  public:
+    virtual ~RQVisitor() {}
+    virtual bool visit(const RQHit *hits, int num_hits) = 0;
+};
+
+// Receives the candidate pairs of a self join in batches, from all executor
+// threads at once: thread_id (below the executor's thread count) tells them
+// apart so per-thread state needs no lock. Return false to stop the join.
+class RQPairVisitor {
+  public:
+    virtual ~RQPairVisitor() {}
+    virtual bool visit(const RQHit *first, const RQHit *second, int num_pairs,
+                       int thread_id) = 0;
+};
+
+// Owns one forest of trees. Once built or loaded, the const queries keep
+// all their state in the call, so any number of threads may query the same
+// index, and any number of indexes may coexist. build, load, clear and the
+// ECO calls are writers: the caller keeps readers off the index while they
+// run. The executor is shared, not owned.
+class RectQueryIndex {
+  public:
+    explicit RectQueryIndex(RQExecutor *executor);
+
+    RQExecutor *getExecutor() const { return executor_; }
+    const boxtree::forest &getForest() const { return forest_; }
+
+    // the chunks are freed as their shapes are placed; given instances, their
+    // masters become the cell trees and each placement one rect per cell tree
+    void build(std::vector<std::vector<LRect> > &chunks,
+               RQPartition partition = kRQPartitionShard,
+               RQEngine engine = kRQEngineBoxTree,
+               LInstances *instances = nullptr);
+    bool save(const std::string &file_name, const RQDesignKey &design) const;
+    // the index is left empty if the file is missing, stale, or was built
+    // with other settings than these
+    bool load(const std::string &file_name, const RQDesignKey &design,
+              RQPartition partition = kRQPartitionShard,
+              RQEngine engine = kRQEngineBoxTree,
+              bool instanced = false);
+    void clear();
+    void reportMemory() const;
+
+    // the hits of every selected tree counted like queryCount, one count
+    // per tree
+    void queryTreeCounts(const Box &search_area, uint64_t layer_mask,
+                         std::vector<uint64_t> &counts) const;
+    // runs on the calling thread, so the visitor needs no locking
+    void query(const Box &search_area, uint64_t layer_mask, RQVisitor &visitor) const;
+    void queryObjects(const Box &search_area, uint64_t layer_mask,
+                      std::vector<RQHit> &hits) const;
+    // hits ordered by rect (llx, lly, urx, ury), then layer, kind, object
+    // and owner, the same on every run; unique keeps only the first hit of
+    // each rect on a layer, dropping the copies other objects put there
+    void querySorted(const Box &search_area, uint64_t layer_mask, bool unique,
+                     std::vector<RQHit> &hits) const;
+    uint64_t queryCount(const Box &search_area, uint64_t layer_mask) const;
+    // queryCount taking stats of every tree on the way, slower, for tuning;
+    // the instances an INST_TREE meets add the walks of their cell trees
+    void queryStats(const Box &search_area, uint64_t layer_mask, RQQueryStats &stats) const;
+    bool queryAny(const Box &search_area, uint64_t layer_mask) const;
+    // the area the shapes cover in each of num_x by num_y bins cutting
+    // search_area, bin (i, j) at areas[j * num_x + i] from the lower left,
+    // see boxtree::densitygrid; every shape adds its area clipped to a bin,
+    // so overlapping shapes count twice. A subtree that falls in one bin adds
+    // its area without being visited, so a coarse grid costs far less than
+    // enumerating the shapes.
+    void queryDensity(const Box &search_area, int num_x, int num_y, uint64_t layer_mask,
+                      std::vector<double> &areas) const;
+    // the hits of every window, in parallel; the hits of search_areas[i] are
+    // hits[offsets[i]] up to hits[offsets[i + 1]]
+    void queryBatch(const std::vector<Box> &search_areas, uint64_t layer_mask,
+                    std::vector<RQHit> &hits, std::vector<size_t> &offsets) const;
+    // the shapes holding point, boundary included, on the calling thread
+    void queryPoint(const Point &point, uint64_t layer_mask, RQPointHits &hits) const;
+    // queryPoint of every point, in parallel; the hits of points[i] are
+    // hits[offsets[i]] up to hits[offsets[i + 1]]
+    void queryPointBatch(const std::vector<Point> &points, uint64_t layer_mask,
+                         std::vector<RQHit> &hits, std::vector<size_t> &offsets) const;
+    // the k shapes nearest to point, at most max_distance away, nearest
+    // first; distances[i] belongs to hits[i] and is 0 for a shape covering
+    // the point
+    void queryNearest(const Point &point, int k, uint64_t layer_mask, double max_distance,
+                      RQDistanceMetric metric, std::vector<RQHit> &hits,
+                      std::vector<double> &distances) const;
+    // every unordered pair of shapes on the same layer that overlap or lie
+    // within spacing of each other along both axes, each pair once
+    void queryPairs(uint64_t layer_mask, int spacing, RQPairVisitor &visitor) const;
+
+    // shapes are keyed by their owner: inst, net, special net, io pin or
+    // routing blockage
+    void insert(const std::vector<LRect> &shapes);
+    int remove(ObjectId owner);
+    // true while owner has shapes in the index
+    bool indexed(ObjectId owner) const;
+    // layers whose insert buffer or removed shapes passed the threshold are
+    // rebuilt from their live shapes
+    void rebuildDegradedLayers();
+
+  private:
+    void __groupCells(LInstances &instances, std::vector<boxtree::rectdb> &cells,
+                      std::map<ObjectId, std::vector<int> > &cell_trees);
+
+    RQExecutor *executor_;
+    boxtree::forest forest_;
+};
+
+// Yields the hits of one window in batches of at most batch_size, so memory
+// stays bounded however large the window. It holds its own cursor, so
+// several iterators may walk one index at once; it is invalidated by any
+// writer call on the index.
+class RQQueryIterator {
+  public:
+    RQQueryIterator(const RectQueryIndex &index, const Box &search_area,
+                    uint64_t layer_mask, int batch_size = kDefaultHitBatch);
+    // replaces hits with the next batch, false once the query is exhausted
+    bool next(std::vector<RQHit> &hits);
+
+  private:
+    const boxtree::forest &forest_;
+    boxtree::rect search_box_;
+    std::vector<int> trees_;
+    unsigned int tree_pos_;
+    int batch_size_;
+    boxtree::querycursor cursor_;
+    std::vector<int> indices_;
+    // placed shapes of instances past the end of the last batch
+    std::vector<RQHit> pending_;
+    size_t pending_pos_;
+};
+
+}  // namespace db
+}  // namespace open_edi
+
+#endif  // SRC_DB_RQ_INDEX_H_
@@ -0,0 +1,357 @@
+/* @file  rq_index_io.cpp
+ * @date  <date>
+ * @brief Save the built query index to a flat file and map it back
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+
+#include "db/rq/rq_index_io.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "db/core/db.h"
+#include "db/rq/obtree.h"
+#include "util/io_manager.h"
+
+namespace open_edi {
+namespace db {
+
+using IOManager = open_edi::util::IOManager;
+
+// IOManager writes at most 4GB per call
+static const uint64_t kMaxWriteChunk = 1u << 30;
+static const int kNumBlobs = 9;
+// layertree, layerlong, layerinst and layerdelta
+static const int kNumLayerTables = 4;
+
+// fnv-1a, stable across runs unlike std::hash
+static uint64_t __hashName(const std::string &name) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned int i = 0; i < name.size(); i++) {
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t __topCellHash() {
+    Cell *top_cell = getTopCell();
+    return top_cell ? __hashName(top_cell->getName()) : 0;
+}
+
+static uint64_t __alignUp(uint64_t offset) {
+    return (offset + kRQIndexAlign - 1) / kRQIndexAlign * kRQIndexAlign;
+}
+
+static void __blobs(const boxtree::rectdb &tree, const void *data[kNumBlobs],
+                    uint64_t bytes[kNumBlobs]) {
+    data[0] = tree.xl.data();
+    data[1] = tree.yl.data();
+    data[2] = tree.xr.data();
+    data[3] = tree.yr.data();
+    data[4] = tree.owner.data();
+    data[5] = tree.source.data();
+    data[6] = tree.kind.data();
+    data[7] = tree.node.data();
+    data[8] = tree.hnode.data();
+    for (int k = 0; k < 4; k++) bytes[k] = tree.size() * sizeof(int);
+    bytes[4] = tree.owner.size() * sizeof(uint64_t);
+    bytes[5] = tree.source.size() * sizeof(uint64_t);
+    bytes[6] = tree.kind.size();
+    bytes[7] = tree.node.size() * sizeof(boxtree::treenode);
+    bytes[8] = tree.hnode.size() * sizeof(boxtree::hrnode);
+}
+
+static bool __writeAll(IOManager &io_manager, const void *data, uint64_t bytes) {
+    const char *p = static_cast<const char *>(data);
+    while (bytes > 0) {
+        uint32_t size = bytes < kMaxWriteChunk ? bytes : kMaxWriteChunk;
+        if (io_manager.write(size, const_cast<char *>(p)) != (int)size) return false;
+        p += size;
+        bytes -= size;
+    }
+    return true;
+}
+
+static bool __isCompressedName(const std::string &file_name) {
+    const char *suffixes[] = {".gz", ".lz4", ".zst", ".zip"};
+    for (unsigned int i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t len = strlen(suffixes[i]);
+        if (file_name.size() > len &&
+            file_name.compare(file_name.size() - len, len, suffixes[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// fnv-1a over 8 byte words, the tail byte by byte; a multi-gigabyte .db
+// hashes at disk speed
+static uint64_t __hashBytes(uint64_t h, const char *data, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * 1099511628211ull;
+    }
+    for (; i < size; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+bool hashDesignFile(const std::string &db_file, RQDesignKey &key) {
+    const size_t chunk_size = 1 << 22;
+    key.size = 0;
+    key.hash = 14695981039346656037ull;
+    int fd = open(db_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        message->issueMsg(kError, "cannot open %s.\n", db_file.c_str());
+        return false;
+    }
+    std::vector<char> chunk(chunk_size);
+    bool ok = true;
+    while (true) {
+        // chunks are filled up before hashing, so short reads do not move
+        // the word boundaries
+        size_t filled = 0;
+        while (filled < chunk_size) {
+            ssize_t got = read(fd, &chunk[filled], chunk_size - filled);
+            if (got <= 0) {
+                ok = got == 0;
+                break;
+            }
+            filled += got;
+        }
+        key.hash = __hashBytes(key.hash, chunk.data(), filled);
+        key.size += filled;
+        if (!ok || filled < chunk_size) break;
+    }
+    close(fd);
+    if (!ok) {
+        message->issueMsg(kError, "cannot read %s.\n", db_file.c_str());
+    }
+    return ok;
+}
+
+bool saveQueryIndex(const std::string &file_name, const RQDesignKey &design,
+                    const boxtree::forest &forest) {
+    // compressed streams cannot be mapped
+    if (__isCompressedName(file_name)) {
+        message->issueMsg(kError, "query index %s must not be compressed.\n",
+                          file_name.c_str());
+        return false;
+    }
+    // the cell trees are written after the trees of rdb
+    std::vector<const boxtree::rectdb *> rdb;
+    for (unsigned int i = 0; i < forest.rdb.size(); i++) rdb.push_back(&forest.rdb[i]);
+    for (unsigned int i = 0; i < forest.cells.size(); i++) rdb.push_back(&forest.cells[i]);
+    std::vector<RQIndexTree> trees(rdb.size());
+    uint64_t offset = sizeof(RQIndexHeader) +
+                      kNumLayerTables * (MAX_LAYER_NUM + 1) * sizeof(int32_t) +
+                      rdb.size() * sizeof(RQIndexTree);
+    for (unsigned int i = 0; i < rdb.size(); i++) {
+        const void *data[kNumBlobs];
+        uint64_t bytes[kNumBlobs];
+        __blobs(*rdb[i], data, bytes);
+        memset(&trees[i], 0, sizeof(RQIndexTree));
+        trees[i].type = rdb[i]->type;
+        trees[i].layer = rdb[i]->layer;
+        trees[i].ndead = rdb[i]->ndead;
+        trees[i].num_rects = rdb[i]->size();
+        trees[i].num_nodes = rdb[i]->node.size();
+        trees[i].num_hnodes = rdb[i]->hnode.size();
+        trees[i].engine = rdb[i]->engine;
+        trees[i].box[0] = rdb[i]->box.xl;
+        trees[i].box[1] = rdb[i]->box.yl;
+        trees[i].box[2] = rdb[i]->box.xr;
+        trees[i].box[3] = rdb[i]->box.yr;
+        for (int k = 0; k < kNumBlobs; k++) {
+            offset = __alignUp(offset);
+            trees[i].offset[k] = offset;
+            offset += bytes[k];
+        }
+    }
+
+    RQIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kRQIndexMagic, sizeof(header.magic));
+    header.version = kRQIndexVersion;
+    header.byte_order = kRQIndexByteOrder;
+    header.design_size = design.size;
+    header.design_hash = design.hash;
+    header.num_trees = forest.rdb.size();
+    header.num_cells = forest.cells.size();
+    header.top_cell_hash = __topCellHash();
+    header.forest_nth = forest.nth;
+    header.max_layer_num = MAX_LAYER_NUM;
+    header.partition = forest.partition;
+    header.engine = forest.engine;
+    header.long_side = forest.longside;
+    header.instanced = forest.instanced;
+    header.file_size = offset;
+
+    IOManager io_manager;
+    if (!io_manager.open(file_name.c_str(), "wb")) {
+        return false;
+    }
+    std::vector<int32_t> layers(forest.layertree.begin(), forest.layertree.end());
+    layers.insert(layers.end(), forest.layerlong.begin(), forest.layerlong.end());
+    layers.insert(layers.end(), forest.layerinst.begin(), forest.layerinst.end());
+    layers.insert(layers.end(), forest.layerdelta.begin(), forest.layerdelta.end());
+    bool ok = __writeAll(io_manager, &header, sizeof(header)) &&
+              __writeAll(io_manager, layers.data(), layers.size() * sizeof(int32_t)) &&
+              __writeAll(io_manager, trees.data(), trees.size() * sizeof(RQIndexTree));
+    uint64_t written = sizeof(header) + layers.size() * sizeof(int32_t) +
+                       trees.size() * sizeof(RQIndexTree);
+    static const char padding[kRQIndexAlign] = {0};
+    for (unsigned int i = 0; ok && i < rdb.size(); i++) {
+        const void *data[kNumBlobs];
+        uint64_t bytes[kNumBlobs];
+        __blobs(*rdb[i], data, bytes);
+        for (int k = 0; ok && k < kNumBlobs; k++) {
+            ok = __writeAll(io_manager, padding, trees[i].offset[k] - written) &&
+                 __writeAll(io_manager, data[k], bytes[k]);
+            written = trees[i].offset[k] + bytes[k];
+        }
+    }
+    io_manager.close();
+    if (!ok) {
+        message->issueMsg(kError, "failed to write query index %s.\n", file_name.c_str());
+    }
+    return ok;
+}
+
+static bool __checkHeader(const RQIndexHeader &header, uint64_t file_size,
+                          const RQDesignKey &design, int partition, int engine,
+                          bool instanced, const std::string &file_name) {
+    if (memcmp(header.magic, kRQIndexMagic, sizeof(header.magic)) != 0 ||
+        header.version != kRQIndexVersion || header.byte_order != kRQIndexByteOrder ||
+        header.max_layer_num != MAX_LAYER_NUM || header.file_size != file_size) {
+        message->info("%s is not a query index of this version.\n", file_name.c_str());
+        return false;
+    }
+    if (header.design_size != design.size || header.design_hash != design.hash ||
+        header.top_cell_hash != __topCellHash()) {
+        message->info("query index %s is stale for the loaded design.\n", file_name.c_str());
+        return false;
+    }
+    if (header.partition != partition || header.engine != engine ||
+        (header.instanced != 0) != instanced) {
+        message->info("query index %s was built with other init_query settings.\n",
+                      file_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool loadQueryIndex(const std::string &file_name, const RQDesignKey &design, int partition,
+                    int engine, bool instanced, RQExecutor &executor,
+                    boxtree::forest &forest) {
+    boxtree::clearForest(forest);
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        message->info("cannot open query index %s.\n", file_name.c_str());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(RQIndexHeader)) {
+        close(fd);
+        message->info("%s is not a query index of this version.\n", file_name.c_str());
+        return false;
+    }
+    uint64_t file_size = st.st_size;
+    void *map = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        message->issueMsg(kError, "cannot map query index %s.\n", file_name.c_str());
+        return false;
+    }
+    madvise(map, file_size, MADV_WILLNEED);
+    const char *base = static_cast<const char *>(map);
+    const RQIndexHeader &header = *reinterpret_cast<const RQIndexHeader *>(base);
+    uint64_t table_end =
+        sizeof(RQIndexHeader) + kNumLayerTables * (MAX_LAYER_NUM + 1) * sizeof(int32_t);
+    bool ok = __checkHeader(header, file_size, design, partition, engine, instanced, file_name) && header.num_cells >= 0 &&
+              table_end + ((uint64_t)header.num_trees + header.num_cells) * sizeof(RQIndexTree) <=
+                  file_size;
+    const int32_t *layers = reinterpret_cast<const int32_t *>(base + sizeof(RQIndexHeader));
+    const RQIndexTree *trees = reinterpret_cast<const RQIndexTree *>(base + table_end);
+    int num_trees = ok ? header.num_trees + header.num_cells : 0;
+    for (int i = 0; ok && i < num_trees; i++) {
+        const RQIndexTree &tree = trees[i];
+        uint64_t bytes[kNumBlobs] = {
+            tree.num_rects * sizeof(int), tree.num_rects * sizeof(int),
+            tree.num_rects * sizeof(int), tree.num_rects * sizeof(int),
+            tree.num_rects * sizeof(uint64_t), tree.num_rects * sizeof(uint64_t),
+            (uint64_t)tree.num_rects, tree.num_nodes * sizeof(boxtree::treenode),
+            tree.num_hnodes * sizeof(boxtree::hrnode)};
+        for (int k = 0; k < kNumBlobs; k++) {
+            ok = ok && tree.num_rects >= 0 && tree.offset[k] % kRQIndexAlign == 0 &&
+                 tree.offset[k] <= file_size && bytes[k] <= file_size - tree.offset[k];
+        }
+    }
+    if (!ok) {
+        munmap(map, file_size);
+        return false;
+    }
+
+    forest.nth = header.forest_nth;
+    forest.partition = header.partition;
+    forest.engine = header.engine;
+    forest.longside = header.long_side;
+    forest.instanced = header.instanced != 0;
+    forest.layertree.assign(layers, layers + MAX_LAYER_NUM + 1);
+    forest.layerlong.assign(layers + MAX_LAYER_NUM + 1, layers + 2 * (MAX_LAYER_NUM + 1));
+    forest.layerinst.assign(layers + 2 * (MAX_LAYER_NUM + 1), layers + 3 * (MAX_LAYER_NUM + 1));
+    forest.layerdelta.assign(layers + 3 * (MAX_LAYER_NUM + 1), layers + 4 * (MAX_LAYER_NUM + 1));
+    forest.rdb.resize(header.num_trees);
+    forest.cells.resize(header.num_cells);
+    executor.parallelFor(num_trees, [&](int i, int thread_id) {
+        const RQIndexTree &tree = trees[i];
+        boxtree::rectdb &rdb = i < (int)header.num_trees ? forest.rdb[i]
+                                                         : forest.cells[i - header.num_trees];
+        const int *xl = reinterpret_cast<const int *>(base + tree.offset[0]);
+        const int *yl = reinterpret_cast<const int *>(base + tree.offset[1]);
+        const int *xr = reinterpret_cast<const int *>(base + tree.offset[2]);
+        const int *yr = reinterpret_cast<const int *>(base + tree.offset[3]);
+        const uint64_t *owner = reinterpret_cast<const uint64_t *>(base + tree.offset[4]);
+        const uint64_t *source = reinterpret_cast<const uint64_t *>(base + tree.offset[5]);
+        const unsigned char *kind = reinterpret_cast<const unsigned char *>(base + tree.offset[6]);
+        const boxtree::treenode *node =
+            reinterpret_cast<const boxtree::treenode *>(base + tree.offset[7]);
+        const boxtree::hrnode *hnode =
+            reinterpret_cast<const boxtree::hrnode *>(base + tree.offset[8]);
+        rdb.type = tree.type;
+        rdb.layer = tree.layer;
+        rdb.ndead = tree.ndead;
+        rdb.engine = tree.engine;
+        rdb.box = {tree.box[0], tree.box[1], tree.box[2], tree.box[3]};
+        rdb.xl.assign(xl, xl + tree.num_rects);
+        rdb.yl.assign(yl, yl + tree.num_rects);
+        rdb.xr.assign(xr, xr + tree.num_rects);
+        rdb.yr.assign(yr, yr + tree.num_rects);
+        rdb.owner.assign(owner, owner + tree.num_rects);
+        rdb.source.assign(source, source + tree.num_rects);
+        rdb.kind.assign(kind, kind + tree.num_rects);
+        rdb.node.assign(node, node + tree.num_nodes);
+        rdb.hnode.assign(hnode, hnode + tree.num_hnodes);
+        // cheaper to sum again than to store
+        boxtree::sumAreas(rdb);
+    });
+    munmap(map, file_size);
+    boxtree::sortTreeOrder(forest);
+    boxtree::buildOwnerIndex(forest);
+    return true;
+}
+
+}  // namespace db
+}  // namespace open_edi
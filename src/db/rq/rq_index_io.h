@@ -0,0 +1,89 @@
+/* @file  rq_index_io.h
+ * @date  <date>
+ * @brief Save the built query index to a flat file and map it back
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#ifndef SRC_DB_RQ_INDEX_IO_H_
+#define SRC_DB_RQ_INDEX_IO_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "db/rq/obtree.h"
+#include "db/rq/rq_executor.h"
+
+namespace open_edi {
+namespace db {
+
+// Layout of an index file, all integers in host byte order:
+//   RQIndexHeader
+//   int32_t layertree[MAX_LAYER_NUM + 1], layerlong[MAX_LAYER_NUM + 1],
+//           layerinst[MAX_LAYER_NUM + 1], layerdelta[MAX_LAYER_NUM + 1]
+//   RQIndexTree[num_trees + num_cells]
+//   array blobs, each starting on a kRQIndexAlign boundary
+// Blob offsets are counted from the start of the file, so the file can be
+// mapped at any address.
+const char kRQIndexMagic[8] = {'R', 'Q', 'I', 'N', 'D', 'E', 'X', '\0'};
+const uint32_t kRQIndexVersion = 8;
+const uint32_t kRQIndexByteOrder = 0x01020304;
+const uint64_t kRQIndexAlign = 64;
+
+struct RQIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t num_trees;  // forest::rdb, then num_cells of forest::cells
+    int32_t instanced;   // forest::instanced
+    uint64_t design_size;  // RQDesignKey of the .db the index was built from
+    uint64_t design_hash;
+    uint64_t top_cell_hash;
+    int32_t forest_nth;
+    int32_t max_layer_num;
+    int32_t partition;  // boxtree::partitionmode, used again by ECO relayouts
+    int32_t engine;     // boxtree::treeengine of the trees ECO relayouts build
+    int32_t long_side;  // forest::longside, sorts shapes in ECO relayouts
+    int32_t num_cells;
+    uint64_t file_size;
+};
+
+struct RQIndexTree {
+    int32_t type;
+    int32_t layer;
+    int32_t ndead;
+    int32_t num_rects;
+    uint64_t num_nodes;
+    int32_t box[4];
+    int32_t engine;
+    int32_t reserved;
+    uint64_t num_hnodes;
+    // xl, yl, xr, yr, owner, source, kind, node, hnode
+    uint64_t offset[9];
+};
+
+// ties an index to the .db it was built from: the checksum WriteDesign
+// appends only covers the file header, so all the bytes are hashed
+struct RQDesignKey {
+    uint64_t size;
+    uint64_t hash;
+};
+
+bool hashDesignFile(const std::string &db_file, RQDesignKey &key);
+bool saveQueryIndex(const std::string &file_name, const RQDesignKey &design,
+                    const boxtree::forest &forest);
+// false if the file is missing, from another build, stale for the design or
+// built with another partition, engine or instanced layout than asked for;
+// the forest is left empty in that case
+bool loadQueryIndex(const std::string &file_name, const RQDesignKey &design, int partition,
+                    int engine, bool instanced, RQExecutor &executor,
+                    boxtree::forest &forest);
+
+}  // namespace db
+}  // namespace open_edi
+
+#endif  // SRC_DB_RQ_INDEX_IO_H_
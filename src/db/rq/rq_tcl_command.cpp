@@ -27,6 +27,51 @@ static int queryCommand(Command* cmd) {
     return result;
 }
 
+static int queryBatchCommand(Command* cmd) {
+    int result = cmdQueryBatch(cmd);
+    return result;
+}
+
+static int queryPointCommand(Command* cmd) {
+    int result = cmdQueryPoint(cmd);
+    return result;
+}
+
+static int queryDensityCommand(Command* cmd) {
+    int result = cmdQueryDensity(cmd);
+    return result;
+}
+
+static int queryNearestCommand(Command* cmd) {
+    int result = cmdQueryNearest(cmd);
+    return result;
+}
+
+static int queryPairsCommand(Command* cmd) {
+    int result = cmdQueryPairs(cmd);
+    return result;
+}
+
+static int queryTraceCommand(Command* cmd) {
+    int result = cmdQueryTrace(cmd);
+    return result;
+}
+
+static int rqInsertCommand(Command* cmd) {
+    int result = cmdRQInsert(cmd);
+    return result;
+}
+
+static int rqRemoveCommand(Command* cmd) {
+    int result = cmdRQRemove(cmd);
+    return result;
+}
+
+static int rqUpdateCommand(Command* cmd) {
+    int result = cmdRQUpdate(cmd);
+    return result;
+}
+
 static int cleanupQueryCommand(Command* cmd) {
     int result = cmdCleanupQuery(cmd);
     return result;
@@ -37,12 +82,118 @@ void registerRQTclCommands(Tcl_Interp *itp) {
     Command *init_query_command = cmd_manager->createObjCommand(
         itp, initQueryCommand, "init_query", "Initialize query data\n",
         cmd_manager->createOption("check_design", OptionDataType::kBoolNoValue, false,
-                               "check if design is loaded.\n"));
+                               "check if design is loaded.\n")
+        + cmd_manager->createOption("-threads", OptionDataType::kInt, false, kDefaultQueryThreads,
+                               "number of threads to build and query with.\n", 1, 256)
+        + cmd_manager->createOption("-report_memory", OptionDataType::kBoolNoValue, false,
+                               "print the index memory of every tree.\n")
+        + cmd_manager->createOption("-save", OptionDataType::kString, false,
+                               "write the built index to this file.\n")
+        + cmd_manager->createOption("-load", OptionDataType::kString, false,
+                               "map the index from this file, rebuild and rewrite it if stale.\n")
+        + cmd_manager->createOption("-db", OptionDataType::kString, false,
+                               "the .db file of the design, needed by -save and -load.\n")
+        + cmd_manager->createOption("-partition", OptionDataType::kString, false,
+                               "shard (default): every tree spans its layer; spatial: one tile per tree.\n")
+        + cmd_manager->createOption("-engine", OptionDataType::kString, false,
+                               "boxtree (default): median split tree; hrtree: packed hilbert r-tree.\n")
+        + cmd_manager->createOption("-instanced", OptionDataType::kBoolNoValue, false,
+                               "index the pins and OBS of each master once, placed per instance.\n"));
 
     Command *query_command = cmd_manager->createObjCommand(
         itp, queryCommand, "query", "Query data\n",
         cmd_manager->createOption("area", OptionDataType::kRect, false,
-                               "search window size.\n"));
+                               "search window size.\n")
+        + cmd_manager->createOption("-layers", OptionDataType::kStringList, false,
+                               "only search shapes on these layers.\n")
+        + cmd_manager->createOption("-objects", OptionDataType::kBoolNoValue, false,
+                               "print every hit with its layer, kind, source object and owner.\n")
+        + cmd_manager->createOption("-sorted", OptionDataType::kBoolNoValue, false,
+                               "print the hits like -objects, ordered by rect, layer, kind and object.\n")
+        + cmd_manager->createOption("-unique", OptionDataType::kBoolNoValue, false,
+                               "like -sorted, but print each rect on a layer once.\n")
+        + cmd_manager->createOption("-stats", OptionDataType::kBoolNoValue, false,
+                               "print nodes visited and pruned, rects tested and time per tree instead of the hits.\n"));
+
+    Command *query_batch_command = cmd_manager->createObjCommand(
+        itp, queryBatchCommand, "query_batch", "Query a batch of windows\n",
+        cmd_manager->createOption("-areas_file", OptionDataType::kString, true,
+                               "file with one search window per line: llx lly urx ury.\n")
+        + cmd_manager->createOption("-layers", OptionDataType::kStringList, false,
+                               "only search shapes on these layers.\n"));
+
+    Command *query_point_command = cmd_manager->createObjCommand(
+        itp, queryPointCommand, "query_point", "Query the shapes covering a point\n",
+        cmd_manager->createOption("-point", OptionDataType::kPoint, false,
+                               "the point to hit test: {x y}.\n")
+        + cmd_manager->createOption("-points_file", OptionDataType::kString, false,
+                               "file with one point per line: x y, queried in parallel.\n")
+        + cmd_manager->createOption("-layers", OptionDataType::kStringList, false,
+                               "only search shapes on these layers.\n"));
+
+    Command *query_density_command = cmd_manager->createObjCommand(
+        itp, queryDensityCommand, "query_density",
+        "Report the area the shapes cover in a window, or its density per bin\n",
+        cmd_manager->createOption("area", OptionDataType::kRect, false,
+                               "search window, the core box by default.\n")
+        + cmd_manager->createOption("-bins", OptionDataType::kIntList, false,
+                               "cut the window into {x y} bins and print the density of each.\n")
+        + cmd_manager->createOption("-layers", OptionDataType::kStringList, false,
+                               "only count shapes on these layers.\n"));
+
+    Command *query_nearest_command = cmd_manager->createObjCommand(
+        itp, queryNearestCommand, "query_nearest", "Query the shapes nearest to a point\n",
+        cmd_manager->createOption("-point", OptionDataType::kPoint, true,
+                               "the point to search from: {x y}.\n")
+        + cmd_manager->createOption("-k", OptionDataType::kInt, false, 1,
+                               "number of shapes to return.\n", 1, 1000000)
+        + cmd_manager->createOption("-max_distance", OptionDataType::kDouble, false,
+                               "ignore shapes farther than this.\n")
+        + cmd_manager->createOption("-euclidean", OptionDataType::kBoolNoValue, false,
+                               "measure euclidean instead of manhattan distance.\n")
+        + cmd_manager->createOption("-layers", OptionDataType::kStringList, false,
+                               "only search shapes on these layers.\n"));
+
+    Command *query_pairs_command = cmd_manager->createObjCommand(
+        itp, queryPairsCommand, "query_pairs",
+        "Find all pairs of shapes on a layer that overlap or are closer than a spacing\n",
+        cmd_manager->createOption("-spacing", OptionDataType::kInt, false, 0,
+                               "also pair shapes at most this far apart.\n", 0, 100000000)
+        + cmd_manager->createOption("-layers", OptionDataType::kStringList, false,
+                               "only pair shapes on these layers.\n"));
+
+    Command *query_trace_command = cmd_manager->createObjCommand(
+        itp, queryTraceCommand, "query_trace",
+        "Append a JSON line per query to a file, or stop tracing without -file\n",
+        cmd_manager->createOption("-file", OptionDataType::kString, false,
+                               "the trace file, truncated when opened.\n"));
+
+    Command *rq_insert_command = cmd_manager->createObjCommand(
+        itp, rqInsertCommand, "rq_insert", "Add the shapes of new objects to query data\n",
+        cmd_manager->createOption("-insts", OptionDataType::kStringList, false,
+                               "instance names.\n")
+        + cmd_manager->createOption("-nets", OptionDataType::kStringList, false,
+                               "net or special net names.\n")
+        + cmd_manager->createOption("-io_pins", OptionDataType::kStringList, false,
+                               "io pin names.\n"));
+
+    Command *rq_remove_command = cmd_manager->createObjCommand(
+        itp, rqRemoveCommand, "rq_remove", "Remove the shapes of objects from query data\n",
+        cmd_manager->createOption("-insts", OptionDataType::kStringList, false,
+                               "instance names.\n")
+        + cmd_manager->createOption("-nets", OptionDataType::kStringList, false,
+                               "net or special net names.\n")
+        + cmd_manager->createOption("-io_pins", OptionDataType::kStringList, false,
+                               "io pin names.\n"));
+
+    Command *rq_update_command = cmd_manager->createObjCommand(
+        itp, rqUpdateCommand, "rq_update", "Re-read the shapes of changed objects into query data\n",
+        cmd_manager->createOption("-insts", OptionDataType::kStringList, false,
+                               "instance names.\n")
+        + cmd_manager->createOption("-nets", OptionDataType::kStringList, false,
+                               "net or special net names.\n")
+        + cmd_manager->createOption("-io_pins", OptionDataType::kStringList, false,
+                               "io pin names.\n"));
 
     Command *cleanup_query_command = cmd_manager->createObjCommand(
         itp, cleanupQueryCommand, "cleanup_query", "Initialize query data\n",
@@ -0,0 +1,746 @@
+/**
+ * @file   rq_index.cpp
+ * @date   <date>
+ * @brief  RectQueryIndex checked against a brute force scan of its shapes
+ */
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "db/rq/rq_index.h"
+#include "util/util.h"
+
+EDI_BEGIN_NAMESPACE
+
+namespace unitest {
+
+const int kDie = 40000;
+const int kNumLayers = 4;
+const int kNumMasters = 8;
+const ObjectId kFirstNet = 100;
+const ObjectId kNumNets = 60;
+const ObjectId kFirstInst = 2000000;
+const ObjectId kFirstCell = 5000;
+const uint64_t kSomeLayers = (1 << 1) | (1 << 3);
+const uint64_t kMasks[] = {ALL_LAYERS, kSomeLayers};
+const int kNumMasks = sizeof(kMasks) / sizeof(kMasks[0]);
+const RQDistanceMetric kMetrics[] = {kRQManhattan, kRQEuclidean};
+const double kNoLimit = std::numeric_limits<double>::infinity();
+
+// rect, layer, kind, object and owner: sorted, the order of querySorted
+typedef std::tuple<int, int, int, int, int, int, ObjectId, ObjectId> HitKey;
+typedef std::pair<HitKey, HitKey> PairKey;
+
+static HitKey hitKey(const Box &rect, int layer, RQShapeKind kind,
+                     ObjectId object, ObjectId owner) {
+  return HitKey(rect.getLLX(), rect.getLLY(), rect.getURX(), rect.getURY(),
+                layer, kind, object, owner);
+}
+
+static HitKey hitKey(const RQHit &hit) {
+  return hitKey(hit.rect, hit.layer, hit.kind, hit.object, hit.owner);
+}
+
+static HitKey hitKey(const LRect &shape) {
+  return hitKey(shape.rect_, shape.layer_id_, shape.kind_, shape.source_,
+                shape.owner_);
+}
+
+// the keys of hits[begin] up to hits[end], in order
+static void hitKeys(const std::vector<RQHit> &hits, size_t begin, size_t end,
+                    std::vector<HitKey> &keys) {
+  keys.clear();
+  for (size_t i = begin; i < end; i++) keys.push_back(hitKey(hits[i]));
+}
+
+static void hitKeys(const std::vector<RQHit> &hits,
+                    std::vector<HitKey> &keys) {
+  hitKeys(hits, 0, hits.size(), keys);
+}
+
+static bool samePlace(const HitKey &a, const HitKey &b) {
+  return std::get<0>(a) == std::get<0>(b) && std::get<1>(a) == std::get<1>(b) &&
+         std::get<2>(a) == std::get<2>(b) && std::get<3>(a) == std::get<3>(b) &&
+         std::get<4>(a) == std::get<4>(b);
+}
+
+static LRect makeShape(int x, int y, int w, int h, int layer, ObjectId owner,
+                       ObjectId source, RQShapeKind kind) {
+  LRect shape;
+  shape.rect_ = Box(x, y, x + w, y + h);
+  shape.layer_id_ = layer;
+  shape.owner_ = owner;
+  shape.source_ = source;
+  shape.kind_ = kind;
+  return shape;
+}
+
+static bool selected(int layer, uint64_t layer_mask) {
+  return layer_mask >> layer & 1;
+}
+
+// boundaries included, like the index
+static bool touches(const Box &a, const Box &b) {
+  return !(a.getURX() < b.getLLX() || a.getLLX() > b.getURX() ||
+           a.getURY() < b.getLLY() || a.getLLY() > b.getURY());
+}
+
+static bool hasArea(const Box &a) {
+  return a.getURX() > a.getLLX() && a.getURY() > a.getLLY();
+}
+
+static double distance(const Box &a, const Point &point,
+                       RQDistanceMetric metric) {
+  double x = point.getX(), y = point.getY();
+  double dx = std::max(0.0, std::max(a.getLLX() - x, x - a.getURX()));
+  double dy = std::max(0.0, std::max(a.getLLY() - y, y - a.getURY()));
+  return metric == kRQEuclidean ? sqrt(dx * dx + dy * dy) : dx + dy;
+}
+
+static double overlapArea(const Box &a, int xl, int yl, int xr, int yr) {
+  double w = std::min(a.getURX(), xr) - std::max(a.getLLX(), xl);
+  double h = std::min(a.getURY(), yr) - std::max(a.getLLY(), yl);
+  return w > 0 && h > 0 ? w * h : 0;
+}
+
+static void writeFile(const std::string &file_name, const std::string &bytes) {
+  std::ofstream out(file_name.c_str(), std::ios::binary | std::ios::trunc);
+  out << bytes;
+}
+
+// Nets of wires over a die of placed cells. With instanced the cells stay
+// masters and placements, like LInstances, else their shapes are placed
+// into the chunks; shapes holds every shape flattened either way.
+struct TestDesign {
+  std::vector<std::vector<LRect> > chunks;
+  LInstances instances;
+  std::vector<LRect> shapes;
+  ObjectId num_insts;
+};
+
+static void makeDesign(bool instanced, TestDesign &design) {
+  const int num_chunks = 4;
+  std::mt19937 gen(17);
+  design.chunks.assign(num_chunks, std::vector<LRect>());
+  design.instances = LInstances();
+  design.shapes.clear();
+
+  ObjectId source = 1000000;
+  for (int c = 0; c < num_chunks; c++) {
+    for (int i = 0; i < 300; i++) {
+      int x = gen() % kDie, y = gen() % kDie;
+      int w = gen() % 400 + 1, h = gen() % 400 + 1;
+      // a few long wires, for the layers' LONG_TREEs
+      if (i % 50 == 0) w = kDie / 2;
+      if (i % 50 == 25) h = kDie / 2;
+      int layer = gen() % kNumLayers;
+      ObjectId net = kFirstNet + gen() % kNumNets;
+      LRect shape = makeShape(x, y, w, h, layer, net, source++, kRQShapeWire);
+      design.chunks[c].push_back(shape);
+      // a second object on the same place, for querySorted unique
+      if (i % 10 == 0) {
+        shape.owner_ = kFirstNet + gen() % kNumNets;
+        shape.source_ = source++;
+        shape.kind_ = kRQShapeVia;
+        design.chunks[c].push_back(shape);
+      }
+    }
+    design.shapes.insert(design.shapes.end(), design.chunks[c].begin(),
+                         design.chunks[c].end());
+  }
+
+  // the last master has no shapes
+  std::vector<std::vector<LRect> > masters(kNumMasters);
+  for (int m = 0; m + 1 < kNumMasters; m++) {
+    int num_shapes = gen() % 8 + 1;
+    for (int i = 0; i < num_shapes; i++) {
+      int x = gen() % 2000 - 200, y = gen() % 2000;
+      int w = gen() % 400 + 1, h = gen() % 200 + 1;
+      RQShapeKind kind = i % 3 ? kRQShapeInstPin : kRQShapeInstObs;
+      masters[m].push_back(makeShape(x, y, w, h, gen() % kNumLayers,
+                                     kFirstCell + m, 7000 + m * 100 + i, kind));
+    }
+    if (instanced) {
+      std::vector<LRect> &cell_shapes = design.instances.cell_shapes_;
+      cell_shapes.insert(cell_shapes.end(), masters[m].begin(),
+                         masters[m].end());
+    }
+  }
+
+  design.num_insts = 0;
+  if (instanced) design.instances.placements_.resize(num_chunks);
+  for (int c = 0; c < num_chunks; c++) {
+    for (int i = 0; i < 40; i++) {
+      LPlacement p;
+      p.inst_ = kFirstInst + design.num_insts++;
+      p.cell_ = kFirstCell + gen() % kNumMasters;
+      p.orient_ = gen() % 8;
+      p.x_ = gen() % kDie;
+      p.y_ = gen() % kDie;
+      if (instanced) design.instances.placements_[c].push_back(p);
+
+      boxtree::placement place = {0, p.orient_, p.x_, p.y_};
+      const std::vector<LRect> &master = masters[p.cell_ - kFirstCell];
+      for (unsigned int s = 0; s < master.size(); s++) {
+        const Box &rect = master[s].rect_;
+        boxtree::rect cell_rect = {rect.getLLX(), rect.getLLY(), rect.getURX(),
+                                   rect.getURY()};
+        boxtree::rect placed = boxtree::placeRect(place, cell_rect);
+        LRect shape = master[s];
+        shape.rect_ = Box(placed.xl, placed.yl, placed.xr, placed.yr);
+        shape.owner_ = p.inst_;
+        if (!instanced) design.chunks[c].push_back(shape);
+        design.shapes.push_back(shape);
+      }
+    }
+  }
+}
+
+static void randomWindows(uint32_t seed, int num_windows,
+                          std::vector<Box> &windows) {
+  std::mt19937 gen(seed);
+  windows.clear();
+  for (int i = 0; i < num_windows; i++) {
+    int x = gen() % kDie, y = gen() % kDie;
+    int side = i % 5 == 0 ? kDie : 3000;
+    windows.push_back(Box(x, y, x + gen() % side, y + gen() % side));
+  }
+  // the die itself and a window off it
+  windows.push_back(Box(0, 0, 2 * kDie, 2 * kDie));
+  windows.push_back(Box(3 * kDie, 3 * kDie, 4 * kDie, 4 * kDie));
+}
+
+// random points, and corners and edges of shapes where boundaries matter
+static void randomPoints(uint32_t seed, int num_points,
+                         const std::vector<LRect> &shapes,
+                         std::vector<Point> &points) {
+  std::mt19937 gen(seed);
+  points.clear();
+  for (int i = 0; i < num_points; i++) {
+    const Box &rect = shapes[gen() % shapes.size()].rect_;
+    int y_mid = (rect.getLLY() + rect.getURY()) / 2;
+    if (i % 3 == 0) {
+      points.push_back(Point(gen() % kDie, gen() % kDie));
+    } else if (i % 3 == 1) {
+      points.push_back(Point(rect.getURX(), rect.getURY()));
+    } else {
+      points.push_back(Point(rect.getLLX(), y_mid));
+    }
+  }
+}
+
+class HitCollector : public RQVisitor {
+ public:
+  bool visit(const RQHit *hits, int num_hits) {
+    for (int i = 0; i < num_hits; i++) keys.push_back(hitKey(hits[i]));
+    return true;
+  }
+
+  std::vector<HitKey> keys;
+};
+
+// the pairs each executor thread saw, merged once the join is done
+class PairCollector : public RQPairVisitor {
+ public:
+  explicit PairCollector(int num_threads) : per_thread_(num_threads) {}
+
+  bool visit(const RQHit *first, const RQHit *second, int num_pairs,
+             int thread_id) {
+    for (int i = 0; i < num_pairs; i++) {
+      HitKey a = hitKey(first[i]), b = hitKey(second[i]);
+      if (b < a) std::swap(a, b);
+      per_thread_[thread_id].push_back(PairKey(a, b));
+    }
+    return true;
+  }
+
+  void merge(std::vector<PairKey> &pairs) const {
+    pairs.clear();
+    for (unsigned int t = 0; t < per_thread_.size(); t++) {
+      pairs.insert(pairs.end(), per_thread_[t].begin(), per_thread_[t].end());
+    }
+    std::sort(pairs.begin(), pairs.end());
+  }
+
+ private:
+  std::vector<std::vector<PairKey> > per_thread_;
+};
+
+typedef std::tuple<RQEngine, RQPartition, bool> RQIndexParam;
+
+// GTest class for the rq index, run for both engines and partitions, with
+// cells flattened and instanced
+class RQIndexTest : public ::testing::TestWithParam<RQIndexParam> {
+ public:
+  static void SetUpTestCase() {
+    util::setAppPath("");
+    util::utilInit();
+  }
+
+ protected:
+  RQIndexTest() : executor_(4), index_(&executor_) {}
+
+  void SetUp() {
+    makeDesign(instanced(), design_);
+    shapes_ = design_.shapes;
+    index_.build(design_.chunks, partition(), engine(),
+                 instanced() ? &design_.instances : nullptr);
+  }
+
+  RQEngine engine() const { return std::get<0>(GetParam()); }
+  RQPartition partition() const { return std::get<1>(GetParam()); }
+  bool instanced() const { return std::get<2>(GetParam()); }
+
+  bool load(RectQueryIndex &index, const std::string &file_name,
+            const RQDesignKey &design) const {
+    return index.load(file_name, design, partition(), engine(), instanced());
+  }
+
+  void bruteWindow(const Box &window, uint64_t layer_mask,
+                   std::vector<HitKey> &keys) const {
+    keys.clear();
+    for (unsigned int i = 0; i < shapes_.size(); i++) {
+      const LRect &shape = shapes_[i];
+      if (selected(shape.layer_id_, layer_mask) &&
+          touches(shape.rect_, window)) {
+        keys.push_back(hitKey(shape));
+      }
+    }
+    std::sort(keys.begin(), keys.end());
+  }
+
+  void brutePoint(const Point &point, uint64_t layer_mask,
+                  std::vector<HitKey> &keys) const {
+    Box window(point.getX(), point.getY(), point.getX(), point.getY());
+    bruteWindow(window, layer_mask, keys);
+  }
+
+  // the distances of the k nearest shapes within max_distance
+  void bruteNearest(const Point &point, int k, uint64_t layer_mask,
+                    double max_distance, RQDistanceMetric metric,
+                    std::vector<double> &distances) const {
+    distances.clear();
+    for (unsigned int i = 0; i < shapes_.size(); i++) {
+      if (!selected(shapes_[i].layer_id_, layer_mask)) continue;
+      double d = distance(shapes_[i].rect_, point, metric);
+      if (d <= max_distance) distances.push_back(d);
+    }
+    std::sort(distances.begin(), distances.end());
+    if (distances.size() > (size_t)k) distances.resize(k);
+  }
+
+  void brutePairs(uint64_t layer_mask, int spacing,
+                  std::vector<PairKey> &pairs) const {
+    pairs.clear();
+    for (unsigned int i = 0; i < shapes_.size(); i++) {
+      const LRect &a = shapes_[i];
+      if (!selected(a.layer_id_, layer_mask)) continue;
+      for (unsigned int j = i + 1; j < shapes_.size(); j++) {
+        const LRect &b = shapes_[j];
+        if (b.layer_id_ != a.layer_id_) continue;
+        if (b.rect_.getLLX() > a.rect_.getURX() + spacing ||
+            a.rect_.getLLX() > b.rect_.getURX() + spacing ||
+            b.rect_.getLLY() > a.rect_.getURY() + spacing ||
+            a.rect_.getLLY() > b.rect_.getURY() + spacing) {
+          continue;
+        }
+        HitKey ka = hitKey(a), kb = hitKey(b);
+        if (kb < ka) std::swap(ka, kb);
+        pairs.push_back(PairKey(ka, kb));
+      }
+    }
+    std::sort(pairs.begin(), pairs.end());
+  }
+
+  void bruteDensity(const Box &window, int num_x, int num_y,
+                    uint64_t layer_mask, std::vector<double> &areas) const {
+    long long w = (long long)window.getURX() - window.getLLX();
+    long long h = (long long)window.getURY() - window.getLLY();
+    areas.assign(num_x * num_y, 0);
+    for (unsigned int s = 0; s < shapes_.size(); s++) {
+      if (!selected(shapes_[s].layer_id_, layer_mask)) continue;
+      for (int j = 0; j < num_y; j++) {
+        int yl = window.getLLY() + (int)(h * j / num_y);
+        int yr = window.getLLY() + (int)(h * (j + 1) / num_y);
+        for (int i = 0; i < num_x; i++) {
+          int xl = window.getLLX() + (int)(w * i / num_x);
+          int xr = window.getLLX() + (int)(w * (i + 1) / num_x);
+          areas[j * num_x + i] += overlapArea(shapes_[s].rect_, xl, yl, xr, yr);
+        }
+      }
+    }
+  }
+
+  // querySorted and queryCount of index match the brute force over shapes_
+  void checkWindows(const RectQueryIndex &index, uint32_t seed) const {
+    std::vector<Box> windows;
+    randomWindows(seed, 30, windows);
+    for (int m = 0; m < kNumMasks; m++) {
+      for (unsigned int w = 0; w < windows.size(); w++) {
+        std::vector<HitKey> expected, keys;
+        bruteWindow(windows[w], kMasks[m], expected);
+        std::vector<RQHit> hits;
+        index.querySorted(windows[w], kMasks[m], false, hits);
+        hitKeys(hits, keys);
+        EXPECT_EQ(keys, expected);
+        EXPECT_EQ(index.queryCount(windows[w], kMasks[m]), expected.size());
+      }
+    }
+  }
+
+  void checkDensity(const RectQueryIndex &index, const Box &window, int num_x,
+                    int num_y, uint64_t layer_mask) const {
+    std::vector<double> expected, areas;
+    bruteDensity(window, num_x, num_y, layer_mask, expected);
+    index.queryDensity(window, num_x, num_y, layer_mask, areas);
+    ASSERT_EQ(areas.size(), expected.size());
+    for (unsigned int b = 0; b < areas.size(); b++) {
+      EXPECT_NEAR(areas[b], expected[b], 1e-9 * std::max(1.0, expected[b]));
+    }
+  }
+
+  void checkNearest(const RectQueryIndex &index, const Point &point, int k,
+                    uint64_t layer_mask, double max_distance,
+                    RQDistanceMetric metric) const {
+    std::vector<double> expected;
+    bruteNearest(point, k, layer_mask, max_distance, metric, expected);
+    std::vector<RQHit> hits;
+    std::vector<double> distances;
+    index.queryNearest(point, k, layer_mask, max_distance, metric, hits,
+                       distances);
+    ASSERT_EQ(hits.size(), distances.size());
+    ASSERT_EQ(distances.size(), expected.size());
+    for (unsigned int i = 0; i < hits.size(); i++) {
+      // ties may pick any of the shapes at a distance, but its distance
+      // is the i-th smallest all the same
+      EXPECT_NEAR(distances[i], expected[i], 1e-9);
+      EXPECT_NEAR(distance(hits[i].rect, point, metric), distances[i], 1e-9);
+      EXPECT_TRUE(selected(hits[i].layer, layer_mask));
+    }
+  }
+
+  RQExecutor executor_;
+  TestDesign design_;
+  std::vector<LRect> shapes_;
+  RectQueryIndex index_;
+};
+
+TEST_P(RQIndexTest, Window) {
+  std::vector<Box> windows;
+  randomWindows(1, 40, windows);
+  for (int m = 0; m < kNumMasks; m++) {
+    for (unsigned int w = 0; w < windows.size(); w++) {
+      std::vector<HitKey> expected, keys;
+      bruteWindow(windows[w], kMasks[m], expected);
+
+      std::vector<RQHit> hits;
+      index_.queryObjects(windows[w], kMasks[m], hits);
+      hitKeys(hits, keys);
+      std::sort(keys.begin(), keys.end());
+      EXPECT_EQ(keys, expected);
+
+      HitCollector collector;
+      index_.query(windows[w], kMasks[m], collector);
+      std::sort(collector.keys.begin(), collector.keys.end());
+      EXPECT_EQ(collector.keys, expected);
+
+      EXPECT_EQ(index_.queryCount(windows[w], kMasks[m]), expected.size());
+      EXPECT_EQ(index_.queryAny(windows[w], kMasks[m]), !expected.empty());
+    }
+  }
+  // no shape is on layer 10
+  EXPECT_EQ(index_.queryCount(windows[0], 1 << 10), 0u);
+  EXPECT_FALSE(index_.queryAny(Box(0, 0, kDie, kDie), 1 << 10));
+}
+
+TEST_P(RQIndexTest, Batch) {
+  std::vector<Box> windows;
+  randomWindows(2, 40, windows);
+  std::vector<RQHit> hits;
+  std::vector<size_t> offsets;
+  index_.queryBatch(windows, kSomeLayers, hits, offsets);
+  ASSERT_EQ(offsets.size(), windows.size() + 1);
+  EXPECT_EQ(offsets.back(), hits.size());
+  for (unsigned int w = 0; w < windows.size(); w++) {
+    std::vector<HitKey> expected, keys;
+    bruteWindow(windows[w], kSomeLayers, expected);
+    hitKeys(hits, offsets[w], offsets[w + 1], keys);
+    std::sort(keys.begin(), keys.end());
+    EXPECT_EQ(keys, expected);
+  }
+}
+
+TEST_P(RQIndexTest, Sorted) {
+  std::vector<Box> windows;
+  randomWindows(3, 40, windows);
+  for (int m = 0; m < kNumMasks; m++) {
+    for (unsigned int w = 0; w < windows.size(); w++) {
+      std::vector<HitKey> expected, keys;
+      bruteWindow(windows[w], kMasks[m], expected);
+
+      std::vector<RQHit> hits;
+      index_.querySorted(windows[w], kMasks[m], false, hits);
+      hitKeys(hits, keys);
+      EXPECT_EQ(keys, expected);
+
+      expected.erase(std::unique(expected.begin(), expected.end(), samePlace),
+                     expected.end());
+      index_.querySorted(windows[w], kMasks[m], true, hits);
+      hitKeys(hits, keys);
+      EXPECT_EQ(keys, expected);
+    }
+  }
+}
+
+TEST_P(RQIndexTest, Point) {
+  std::vector<Point> points;
+  randomPoints(4, 300, shapes_, points);
+  for (int m = 0; m < kNumMasks; m++) {
+    RQPointHits hits;
+    for (unsigned int p = 0; p < points.size(); p++) {
+      std::vector<HitKey> expected, keys;
+      brutePoint(points[p], kMasks[m], expected);
+      index_.queryPoint(points[p], kMasks[m], hits);
+      for (int i = 0; i < hits.size(); i++) keys.push_back(hitKey(hits[i]));
+      std::sort(keys.begin(), keys.end());
+      EXPECT_EQ(keys, expected);
+    }
+
+    std::vector<RQHit> batch;
+    std::vector<size_t> offsets;
+    index_.queryPointBatch(points, kMasks[m], batch, offsets);
+    ASSERT_EQ(offsets.size(), points.size() + 1);
+    EXPECT_EQ(offsets.back(), batch.size());
+    for (unsigned int p = 0; p < points.size(); p++) {
+      std::vector<HitKey> expected, keys;
+      brutePoint(points[p], kMasks[m], expected);
+      hitKeys(batch, offsets[p], offsets[p + 1], keys);
+      std::sort(keys.begin(), keys.end());
+      EXPECT_EQ(keys, expected);
+    }
+  }
+}
+
+TEST_P(RQIndexTest, Nearest) {
+  const int ks[] = {1, 5, 40};
+  const double max_distances[] = {kNoLimit, 300};
+  std::vector<Point> points;
+  randomPoints(5, 40, shapes_, points);
+  for (unsigned int p = 0; p < points.size(); p++) {
+    for (int k = 0; k < 3; k++) {
+      for (int d = 0; d < 2; d++) {
+        for (int metric = 0; metric < 2; metric++) {
+          checkNearest(index_, points[p], ks[k], kMasks[p % kNumMasks],
+                       max_distances[d], kMetrics[metric]);
+        }
+      }
+    }
+  }
+}
+
+TEST_P(RQIndexTest, Pairs) {
+  const int spacings[] = {0, 60};
+  for (int m = 0; m < kNumMasks; m++) {
+    for (int s = 0; s < 2; s++) {
+      std::vector<PairKey> expected, pairs;
+      brutePairs(kMasks[m], spacings[s], expected);
+      PairCollector collector(executor_.getNumThreads());
+      index_.queryPairs(kMasks[m], spacings[s], collector);
+      collector.merge(pairs);
+      // both sorted, so a pair reported twice shows up here as well
+      EXPECT_EQ(pairs, expected);
+    }
+  }
+}
+
+TEST_P(RQIndexTest, Density) {
+  std::vector<Box> windows;
+  randomWindows(6, 10, windows);
+  for (unsigned int w = 0; w < windows.size(); w++) {
+    if (!hasArea(windows[w])) continue;
+    checkDensity(index_, windows[w], 1, 1, ALL_LAYERS);
+    checkDensity(index_, windows[w], 4, 3, kSomeLayers);
+    checkDensity(index_, windows[w], 16, 16, ALL_LAYERS);
+  }
+  Box around_die(-100, -100, kDie + 100, kDie + 100);
+  checkDensity(index_, around_die, 64, 64, ALL_LAYERS);
+}
+
+TEST_P(RQIndexTest, Eco) {
+  std::mt19937 gen(7);
+  // a few nets and instances go
+  for (int i = 0; i < 10; i++) {
+    ObjectId owner = i % 2 ? kFirstNet + gen() % kNumNets
+                           : kFirstInst + gen() % design_.num_insts;
+    int num_shapes = 0;
+    for (unsigned int s = 0; s < shapes_.size(); s++) {
+      num_shapes += shapes_[s].owner_ == owner;
+    }
+    EXPECT_EQ(index_.indexed(owner), num_shapes > 0);
+    int removed = index_.remove(owner);
+    // an instanced inst is a rect per cell tree, not a rect per shape
+    if (instanced() && owner >= kFirstInst) {
+      EXPECT_EQ(removed > 0, num_shapes > 0);
+    } else {
+      EXPECT_EQ(removed, num_shapes);
+    }
+    EXPECT_FALSE(index_.indexed(owner));
+    EXPECT_EQ(index_.remove(owner), 0);
+    shapes_.erase(std::remove_if(shapes_.begin(), shapes_.end(),
+                                 [owner](const LRect &shape) {
+                                   return shape.owner_ == owner;
+                                 }),
+                  shapes_.end());
+  }
+
+  // new nets, enough on layer 0 to pass the rebuild threshold
+  std::vector<LRect> added;
+  for (int i = 0; i < REBUILD_MIN + 500; i++) {
+    int layer = i < REBUILD_MIN ? 0 : gen() % kNumLayers;
+    int x = gen() % kDie, y = gen() % kDie;
+    int w = gen() % 300 + 1, h = gen() % 300 + 1;
+    ObjectId net = kFirstNet + kNumNets + i % 20;
+    added.push_back(makeShape(x, y, w, h, layer, net, 3000000 + i,
+                              kRQShapePatch));
+  }
+  index_.insert(added);
+  shapes_.insert(shapes_.end(), added.begin(), added.end());
+  EXPECT_TRUE(index_.indexed(kFirstNet + kNumNets));
+  checkWindows(index_, 8);
+
+  index_.rebuildDegradedLayers();
+  checkWindows(index_, 9);
+
+  // and answers like an index built from the live shapes
+  std::vector<std::vector<LRect> > chunks(1, shapes_);
+  RectQueryIndex fresh(&executor_);
+  fresh.build(chunks, partition(), engine());
+  std::vector<Box> windows;
+  randomWindows(10, 30, windows);
+  for (unsigned int w = 0; w < windows.size(); w++) {
+    std::vector<RQHit> hits, fresh_hits;
+    std::vector<HitKey> keys, fresh_keys;
+    index_.querySorted(windows[w], ALL_LAYERS, false, hits);
+    fresh.querySorted(windows[w], ALL_LAYERS, false, fresh_hits);
+    hitKeys(hits, keys);
+    hitKeys(fresh_hits, fresh_keys);
+    EXPECT_EQ(keys, fresh_keys);
+    if (!hasArea(windows[w])) continue;
+    std::vector<double> areas, fresh_areas;
+    index_.queryDensity(windows[w], 8, 8, ALL_LAYERS, areas);
+    fresh.queryDensity(windows[w], 8, 8, ALL_LAYERS, fresh_areas);
+    ASSERT_EQ(areas.size(), fresh_areas.size());
+    for (unsigned int b = 0; b < areas.size(); b++) {
+      double tolerance = 1e-9 * std::max(1.0, fresh_areas[b]);
+      EXPECT_NEAR(areas[b], fresh_areas[b], tolerance);
+    }
+  }
+  std::vector<Point> points;
+  randomPoints(11, 30, shapes_, points);
+  for (unsigned int p = 0; p < points.size(); p++) {
+    checkNearest(index_, points[p], 10, ALL_LAYERS, kNoLimit, kRQEuclidean);
+  }
+}
+
+TEST_P(RQIndexTest, SaveLoad) {
+  std::string file_name = ::testing::TempDir() + "unittest_rq_index.rq";
+  std::string db_file = ::testing::TempDir() + "unittest_rq_design.db";
+  writeFile(db_file, "not really a design, but hashed all the same");
+  RQDesignKey design;
+  ASSERT_TRUE(hashDesignFile(db_file, design));
+  ASSERT_TRUE(index_.save(file_name, design));
+
+  RectQueryIndex loaded(&executor_);
+  ASSERT_TRUE(load(loaded, file_name, design));
+  std::vector<Box> windows;
+  randomWindows(12, 30, windows);
+  for (unsigned int w = 0; w < windows.size(); w++) {
+    std::vector<RQHit> hits, loaded_hits;
+    std::vector<HitKey> keys, loaded_keys;
+    index_.querySorted(windows[w], ALL_LAYERS, false, hits);
+    loaded.querySorted(windows[w], ALL_LAYERS, false, loaded_hits);
+    hitKeys(hits, keys);
+    hitKeys(loaded_hits, loaded_keys);
+    EXPECT_EQ(keys, loaded_keys);
+  }
+  checkWindows(loaded, 13);
+  checkDensity(loaded, Box(0, 0, kDie, kDie), 8, 8, ALL_LAYERS);
+  checkNearest(loaded, Point(kDie / 2, kDie / 2), 10, kSomeLayers, kNoLimit,
+               kRQManhattan);
+  // a loaded index takes ECOs like a built one
+  EXPECT_EQ(loaded.remove(kFirstNet), index_.remove(kFirstNet));
+  EXPECT_FALSE(loaded.indexed(kFirstNet));
+
+  // other init_query settings
+  Box die(0, 0, kDie, kDie);
+  RQEngine other_engine =
+      engine() == kRQEngineBoxTree ? kRQEngineHRTree : kRQEngineBoxTree;
+  RQPartition other_partition =
+      partition() == kRQPartitionShard ? kRQPartitionSpatial
+                                       : kRQPartitionShard;
+  EXPECT_FALSE(loaded.load(file_name, design, partition(), other_engine,
+                           instanced()));
+  EXPECT_EQ(loaded.queryCount(die, ALL_LAYERS), 0u);
+  EXPECT_FALSE(loaded.load(file_name, design, other_partition, engine(),
+                           instanced()));
+  EXPECT_FALSE(loaded.load(file_name, design, partition(), engine(),
+                           !instanced()));
+
+  // a .db of the same size with one byte changed
+  {
+    std::fstream db(db_file.c_str(),
+                    std::ios::binary | std::ios::in | std::ios::out);
+    db.seekp(2);
+    db.put('A');
+  }
+  RQDesignKey changed;
+  ASSERT_TRUE(hashDesignFile(db_file, changed));
+  EXPECT_EQ(changed.size, design.size);
+  EXPECT_NE(changed.hash, design.hash);
+  EXPECT_FALSE(load(loaded, file_name, changed));
+  EXPECT_EQ(loaded.queryCount(die, ALL_LAYERS), 0u);
+
+  // corrupt files: a bad magic, cut short, empty, missing
+  std::string bytes;
+  {
+    std::ifstream in(file_name.c_str(), std::ios::binary);
+    bytes.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+  }
+  std::string corrupt = bytes;
+  corrupt[0] ^= 0x5a;
+  writeFile(file_name, corrupt);
+  EXPECT_FALSE(load(loaded, file_name, design));
+  writeFile(file_name, bytes.substr(0, bytes.size() / 2));
+  EXPECT_FALSE(load(loaded, file_name, design));
+  writeFile(file_name, "");
+  EXPECT_FALSE(load(loaded, file_name, design));
+  ::remove(file_name.c_str());
+  ::remove(db_file.c_str());
+  EXPECT_FALSE(load(loaded, file_name, design));
+  EXPECT_EQ(loaded.queryCount(die, ALL_LAYERS), 0u);
+  EXPECT_FALSE(hashDesignFile(db_file, changed));
+}
+
+INSTANTIATE_TEST_CASE_P(
+    RQIndex, RQIndexTest,
+    ::testing::Combine(::testing::Values(kRQEngineBoxTree, kRQEngineHRTree),
+                       ::testing::Values(kRQPartitionShard,
+                                         kRQPartitionSpatial),
+                       ::testing::Bool()));
+
+}  // namespace unitest
+
+EDI_END_NAMESPACE
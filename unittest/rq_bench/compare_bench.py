@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Compares two rq_bench result files, e.g. of the commits before and after
+# a change: python3 compare_bench.py base.jsonl new.jsonl
+#
+# Results are matched by bench name and run settings. Each line shows new
+# over base for times, memory and throughput; below 1 is faster or smaller
+# except for qps.
+
+import json
+import sys
+
+KEYS = ("seconds", "p50_us", "p99_us", "qps", "index_kb", "peak_rss_kb")
+SETTINGS = ("bench", "scale", "seed", "threads", "engine", "partition", "instanced")
+
+
+def load(file_name):
+    results = {}
+    with open(file_name) as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            result = json.loads(line)
+            # a later run of the same settings replaces an earlier one
+            results[tuple(result.get(key) for key in SETTINGS)] = result
+    return results
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: compare_bench.py base.jsonl new.jsonl")
+        return 1
+    base = load(sys.argv[1])
+    new = load(sys.argv[2])
+    for settings in base:
+        if settings not in new:
+            continue
+        ratios = []
+        for key in KEYS:
+            if key in base[settings] and base[settings][key]:
+                ratios.append("%s %.3f" % (key, new[settings][key] / base[settings][key]))
+        if ratios:
+            print("%-40s %s" % (" ".join(str(s) for s in settings[:1] + settings[4:]),
+                                "  ".join(ratios)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
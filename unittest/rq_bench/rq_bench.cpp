@@ -0,0 +1,340 @@
+/* @file  rq_bench.cpp
+ * @date  <date>
+ * @brief Build and query benchmark of the rq index on synthetic designs
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+
+// Usage: rq_bench [-scale s] [-seed n] [-threads n] [-engine boxtree|hrtree]
+//                 [-partition shard|spatial] [-instanced] [-queries n]
+//                 [-stripes n] [-via_arrays n] [-label text] [-out file]
+//
+// Builds the index of one synthetic design, then runs each query mix
+// warm: a tenth of its queries first untimed, then all of them timed one by
+// one. Every result is one JSON line, written to -out (default stdout) so
+// that runs of two commits can be compared with compare_bench.py.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "db/rq/rq_index.h"
+#include "synthetic_design.h"
+
+namespace open_edi {
+namespace db {
+
+typedef std::chrono::steady_clock BenchClock;
+
+struct BenchOptions {
+    SyntheticSpec spec;
+    double scale;
+    int threads;
+    RQEngine engine;
+    RQPartition partition;
+    int queries;
+    std::string label;
+    std::string out;
+};
+
+static double secondsSince(BenchClock::time_point start) {
+    return std::chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+static long peakRssKB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static int usage(const char *arg) {
+    fprintf(stderr, "rq_bench: bad argument %s, see the head of rq_bench.cpp.\n", arg);
+    return 1;
+}
+
+static int parseOptions(int argc, char **argv, BenchOptions &options) {
+    options.scale = 1;
+    options.threads = 4;
+    options.engine = kRQEngineBoxTree;
+    options.partition = kRQPartitionShard;
+    options.queries = 20000;
+    options.label = "";
+    options.out = "";
+    int seed = 1, stripes = -1, via_arrays = -1;
+    bool instanced = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "-instanced") {
+            instanced = true;
+        } else if (!has_value) {
+            return usage(argv[i]);
+        } else if (arg == "-scale") {
+            options.scale = atof(argv[++i]);
+        } else if (arg == "-seed") {
+            seed = atoi(argv[++i]);
+        } else if (arg == "-threads") {
+            options.threads = atoi(argv[++i]);
+        } else if (arg == "-engine") {
+            std::string name = argv[++i];
+            if (name != "boxtree" && name != "hrtree") return usage(argv[i]);
+            options.engine = name == "hrtree" ? kRQEngineHRTree : kRQEngineBoxTree;
+        } else if (arg == "-partition") {
+            std::string mode = argv[++i];
+            if (mode != "shard" && mode != "spatial") return usage(argv[i]);
+            options.partition = mode == "spatial" ? kRQPartitionSpatial : kRQPartitionShard;
+        } else if (arg == "-queries") {
+            options.queries = atoi(argv[++i]);
+        } else if (arg == "-stripes") {
+            stripes = atoi(argv[++i]);
+        } else if (arg == "-via_arrays") {
+            via_arrays = atoi(argv[++i]);
+        } else if (arg == "-label") {
+            options.label = argv[++i];
+        } else if (arg == "-out") {
+            options.out = argv[++i];
+        } else {
+            return usage(argv[i]);
+        }
+    }
+    if (options.scale <= 0 || options.threads < 1 || options.queries < 1) {
+        fprintf(stderr, "rq_bench: -scale, -threads and -queries must be positive.\n");
+        return 1;
+    }
+    defaultSyntheticSpec(options.spec, options.scale);
+    options.spec.seed = seed;
+    options.spec.instanced = instanced;
+    if (stripes >= 0) options.spec.num_stripes = stripes;
+    if (via_arrays >= 0) options.spec.num_via_arrays = via_arrays;
+    return 0;
+}
+
+// writes the members every line shares, then those of one result
+class ResultWriter {
+  public:
+    ResultWriter(FILE *file, const BenchOptions &options) : file_(file), options_(options) {}
+    void write(const char *bench, const char *members) {
+        fprintf(file_,
+                "{\"bench\":\"%s\",\"label\":\"%s\",\"scale\":%g,\"seed\":%u,\"threads\":%d,"
+                "\"engine\":\"%s\",\"partition\":\"%s\",\"instanced\":%s,%s}\n",
+                bench, options_.label.c_str(), options_.scale, options_.spec.seed,
+                options_.threads, options_.engine == kRQEngineHRTree ? "hrtree" : "boxtree",
+                options_.partition == kRQPartitionSpatial ? "spatial" : "shard",
+                options_.spec.instanced ? "true" : "false", members);
+        fflush(file_);
+    }
+
+  private:
+    FILE *file_;
+    const BenchOptions &options_;
+};
+
+static double percentile(std::vector<double> &sorted, double p) {
+    size_t at = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[at];
+}
+
+// run(i) is query i of the mix and returns its result count
+static void runMix(const char *bench, int num_queries, const std::function<uint64_t(int)> &run,
+                   ResultWriter &writer) {
+    for (int i = 0; i < num_queries / 10; i++) run(i);
+    std::vector<double> latencies(num_queries);
+    uint64_t results = 0;
+    BenchClock::time_point start = BenchClock::now();
+    for (int i = 0; i < num_queries; i++) {
+        BenchClock::time_point query_start = BenchClock::now();
+        results += run(i);
+        latencies[i] = secondsSince(query_start);
+    }
+    double seconds = secondsSince(start);
+    std::sort(latencies.begin(), latencies.end());
+    char members[256];
+    snprintf(members, sizeof(members),
+             "\"queries\":%d,\"results\":%lu,\"seconds\":%.6f,\"qps\":%.1f,"
+             "\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f",
+             num_queries, results, seconds, num_queries / seconds,
+             percentile(latencies, 0.5) * 1e6, percentile(latencies, 0.99) * 1e6,
+             latencies.back() * 1e6);
+    writer.write(bench, members);
+}
+
+// what a density map costs without queryDensity: every shape of the window
+// through query(), clipped to the bins by hand
+class ClippingVisitor : public RQVisitor {
+  public:
+    explicit ClippingVisitor(boxtree::densitygrid &grid) : grid_(grid) {}
+    bool visit(const RQHit *hits, int num_hits) {
+        for (int i = 0; i < num_hits; i++) {
+            const Box &r = hits[i].rect;
+            grid_.add({r.getLLX(), r.getLLY(), r.getURX(), r.getURY()});
+        }
+        return true;
+    }
+
+  private:
+    boxtree::densitygrid &grid_;
+};
+
+static Box windowAt(const Point &center, int width, int height) {
+    return Box(center.getX() - width / 2, center.getY() - height / 2,
+               center.getX() + width / 2, center.getY() + height / 2);
+}
+
+static int runBench(const BenchOptions &options) {
+    FILE *file = stdout;
+    if (!options.out.empty() && !(file = fopen(options.out.c_str(), "a"))) {
+        fprintf(stderr, "rq_bench: cannot open %s.\n", options.out.c_str());
+        return 1;
+    }
+    ResultWriter writer(file, options);
+    char members[256];
+
+    BenchClock::time_point start = BenchClock::now();
+    SyntheticDesign design;
+    RQExecutor executor(options.threads);
+    buildSyntheticDesign(options.spec, executor.getNumThreads() * 4, design);
+    snprintf(members, sizeof(members), "\"seconds\":%.6f,\"shapes\":%lu,\"cells\":%d,\"die\":%d",
+             secondsSince(start), design.num_shapes, options.spec.num_cells,
+             design.die.getURX());
+    writer.write("generate", members);
+
+    start = BenchClock::now();
+    RectQueryIndex index(&executor);
+    index.build(design.chunks, options.partition, options.engine,
+                options.spec.instanced ? &design.instances : nullptr);
+    double build_seconds = secondsSince(start);
+    const boxtree::forest &forest = index.getForest();
+    size_t index_bytes = 0;
+    for (unsigned int i = 0; i < forest.rdb.size(); i++) {
+        index_bytes += boxtree::treeMemory(forest.rdb[i]);
+    }
+    for (unsigned int i = 0; i < forest.cells.size(); i++) {
+        index_bytes += boxtree::treeMemory(forest.cells[i]);
+    }
+    snprintf(members, sizeof(members),
+             "\"seconds\":%.6f,\"trees\":%lu,\"index_kb\":%lu,\"peak_rss_kb\":%ld",
+             build_seconds, forest.rdb.size(), index_bytes / 1024, peakRssKB());
+    writer.write("build", members);
+
+    // every mix draws from its own stream, so adding a mix keeps the others
+    const std::vector<Point> &pins = design.pins;
+    int die = design.die.getURX(), n = options.queries;
+    std::vector<Box> pin_windows(n), track_windows(n), region_windows(n);
+    std::vector<Point> points(n);
+    std::mt19937 rng(options.spec.seed + 1);
+    for (int i = 0; i < n; i++) {
+        pin_windows[i] = windowAt(pins[rng() % pins.size()], 400, 400);
+    }
+    for (int i = 0; i < n; i++) {
+        Point at(rng() % die, rng() % die);
+        track_windows[i] = i % 2 ? windowAt(at, 20000, 2000) : windowAt(at, 2000, 20000);
+    }
+    int side = std::max(1, die / 10);
+    for (int i = 0; i < n; i++) {
+        region_windows[i] = windowAt(Point(rng() % die, rng() % die), side, side);
+    }
+    for (int i = 0; i < n; i++) {
+        points[i] = i % 2 ? pins[rng() % pins.size()] : Point(rng() % die, rng() % die);
+    }
+
+    std::vector<RQHit> hits;
+    std::vector<double> distances;
+    runMix("objects_pin", n, [&](int i) {
+        index.queryObjects(pin_windows[i], ALL_LAYERS, hits);
+        return (uint64_t)hits.size();
+    }, writer);
+    runMix("objects_track", n, [&](int i) {
+        index.queryObjects(track_windows[i], ALL_LAYERS, hits);
+        return (uint64_t)hits.size();
+    }, writer);
+    runMix("count_region", std::max(1, n / 20), [&](int i) {
+        return index.queryCount(region_windows[i], ALL_LAYERS);
+    }, writer);
+    std::vector<double> areas;
+    runMix("area_region", std::max(1, n / 20), [&](int i) {
+        index.queryDensity(region_windows[i], 1, 1, ALL_LAYERS, areas);
+        return (uint64_t)areas.size();
+    }, writer);
+    runMix("any_pin", n, [&](int i) {
+        return (uint64_t)index.queryAny(pin_windows[i], ALL_LAYERS);
+    }, writer);
+    // half the points are on pins, half anywhere
+    RQPointHits point_hits;
+    runMix("point", n, [&](int i) {
+        index.queryPoint(points[i], ALL_LAYERS, point_hits);
+        return (uint64_t)point_hits.size();
+    }, writer);
+    runMix("nearest_8", n, [&](int i) {
+        index.queryNearest(points[i], 8, ALL_LAYERS, 1e18, kRQManhattan, hits, distances);
+        return (uint64_t)hits.size();
+    }, writer);
+
+    // a batch is timed as one query, qps counts its windows
+    const int batch_size = 1024;
+    std::vector<size_t> offsets;
+    std::vector<Box> batch;
+    BenchClock::time_point batch_start = BenchClock::now();
+    uint64_t batch_results = 0;
+    for (int i = 0; i < n; i += batch_size) {
+        batch.assign(pin_windows.begin() + i, pin_windows.begin() + std::min(n, i + batch_size));
+        index.queryBatch(batch, ALL_LAYERS, hits, offsets);
+        batch_results += hits.size();
+    }
+    double batch_seconds = secondsSince(batch_start);
+    snprintf(members, sizeof(members),
+             "\"queries\":%d,\"results\":%lu,\"seconds\":%.6f,\"qps\":%.1f", n, batch_results,
+             batch_seconds, n / batch_seconds);
+    writer.write("batch_pin", members);
+
+    // every pin of the design at once, as a pin access check would
+    batch_start = BenchClock::now();
+    index.queryPointBatch(pins, ALL_LAYERS, hits, offsets);
+    batch_seconds = secondsSince(batch_start);
+    snprintf(members, sizeof(members),
+             "\"queries\":%lu,\"results\":%lu,\"seconds\":%.6f,\"qps\":%.1f", pins.size(),
+             hits.size(), batch_seconds, pins.size() / batch_seconds);
+    writer.write("batch_point", members);
+
+    // the die as one density map, against clipping every shape of it
+    const int map_bins = 64;
+    batch_start = BenchClock::now();
+    index.queryDensity(design.die, map_bins, map_bins, ALL_LAYERS, areas);
+    batch_seconds = secondsSince(batch_start);
+    std::vector<double> clipped(map_bins * map_bins, 0);
+    boxtree::densitygrid grid;
+    boxtree::setGrid(grid, {design.die.getLLX(), design.die.getLLY(), design.die.getURX(),
+                            design.die.getURY()},
+                     map_bins, map_bins, &clipped[0]);
+    ClippingVisitor clipping(grid);
+    BenchClock::time_point clip_start = BenchClock::now();
+    index.query(design.die, ALL_LAYERS, clipping);
+    snprintf(members, sizeof(members), "\"bins\":%d,\"seconds\":%.6f,\"clip_seconds\":%.6f",
+             map_bins * map_bins, batch_seconds, secondsSince(clip_start));
+    writer.write("density_die", members);
+
+    snprintf(members, sizeof(members), "\"peak_rss_kb\":%ld", peakRssKB());
+    writer.write("done", members);
+    if (file != stdout) fclose(file);
+    return 0;
+}
+
+}  // namespace db
+}  // namespace open_edi
+
+int main(int argc, char **argv) {
+    open_edi::db::BenchOptions options;
+    if (open_edi::db::parseOptions(argc, argv, options) != 0) return 1;
+    return open_edi::db::runBench(options);
+}
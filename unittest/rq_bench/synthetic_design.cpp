@@ -0,0 +1,247 @@
+/* @file  synthetic_design.cpp
+ * @date  <date>
+ * @brief Synthetic designs for the rq benchmark
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+
+#include "synthetic_design.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <random>
+
+#include "db/rq/obtree.h"
+
+namespace open_edi {
+namespace db {
+
+// ids of the owners and sources, apart so that no two kinds collide
+static const ObjectId kMasterBase = 1000000000ull;
+static const ObjectId kNetBase = 2000000000ull;
+static const ObjectId kSpecialNetBase = 3000000000ull;
+static const int kTrackPitch = 400;
+static const int kWireWidth = 100;
+static const int kCutSize = 100;
+static const int kCutPitch = 200;
+static const int kStripeWidth = 2000;
+// orientations of even and odd rows: N, and FS, which mirrors y
+static const int kRowOrient[2] = {0, 4};
+
+void defaultSyntheticSpec(SyntheticSpec &spec, double scale) {
+    spec.seed = 1;
+    spec.num_cells = std::max(1, (int)(100000 * scale));
+    spec.num_masters = 64;
+    spec.num_metals = 6;
+    spec.num_wires = std::max(1, (int)(400000 * scale));
+    spec.num_vias = std::max(1, (int)(200000 * scale));
+    spec.num_via_arrays = std::max(1, (int)(2000 * scale));
+    spec.via_array_size = 4;
+    spec.num_stripes = 64;
+    spec.instanced = false;
+}
+
+static int cutLayer(int metal) { return 2 * metal - 2; }
+static int wireLayer(int metal) { return 2 * metal - 1; }
+
+struct Master {
+    int width;
+    std::vector<LRect> shapes;  // in the master's frame
+};
+
+static void makeMasters(const SyntheticSpec &spec, std::mt19937 &rng,
+                        std::vector<Master> &masters) {
+    masters.resize(spec.num_masters);
+    for (int m = 0; m < spec.num_masters; m++) {
+        Master &master = masters[m];
+        int sites = 3 + rng() % 18;
+        master.width = sites * kBenchSite;
+        ObjectId cell = kMasterBase + m;
+        int num_pins = 2 + rng() % 5;
+        for (int p = 0; p < num_pins; p++) {
+            int x = (rng() % sites) * kBenchSite + kBenchSite / 2 - 30;
+            int y = 200 + rng() % 800;
+            LRect pin;
+            pin.rect_ = Box(x, y, x + 60, y + 300 + rng() % 900);
+            pin.layer_id_ = 1;
+            pin.owner_ = cell;
+            pin.source_ = cell * 16 + p;
+            pin.kind_ = kRQShapeInstPin;
+            master.shapes.push_back(pin);
+        }
+        int num_obs = rng() % 3;
+        for (int o = 0; o < num_obs; o++) {
+            int xl = (rng() % sites) * kBenchSite;
+            int xr = std::min(master.width, xl + (1 + (int)(rng() % 4)) * kBenchSite);
+            LRect obs;
+            obs.rect_ = Box(xl, 100, xr, kBenchRow - 100);
+            obs.layer_id_ = 0;
+            obs.owner_ = cell;
+            obs.source_ = cell;
+            obs.kind_ = kRQShapeInstObs;
+            master.shapes.push_back(obs);
+        }
+    }
+}
+
+static Box placeBox(const Box &box, int orient, int x, int y) {
+    boxtree::rect a = {box.getLLX(), box.getLLY(), box.getURX(), box.getURY()};
+    boxtree::placement p = {0, orient, x, y};
+    a = boxtree::placeRect(p, a);
+    return Box(a.xl, a.yl, a.xr, a.yr);
+}
+
+static void placeCells(const SyntheticSpec &spec, std::mt19937 &rng,
+                       const std::vector<Master> &masters, SyntheticDesign &design,
+                       std::vector<LRect> &shapes, std::vector<LPlacement> &placements) {
+    int die = design.die.getURX();
+    int x = 0, row = 0;
+    for (int i = 0; i < spec.num_cells; i++) {
+        int m = rng() % masters.size();
+        const Master &master = masters[m];
+        x += (rng() % 3) * kBenchSite;
+        if (x + master.width > die) {
+            x = 0;
+            row++;
+        }
+        int orient = kRowOrient[row & 1];
+        // FS mirrors the cell below the row, so it is moved up a row height
+        int y = row * kBenchRow + (orient ? kBenchRow : 0);
+        ObjectId inst = 1 + i;
+        if (spec.instanced) {
+            LPlacement placement = {inst, kMasterBase + m, orient, x, y};
+            placements.push_back(placement);
+        } else {
+            for (unsigned int k = 0; k < master.shapes.size(); k++) {
+                LRect shape = master.shapes[k];
+                shape.rect_ = placeBox(shape.rect_, orient, x, y);
+                shape.owner_ = inst;
+                shapes.push_back(shape);
+            }
+        }
+        const Box pin = placeBox(master.shapes[0].rect_, orient, x, y);
+        design.pins.push_back(Point((pin.getLLX() + pin.getURX()) / 2,
+                                    (pin.getLLY() + pin.getURY()) / 2));
+        design.num_shapes += master.shapes.size();
+        x += master.width;
+    }
+}
+
+static LRect makeShape(int xl, int yl, int xr, int yr, int layer, ObjectId owner,
+                       ObjectId source, RQShapeKind kind) {
+    LRect shape;
+    shape.rect_ = Box(xl, yl, xr, yr);
+    shape.layer_id_ = layer;
+    shape.owner_ = owner;
+    shape.source_ = source;
+    shape.kind_ = kind;
+    return shape;
+}
+
+// wires run along the tracks of their layer, mostly short with a long tail
+static void makeRouting(const SyntheticSpec &spec, std::mt19937 &rng, SyntheticDesign &design,
+                        std::vector<LRect> &shapes) {
+    int die = design.die.getURX();
+    int tracks = die / kTrackPitch;
+    size_t first = shapes.size();
+    std::exponential_distribution<double> length(1.0 / 8000);
+    for (int i = 0; i < spec.num_wires; i++) {
+        int metal = 2 + rng() % (spec.num_metals - 1);
+        int track = (rng() % tracks) * kTrackPitch;
+        int from = rng() % die;
+        int to = std::min<long long>(die, from + 400 + (long long)length(rng));
+        ObjectId net = kNetBase + i / 8;
+        if (metal % 2 == 0) {
+            shapes.push_back(makeShape(from, track, to, track + kWireWidth, wireLayer(metal),
+                                       net, net, kRQShapeWire));
+        } else {
+            shapes.push_back(makeShape(track, from, track + kWireWidth, to, wireLayer(metal),
+                                       net, net, kRQShapeWire));
+        }
+    }
+    for (int i = 0; i < spec.num_vias; i++) {
+        int metal = 2 + rng() % (spec.num_metals - 1);
+        int x = rng() % (die - kCutSize), y = rng() % (die - kCutSize);
+        ObjectId net = kNetBase + rng() % (spec.num_wires / 8 + 1);
+        shapes.push_back(makeShape(x, y, x + kCutSize, y + kCutSize, cutLayer(metal), net, net,
+                                   kRQShapeVia));
+    }
+    int span = spec.via_array_size * kCutPitch;
+    for (int i = 0; i < spec.num_via_arrays; i++) {
+        int metal = 2 + rng() % (spec.num_metals - 1);
+        int x0 = rng() % (die - span), y0 = rng() % (die - span);
+        ObjectId net = kSpecialNetBase + i % 2;
+        for (int r = 0; r < spec.via_array_size; r++) {
+            for (int c = 0; c < spec.via_array_size; c++) {
+                int x = x0 + c * kCutPitch, y = y0 + r * kCutPitch;
+                shapes.push_back(makeShape(x, y, x + kCutSize, y + kCutSize, cutLayer(metal),
+                                           net, net, kRQShapeVia));
+            }
+        }
+    }
+    // VDD and VSS alternate over the two top metals
+    for (int metal = spec.num_metals - 1; metal <= spec.num_metals; metal++) {
+        for (int i = 0; i < spec.num_stripes; i++) {
+            int at = (int)((long long)die * (2 * i + 1) / (2 * spec.num_stripes));
+            ObjectId net = kSpecialNetBase + i % 2;
+            if (metal % 2 == 0) {
+                shapes.push_back(makeShape(0, at, die, at + kStripeWidth, wireLayer(metal), net,
+                                           net, kRQShapeWire));
+            } else {
+                shapes.push_back(makeShape(at, 0, at + kStripeWidth, die, wireLayer(metal), net,
+                                           net, kRQShapeWire));
+            }
+        }
+    }
+    design.num_shapes += shapes.size() - first;
+}
+
+// the chunks are contiguous runs, as an import would hand them over
+template <class T>
+static void splitChunks(std::vector<T> &items, int num_chunks,
+                        std::vector<std::vector<T> > &chunks) {
+    chunks.assign(num_chunks, std::vector<T>());
+    size_t per_chunk = (items.size() + num_chunks - 1) / num_chunks;
+    for (int i = 0; i < num_chunks; i++) {
+        size_t begin = std::min(items.size(), i * per_chunk);
+        size_t end = std::min(items.size(), begin + per_chunk);
+        chunks[i].assign(items.begin() + begin, items.begin() + end);
+    }
+    std::vector<T>().swap(items);
+}
+
+void buildSyntheticDesign(const SyntheticSpec &spec, int num_chunks, SyntheticDesign &design) {
+    std::mt19937 rng(spec.seed);
+    // rows at 70% utilization of a square die
+    double cell_area = (double)spec.num_cells * 11.5 * kBenchSite * kBenchRow;
+    int die = std::max(4 * kBenchRow, (int)sqrt(cell_area / 0.7));
+    design.die = Box(0, 0, die, die);
+    design.pins.clear();
+    design.num_shapes = 0;
+
+    std::vector<Master> masters;
+    makeMasters(spec, rng, masters);
+    std::vector<LRect> shapes;
+    std::vector<LPlacement> placements;
+    placeCells(spec, rng, masters, design, shapes, placements);
+    makeRouting(spec, rng, design, shapes);
+
+    splitChunks(shapes, num_chunks, design.chunks);
+    design.instances.cell_shapes_.clear();
+    if (spec.instanced) {
+        for (unsigned int m = 0; m < masters.size(); m++) {
+            design.instances.cell_shapes_.insert(design.instances.cell_shapes_.end(),
+                                                 masters[m].shapes.begin(),
+                                                 masters[m].shapes.end());
+        }
+    }
+    splitChunks(placements, num_chunks, design.instances.placements_);
+}
+
+}  // namespace db
+}  // namespace open_edi
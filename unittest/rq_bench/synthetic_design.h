@@ -0,0 +1,61 @@
+/* @file  synthetic_design.h
+ * @date  <date>
+ * @brief Synthetic designs for the rq benchmark
+ *
+ * Copyright (C) 2020 NIIC EDA
+ * All rights reserved.
+ *
+ * This software may be modified and distributed under the terms
+ * of the BSD license.  See the LICENSE file for details.
+ */
+#ifndef UNITTEST_RQ_BENCH_SYNTHETIC_DESIGN_H_
+#define UNITTEST_RQ_BENCH_SYNTHETIC_DESIGN_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "db/rq/data_model.h"
+
+namespace open_edi {
+namespace db {
+
+// A die of rows of standard cells under a routing stack. Layer 0 holds the
+// cell OBS, layer 1 the pins, layers 2 .. 2 * num_metals - 1 alternate
+// wires and vias: horizontal wires on even layers, vertical on odd ones,
+// vias of the metal below on the cut layer between.
+struct SyntheticSpec {
+    uint32_t seed;
+    int num_cells;       // instances, placed row by row
+    int num_masters;
+    int num_metals;
+    int num_wires;       // wire segments over all metal layers
+    int num_vias;        // single cuts
+    int num_via_arrays;  // arrays of via_array_size x via_array_size cuts
+    int via_array_size;
+    int num_stripes;     // power stripes spanning the die, per top two metals
+    // masters are kept once and placed per instance, see LInstances
+    bool instanced;
+};
+
+// site width and row height of the cell rows, in dbu
+const int kBenchSite = 200;
+const int kBenchRow = 2000;
+
+void defaultSyntheticSpec(SyntheticSpec &spec, double scale);
+
+struct SyntheticDesign {
+    std::vector<std::vector<LRect> > chunks;
+    LInstances instances;
+    Box die;
+    // pin centers, for windows and points that land where shapes are dense
+    std::vector<Point> pins;
+    uint64_t num_shapes;  // flattened, as a non-instanced build would index
+};
+
+void buildSyntheticDesign(const SyntheticSpec &spec, int num_chunks, SyntheticDesign &design);
+
+}  // namespace db
+}  // namespace open_edi
+
+#endif  // UNITTEST_RQ_BENCH_SYNTHETIC_DESIGN_H_